@@ -0,0 +1,435 @@
+
+/**
+ * bench
+ * microbenchmarks of the codec and the buffers on the hot path,
+ * `make bench` builds and runs them. each one reports ns/op and the heap
+ * allocations per op, the latter counted by the malloc() below.
+ * ./redisproxy_bench [filter] [scale]
+ **/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <string>
+#include <vector>
+
+#include "cmd.h"
+#include "recycle.h"
+
+extern "C" {
+void* __libc_malloc( std::size_t size );
+void* __libc_calloc( std::size_t n, std::size_t size );
+void* __libc_realloc( void* p, std::size_t size );
+void __libc_free( void* p );
+}
+
+static uint64_t gAllocs = 0;
+
+/**
+ * every allocation of the process goes by here, operator new included
+ **/
+extern "C" {
+void* malloc( std::size_t size ) { gAllocs++; return __libc_malloc( size ); }
+void* calloc( std::size_t n, std::size_t size ) { gAllocs++; return __libc_calloc( n, size ); }
+void* realloc( void* p, std::size_t size ) { gAllocs++; return __libc_realloc( p, size ); }
+void free( void* p ) { __libc_free( p ); }
+}
+
+namespace {
+
+typedef std::size_t (*BenchType)( int rounds );
+
+const char* gFilter = nullptr;
+int gScale = 1;
+uint64_t gSink = 0;
+
+double now() {
+    timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * one round to warm up, then the rounds counted.
+ * the bench returns the number of ops it has done.
+ **/
+void run( const char* name, BenchType bench, int rounds ) {
+    if ( gFilter != nullptr && strstr( name, gFilter ) == nullptr ) {
+        return;
+    }
+
+    bench( 1 );
+
+    rounds *= gScale;
+    uint64_t allocs = gAllocs;
+    double begin = now();
+    std::size_t ops = bench( rounds );
+    double secs = now() - begin;
+    allocs = gAllocs - allocs;
+
+    printf( "%-32s %10zu ops %12.1f ns/op %10.3f allocs/op\n", name, ops,
+        secs * 1e9 / ops, double(allocs) / ops );
+}
+
+/**
+ * the command mixes, as they come from clients
+ **/
+std::string bulk( const std::string& s ) {
+    char head[32];
+    snprintf( head, sizeof(head), "$%zu\r\n", s.size() );
+    return head + s + "\r\n";
+}
+
+std::string multibulk( const char* name, const std::string* args, std::size_t n ) {
+    char head[32];
+    snprintf( head, sizeof(head), "*%zu\r\n", n + 1 );
+
+    std::string s( head );
+    s += bulk( name );
+    for ( std::size_t i = 0; i < n; ++i ) {
+        s += bulk( args[i] );
+    }
+    return s;
+}
+
+std::string key( int i ) {
+    char k[32];
+    snprintf( k, sizeof(k), "key:%08d", i );
+    return k;
+}
+
+// 1000 requests, one SET to three GETs
+std::string smallRequests() {
+    std::string s;
+    for ( int i = 0; i < 1000; ++i ) {
+        std::string args[2] = { key(i), std::string( 16, 'v' ) };
+        s += i % 4 == 0 ? multibulk( "SET", args, 2 ) : multibulk( "GET", args, 1 );
+    }
+    return s;
+}
+
+std::string mgetRequest() {
+    std::string args[100];
+    for ( int i = 0; i < 100; ++i ) {
+        args[i] = key(i);
+    }
+    return multibulk( "MGET", args, 100 );
+}
+
+std::string largeRequest() {
+    std::string args[2] = { key(0), std::string( 1024 * 1024, 'v' ) };
+    return multibulk( "SET", args, 2 );
+}
+
+/**
+ * and the replies to them
+ **/
+std::string smallReplies() {
+    std::string s;
+    for ( int i = 0; i < 1000; ++i ) {
+        s += i % 4 == 0 ? "+OK\r\n" : bulk( std::string( 16, 'v' ) );
+    }
+    return s;
+}
+
+std::string mgetReply() {
+    std::string s( "*100\r\n" );
+    for ( int i = 0; i < 100; ++i ) {
+        s += i % 10 == 0 ? "$-1\r\n" : bulk( std::string( 16, 'v' ) );
+    }
+    return s;
+}
+
+std::string largeReply() {
+    return bulk( std::string( 1024 * 1024, 'v' ) );
+}
+
+/**
+ * feeds the stream to a parser chunk by chunk, the way the session reads
+ * it: the buffer is grown when short of room and every request parsed
+ * as soon as it is complete.
+ **/
+std::size_t feedRequests( const std::string& stream, std::size_t chunk, int rounds ) {
+    rp::CmdParser parser;
+    rp::Cmd cmd;
+    rp::Buffer* input = parser.GetInputBuffer();
+    std::size_t ops = 0;
+
+    for ( int r = 0; r < rounds; ++r ) {
+        for ( std::size_t off = 0; off < stream.size(); off += chunk ) {
+            std::size_t size = stream.size() - off < chunk ? stream.size() - off : chunk;
+            if ( input->FreeSize() < size ) {
+                input->AppendCapacity( size > 16 * 1024 ? size : 16 * 1024 );
+            }
+            input->Append( stream.data() + off, size );
+
+            rp::Error err;
+            while ( (err = parser.ParseRequest( &cmd )).None() ) {
+                gSink += cmd.GetArgSize();
+                ops++;
+                parser.Reset();
+                cmd.Reset();
+            }
+
+            if ( err != rp::Error::TryAgain ) {
+                printf( "ParseRequest failed:%s\n", err.String().c_str() );
+                exit( 1 );
+            }
+        }
+    }
+    return ops;
+}
+
+std::size_t feedReplies( const std::string& stream, std::size_t chunk, int rounds ) {
+    rp::CmdParser parser;
+    rp::Buffer* input = parser.GetInputBuffer();
+    std::size_t ops = 0;
+
+    for ( int r = 0; r < rounds; ++r ) {
+        for ( std::size_t off = 0; off < stream.size(); off += chunk ) {
+            std::size_t size = stream.size() - off < chunk ? stream.size() - off : chunk;
+            if ( input->FreeSize() < size ) {
+                input->AppendCapacity( size > 16 * 1024 ? size : 16 * 1024 );
+            }
+            input->Append( stream.data() + off, size );
+
+            rp::Buffer reply;
+            rp::Error err;
+            while ( (err = parser.ParseResponse( &reply )).None() ) {
+                gSink += reply.Size();
+                ops++;
+                reply = rp::Buffer();
+            }
+
+            if ( err != rp::Error::TryAgain ) {
+                printf( "ParseResponse failed:%s\n", err.String().c_str() );
+                exit( 1 );
+            }
+        }
+    }
+    return ops;
+}
+
+std::size_t parseSmall( int rounds ) {
+    static const std::string s = smallRequests();
+    return feedRequests( s, 16 * 1024, rounds );
+}
+
+std::size_t parseSmallSplit( int rounds ) {
+    static const std::string s = smallRequests();
+    return feedRequests( s, 7, rounds );
+}
+
+std::size_t parseMget( int rounds ) {
+    static const std::string s = mgetRequest();
+    return feedRequests( s, 16 * 1024, rounds );
+}
+
+std::size_t parseLarge( int rounds ) {
+    static const std::string s = largeRequest();
+    return feedRequests( s, 64 * 1024, rounds );
+}
+
+std::size_t replySmall( int rounds ) {
+    static const std::string s = smallReplies();
+    return feedReplies( s, 16 * 1024, rounds );
+}
+
+std::size_t replySmallSplit( int rounds ) {
+    static const std::string s = smallReplies();
+    return feedReplies( s, 7, rounds );
+}
+
+std::size_t replyMget( int rounds ) {
+    static const std::string s = mgetReply();
+    return feedReplies( s, 16 * 1024, rounds );
+}
+
+std::size_t replyLarge( int rounds ) {
+    static const std::string s = largeReply();
+    return feedReplies( s, 64 * 1024, rounds );
+}
+
+/**
+ * a request re-encoded, as the upstream does for changed args
+ **/
+std::size_t format( const rp::Cmd& cmd, int rounds ) {
+    for ( int r = 0; r < rounds; ++r ) {
+        rp::Buffer out;
+        cmd.FormatRESP2( &out );
+        gSink += out.Size();
+    }
+    return rounds;
+}
+
+std::size_t formatSet( int rounds ) {
+    rp::Cmd cmd;
+    std::string k = key(0), v( 16, 'v' );
+    cmd.AppendArg( "SET", 3 );
+    cmd.AppendArg( k.data(), k.size() );
+    cmd.AppendArg( v.data(), v.size() );
+    return format( cmd, rounds );
+}
+
+std::size_t formatMget( int rounds ) {
+    rp::Cmd cmd;
+    cmd.AppendArg( "MGET", 4 );
+    for ( int i = 0; i < 100; ++i ) {
+        std::string k = key(i);
+        cmd.AppendArg( k.data(), k.size() );
+    }
+    return format( cmd, rounds );
+}
+
+/**
+ * a buffer filled by small appends up to 64KB, then let go
+ **/
+std::size_t bufferAppend( int rounds ) {
+    char chunk[64];
+    memset( chunk, 'x', sizeof(chunk) );
+
+    std::size_t ops = 0;
+    for ( int r = 0; r < rounds; ++r ) {
+        rp::Buffer b;
+        for ( int i = 0; i < 1024; ++i ) {
+            b.Append( chunk, sizeof(chunk) );
+            ops++;
+        }
+        gSink += b.Size();
+    }
+    return ops;
+}
+
+/**
+ * room made ahead of reads, as the sessions do
+ **/
+std::size_t bufferAppendCapacity( int rounds ) {
+    char chunk[1024];
+    memset( chunk, 'x', sizeof(chunk) );
+
+    std::size_t ops = 0;
+    for ( int r = 0; r < rounds; ++r ) {
+        rp::Buffer b;
+        for ( int i = 0; i < 256; ++i ) {
+            if ( b.FreeSize() < sizeof(chunk) ) {
+                b.AppendCapacity( 16 * 1024 );
+            }
+            b.Append( chunk, sizeof(chunk) );
+            // what was read is consumed
+            b.Offset( int32_t(sizeof(chunk)) );
+            ops++;
+        }
+        gSink += b.Capacity();
+    }
+    return ops;
+}
+
+/**
+ * slices handed out of an input buffer
+ **/
+std::size_t bufferSlice( int rounds ) {
+    rp::Buffer input;
+    input.AppendCapacity( 64 * 1024 );
+    input.AppendSize( 64 * 1024 );
+
+    std::size_t ops = 0;
+    for ( int r = 0; r < rounds; ++r ) {
+        for ( std::size_t off = 0; off < input.Size(); off += 64 ) {
+            rp::Buffer slice;
+            slice.Append( input, off, 64 );
+            gSink += slice.Size();
+            ops++;
+        }
+    }
+    return ops;
+}
+
+/**
+ * inline requests tokenized by the reader, as InlineParser does
+ **/
+std::size_t readerScan( int rounds ) {
+    static std::string s;
+    if ( s.empty() ) {
+        for ( int i = 0; i < 1000; ++i ) {
+            s += "set " + key(i) + " " + std::string( 16 + i % 100, 'v' ) + "\r\n";
+        }
+    }
+
+    rp::Buffer input( s.data(), s.size() );
+    std::vector<char> split;
+    split.push_back( ' ' );
+    split.push_back( '\n' );
+
+    std::size_t ops = 0;
+    for ( int r = 0; r < rounds; ++r ) {
+        rp::BufferReader br( input );
+        rp::Buffer token;
+        while ( br.ReadUntil( &token, split ).None() ) {
+            gSink += token.Size();
+            token = rp::Buffer();
+            br.Next();
+            ops++;
+        }
+    }
+    return ops;
+}
+
+/**
+ * the cmd queue of an upstream, requests pushed and their replies popped
+ **/
+struct Pair {
+    uint64_t identity;
+    void*   reader;
+};
+
+std::size_t recyclePushPop( int rounds ) {
+    rp::Recycle<Pair> queue( 1024 );
+    Pair pair = { 1, nullptr };
+
+    std::size_t ops = 0;
+    for ( int r = 0; r < rounds; ++r ) {
+        for ( int i = 0; i < 64; ++i ) {
+            pair.identity = i;
+            queue.Push( pair );
+        }
+        while ( queue.Pop( &pair ).None() ) {
+            gSink += pair.identity;
+            ops++;
+        }
+    }
+    return ops;
+}
+
+}
+
+int main( int argc, char** argv ) {
+    if ( argc > 1 ) {
+        gFilter = argv[1];
+    }
+    if ( argc > 2 ) {
+        gScale = atoi( argv[2] ) > 0 ? atoi( argv[2] ) : 1;
+    }
+
+    run( "ParseRequest/small", parseSmall, 200 );
+    run( "ParseRequest/small-split", parseSmallSplit, 50 );
+    run( "ParseRequest/mget100", parseMget, 20000 );
+    run( "ParseRequest/1MB", parseLarge, 200 );
+
+    run( "ParseResponse/small", replySmall, 200 );
+    run( "ParseResponse/small-split", replySmallSplit, 50 );
+    run( "ParseResponse/mget100", replyMget, 20000 );
+    run( "ParseResponse/1MB", replyLarge, 200 );
+
+    run( "FormatRESP2/set", formatSet, 500000 );
+    run( "FormatRESP2/mget100", formatMget, 20000 );
+
+    run( "Buffer/Append", bufferAppend, 2000 );
+    run( "Buffer/AppendCapacity", bufferAppendCapacity, 2000 );
+    run( "Buffer/slice", bufferSlice, 2000 );
+
+    run( "BufferReader/ReadUntil", readerScan, 200 );
+
+    run( "Recycle/push-pop", recyclePushPop, 20000 );
+
+    return gSink == 0;
+}
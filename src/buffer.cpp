@@ -104,7 +104,7 @@ Error Buffer::AppendCapacity( std::size_t size ) {
     if ( needCapacity > capacity ) {
         if (data_ != nullptr) {
             if ( mem::GetRefCount(data_) == 1 && offset_ >= needCapacity - capacity ) {
-                memcpy( data_, Data(), Size() );
+                memmove( data_, Data(), Size() );
 
                 needCapacity -= offset_;
                 size_ -= offset_;
@@ -121,6 +121,8 @@ Error Buffer::AppendCapacity( std::size_t size ) {
 
                 mem::DescRef( data_ );
                 data_ = data;
+
+                needCapacity -= offset_;
                 size_ -= offset_;
                 offset_ = 0;
             }
@@ -162,6 +164,32 @@ Error Buffer::Append( const Buffer& buffer, std::size_t size ) {
     return Error::OK;
 }
 
+Error Buffer::Append( const Buffer& buffer, std::size_t start, std::size_t size ) {
+    if ( start + size > buffer.Size() ) {
+        return Error::OutOfBound;
+    }
+
+    if ( size == 0 ) {
+        return Error::OK;
+    }
+
+    std::size_t from = buffer.offset_ + start;
+    if ( data_ == nullptr ) {
+        data_ = const_cast<mem::RefType>( buffer.data_ );
+        mem::IncrRef( data_ );
+
+        offset_ = from;
+        size_ = from + size;
+    } else if ( data_ == buffer.data_ && size_ == from ) {
+        // right behind what this one holds
+        size_ += size;
+    } else {
+        return Append( buffer.Data() + start, size );
+    }
+
+    return Error::OK;
+}
+
 Error Buffer::Append( const char* data, std::size_t size ) {
     std::size_t needCapacity = size + size_;
     std::size_t capacity = Capacity();
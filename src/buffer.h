@@ -13,6 +13,14 @@ public:
     Buffer();
     Buffer( const Buffer& b );
     Buffer( const char* data, std::size_t size );
+    /**
+     * moving hands over the reference as it is, no count is touched
+     **/
+    Buffer( Buffer&& b ) : data_(b.data_), size_(b.size_), offset_(b.offset_) {
+        b.data_ = nullptr;
+        b.size_ = 0;
+        b.offset_ = 0;
+    }
 
     ~Buffer();
 
@@ -21,6 +29,22 @@ public:
 
 public:
     Buffer& operator= ( const Buffer& );
+    Buffer& operator= ( Buffer&& b ) {
+        if ( this != &b ) {
+            if ( data_ != nullptr ) {
+                mem::DescRef( data_ );
+            }
+
+            data_ = b.data_;
+            size_ = b.size_;
+            offset_ = b.offset_;
+
+            b.data_ = nullptr;
+            b.size_ = 0;
+            b.offset_ = 0;
+        }
+        return *this;
+    }
     char operator[] ( std::size_t index ) const {
         if ( index >= Size() ) {
             throw Error::OutOfBound;
@@ -37,6 +61,7 @@ public:
 
 public:
     bool Empty() const { return Size() == 0; }
+    bool Shared() const { return data_ != nullptr && mem::GetRefCount(data_) > 1; }
     std::size_t Size() const { return size_ - offset_; }
     std::size_t Offset() const { return offset_; }
 
@@ -56,6 +81,10 @@ public:
      * 
      **/
     Error Append( const Buffer& buffer, std::size_t size = 0 );
+    /**
+     * shares [start, start + size) of buffer, an empty range appends nothing
+     **/
+    Error Append( const Buffer& buffer, std::size_t start, std::size_t size );
     Error Append( const char* data, std::size_t size );
     Error AppendCapacity( std::size_t size );
     Error AppendSize( std::size_t size );
@@ -66,6 +95,25 @@ private:
     std::size_t offset_;
 };
 
+/**
+ * Slice
+ * a view of bytes a Buffer holds, good as long as that one is around
+ **/
+class Slice {
+public:
+    Slice() : data_(nullptr), size_(0) {}
+    Slice( const char* data, std::size_t size ) : data_(data), size_(size) {}
+
+public:
+    const char* Data() const { return data_; }
+    std::size_t Size() const { return size_; }
+    bool Empty() const { return size_ == 0; }
+
+private:
+    const char* data_;
+    std::size_t size_;
+};
+
 }
 
 #endif
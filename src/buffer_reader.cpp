@@ -2,6 +2,7 @@
 #include <string.h>
 
 #include "buffer_reader.h"
+#include "scan.h"
 
 namespace rp {
 
@@ -15,19 +16,30 @@ bool BufferReader::Eof() const {
 }
 
 Error BufferReader::ReadUntil( Buffer* buffer, const char& ch, int extend ) {
-    if ( Eof() ) { return Error::OutOfBound; }
+    return readUntil( buffer, &ch, 1, extend );
+}
+
+Error BufferReader::ReadUntil( Buffer* buffer, const std::vector<char>& chs, int extend ) {
+    if ( chs.empty() ) { return Error::NotFound; }
+    return readUntil( buffer, &chs[0], int(chs.size()), extend );
+}
 
-    Buffer tmpBuffer( buffer_ );
-    tmpBuffer.Offset( offset_ );
+/**
+ * readUntil
+ * scans the rest for the first byte of the set in a single pass
+ * and hands out the slice without copying the data.
+ **/
+Error BufferReader::readUntil( Buffer* buffer, const char* set, int nset, int extend ) {
+    if ( Eof() ) { return Error::OutOfBound; }
 
-    const char* data = tmpBuffer.Data();
-    const char* pch = (const char *)memchr( data, ch, tmpBuffer.Size() );
-    if ( pch == NULL ) {
+    const char* data = buffer_.Data() + offset_;
+    const char* pch = scan::FindFirstOf( data, buffer_.Size() - offset_, set, nset );
+    if ( pch == nullptr ) {
         return Error::NotFound;
     }
-    
+
     std::size_t offset = pch - data + extend;
-    Error err = buffer->Append( tmpBuffer, offset );
+    Error err = buffer->Append( buffer_, offset_, offset );
     if ( !err.None() ) {
         return err;
     }
@@ -36,48 +48,6 @@ Error BufferReader::ReadUntil( Buffer* buffer, const char& ch, int extend ) {
     return Error::OK;
 }
 
-Error BufferReader::ReadUntil( Buffer* buffer, const std::vector<char>& chs, int extend ) {
-    if ( Eof() ) { return Error::OutOfBound; }
-
-    Buffer tmpBuffer( buffer_ );
-    tmpBuffer.Offset( offset_ );
-
-    const char* data = tmpBuffer.Data();
-
-    for ( std::size_t i = 0; i < chs.size(); ++i ) {
-        const char* pch = (const char *)memchr( data, chs[i], tmpBuffer.Size() );
-        if ( pch != NULL ) {
-            std::size_t offset = pch - data + extend;
-            Error err = buffer->Append( tmpBuffer, offset );
-            if ( !err.None() ) {
-                return err;
-            }
-
-            offset_ += offset;
-            return Error::OK;
-        }
-    }
-
-    /**
-    for ( std::size_t i = 0; i < length; i++ ) {
-        for ( std::vector<char>::const_iterator it = chs.begin(); it != chs.end(); it++ ) {
-            if ( tmpBuffer[i] == *it ) {
-                std::size_t offset = i + extend;
-                Error err = buffer->Append( data, offset );
-                if ( !err.None() ) {
-                    return err;
-                }
-
-                offset_ += offset;
-                return Error::OK;
-            }
-        }
-    }
-    */
-
-    return Error::NotFound;
-}
-
 Error BufferReader::Read( Buffer* buffer, const std::size_t& length ) {
     if ( Eof() ) { return Error::OutOfBound; }
 
@@ -86,10 +56,7 @@ Error BufferReader::Read( Buffer* buffer, const std::size_t& length ) {
         return Error::OutOfBound;
     }
 
-    Buffer tmpBuffer( buffer_ );
-    tmpBuffer.Offset( offset_ );
-    
-    Error err = buffer->Append( tmpBuffer, length );
+    Error err = buffer->Append( buffer_, offset_, length );
     if ( !err.None() ) {
         return err;
     }
@@ -28,11 +28,21 @@ public:
     const char Current() const;
     const char Last() const; 
 
+public:
+    /**
+     * the part not read yet
+     **/
+    const char* Data() const { return buffer_.Data() + offset_; }
+    std::size_t Left() const { return Eof() ? 0 : buffer_.Size() - offset_; }
+
 public:
     bool Eof() const;
     std::size_t Offset() const { return offset_; }
     void Reset() { offset_ = 0; }
 
+private:
+    Error readUntil( Buffer* buffer, const char* set, int nset, int extend );
+
 private:
     const Buffer& buffer_;
     std::size_t offset_;
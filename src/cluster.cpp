@@ -0,0 +1,365 @@
+
+#include <string.h>
+#include <stdlib.h>
+#include <functional>
+
+#include "cluster.h"
+#include "fanout.h"
+#include "metric.h"
+
+namespace rp {
+
+/**
+ * crc16Table
+ * CRC16-CCITT (XMODEM), polynomial 0x1021 with a zero start,
+ * one step of a byte at a time.
+ **/
+static const uint16_t crc16Table[256] = {
+    0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50a5, 0x60c6, 0x70e7,
+    0x8108, 0x9129, 0xa14a, 0xb16b, 0xc18c, 0xd1ad, 0xe1ce, 0xf1ef,
+    0x1231, 0x0210, 0x3273, 0x2252, 0x52b5, 0x4294, 0x72f7, 0x62d6,
+    0x9339, 0x8318, 0xb37b, 0xa35a, 0xd3bd, 0xc39c, 0xf3ff, 0xe3de,
+    0x2462, 0x3443, 0x0420, 0x1401, 0x64e6, 0x74c7, 0x44a4, 0x5485,
+    0xa56a, 0xb54b, 0x8528, 0x9509, 0xe5ee, 0xf5cf, 0xc5ac, 0xd58d,
+    0x3653, 0x2672, 0x1611, 0x0630, 0x76d7, 0x66f6, 0x5695, 0x46b4,
+    0xb75b, 0xa77a, 0x9719, 0x8738, 0xf7df, 0xe7fe, 0xd79d, 0xc7bc,
+    0x48c4, 0x58e5, 0x6886, 0x78a7, 0x0840, 0x1861, 0x2802, 0x3823,
+    0xc9cc, 0xd9ed, 0xe98e, 0xf9af, 0x8948, 0x9969, 0xa90a, 0xb92b,
+    0x5af5, 0x4ad4, 0x7ab7, 0x6a96, 0x1a71, 0x0a50, 0x3a33, 0x2a12,
+    0xdbfd, 0xcbdc, 0xfbbf, 0xeb9e, 0x9b79, 0x8b58, 0xbb3b, 0xab1a,
+    0x6ca6, 0x7c87, 0x4ce4, 0x5cc5, 0x2c22, 0x3c03, 0x0c60, 0x1c41,
+    0xedae, 0xfd8f, 0xcdec, 0xddcd, 0xad2a, 0xbd0b, 0x8d68, 0x9d49,
+    0x7e97, 0x6eb6, 0x5ed5, 0x4ef4, 0x3e13, 0x2e32, 0x1e51, 0x0e70,
+    0xff9f, 0xefbe, 0xdfdd, 0xcffc, 0xbf1b, 0xaf3a, 0x9f59, 0x8f78,
+    0x9188, 0x81a9, 0xb1ca, 0xa1eb, 0xd10c, 0xc12d, 0xf14e, 0xe16f,
+    0x1080, 0x00a1, 0x30c2, 0x20e3, 0x5004, 0x4025, 0x7046, 0x6067,
+    0x83b9, 0x9398, 0xa3fb, 0xb3da, 0xc33d, 0xd31c, 0xe37f, 0xf35e,
+    0x02b1, 0x1290, 0x22f3, 0x32d2, 0x4235, 0x5214, 0x6277, 0x7256,
+    0xb5ea, 0xa5cb, 0x95a8, 0x8589, 0xf56e, 0xe54f, 0xd52c, 0xc50d,
+    0x34e2, 0x24c3, 0x14a0, 0x0481, 0x7466, 0x6447, 0x5424, 0x4405,
+    0xa7db, 0xb7fa, 0x8799, 0x97b8, 0xe75f, 0xf77e, 0xc71d, 0xd73c,
+    0x26d3, 0x36f2, 0x0691, 0x16b0, 0x6657, 0x7676, 0x4615, 0x5634,
+    0xd94c, 0xc96d, 0xf90e, 0xe92f, 0x99c8, 0x89e9, 0xb98a, 0xa9ab,
+    0x5844, 0x4865, 0x7806, 0x6827, 0x18c0, 0x08e1, 0x3882, 0x28a3,
+    0xcb7d, 0xdb5c, 0xeb3f, 0xfb1e, 0x8bf9, 0x9bd8, 0xabbb, 0xbb9a,
+    0x4a75, 0x5a54, 0x6a37, 0x7a16, 0x0af1, 0x1ad0, 0x2ab3, 0x3a92,
+    0xfd2e, 0xed0f, 0xdd6c, 0xcd4d, 0xbdaa, 0xad8b, 0x9de8, 0x8dc9,
+    0x7c26, 0x6c07, 0x5c64, 0x4c45, 0x3ca2, 0x2c83, 0x1ce0, 0x0cc1,
+    0xef1f, 0xff3e, 0xcf5d, 0xdf7c, 0xaf9b, 0xbfba, 0x8fd9, 0x9ff8,
+    0x6e17, 0x7e36, 0x4e55, 0x5e74, 0x2e93, 0x3eb2, 0x0ed1, 0x1ef0,
+};
+
+static uint16_t crc16( const char* data, std::size_t size ) {
+    uint16_t crc = 0;
+    for ( std::size_t i = 0; i < size; ++i ) {
+        crc = (crc << 8) ^ crc16Table[((crc >> 8) ^ (uint8_t)data[i]) & 0xff];
+    }
+    return crc;
+}
+
+uint16_t KeySlot( const char* key, std::size_t size ) {
+    Slice tag = HashTag( key, size );
+    return crc16( tag.Data(), tag.Size() ) & (CLUSTER_SLOTS - 1);
+}
+
+static int slotBucket( const void* ctx, const char* key, std::size_t size ) {
+    return KeySlot( key, size );
+}
+
+int CmdSlot( const Cmd& cmd ) {
+    return KeysBucket( cmd, slotBucket, nullptr );
+}
+
+Error Cluster::Init() {
+    using namespace std::placeholders;
+
+    memset( slots_, 0, sizeof(slots_) );
+
+    std::string sources;
+    std::string password;
+    int protocol = 2;
+    if ( opt_.ClusterMode ) {
+        sources = opt_.ClusterOpt->Seeds;
+        password = opt_.ClusterOpt->Password;
+        protocol = opt_.ClusterOpt->Protocol;
+    } else {
+        sources = opt_.SingularOpt->UpstreamHost + ":" + std::to_string( opt_.SingularOpt->UpstreamPort );
+        password = opt_.SingularOpt->Password;
+        protocol = opt_.SingularOpt->Protocol;
+    }
+
+    Error err = sources_.Init( sources, password, protocol,
+        std::bind( &Cluster::onSlots, this, _1 ), std::bind( &Cluster::onRedirect, this, _1, _2, _3 ) );
+    if ( !err.None() ) {
+        return err;
+    }
+
+    if ( opt_.ClusterMode ) {
+        sources_.OnClosed( std::bind( &Cluster::onClosed, this, _1 ) );
+        sources_.RefreshEvery( opt_.ClusterOpt->RefreshPeriod );
+        sources_.Refresh();
+    }
+    return Error::OK;
+}
+
+bool Cluster::onSlots( const std::vector<SlotRange>& ranges ) {
+    bool complete = true;
+
+    memset( slots_, 0, sizeof(slots_) );
+    for ( std::size_t i = 0; i < ranges.size(); ++i ) {
+        const SlotRange& range = ranges[i];
+
+        std::size_t index = 0;
+        Error err = sources_.AddNode( range.host, range.port, &index );
+        // the index + 1 is kept in uint16_t
+        if ( err.None() && index >= 0xffff ) {
+            err = Error::Exhausted;
+        }
+        if ( !err.None() ) {
+            LogErrorf( "cluster node %s:%d left out:%s", range.host.c_str(), range.port, err.String().c_str() );
+            complete = false;
+            continue;
+        }
+
+        for ( int slot = range.first; slot <= range.last; ++slot ) {
+            slots_[slot] = index + 1;
+        }
+    }
+
+    return complete;
+}
+
+/**
+ * onClosed
+ * a master lost may be failed over, a replica serves its slots then
+ **/
+void Cluster::onClosed( Upstream* upstream ) {
+    sources_.Refresh();
+}
+
+/**
+ * onRedirect
+ * "-MOVED <slot> <host>:<port>" or "-ASK ...". an empty host is the one of
+ * the node which redirected. the reply goes to the client when the request
+ * can not be sent on right away.
+ **/
+bool Cluster::onRedirect( Upstream* upstream, const Buffer& reply, const Redirection& redirection ) {
+    if ( redirection.hops >= CLUSTER_MAX_REDIRECTS ) {
+        MetricFactoryInstance->FetchTimeSum( "cluster_redirect_loop" )->Inc();
+        return false;
+    }
+
+    bool moved = reply.Data()[1] == 'M';
+    const char* p = reply.Data() + (moved ? 7 : 5);
+    const char* end = reply.Data() + reply.Size();
+
+    char* next = nullptr;
+    long slot = strtol( p, &next, 10 );
+    if ( next == p || *next != ' ' || slot < 0 || slot >= CLUSTER_SLOTS ) {
+        return false;
+    }
+
+    const char* addr = next + 1;
+    const char* cr = (const char *)memchr( addr, '\r', end - addr );
+    if ( cr == nullptr ) {
+        return false;
+    }
+
+    const char* colon = cr;
+    while ( colon > addr && *colon != ':' ) {
+        colon--;
+    }
+    if ( *colon != ':' ) {
+        return false;
+    }
+
+    std::string host( addr, colon - addr );
+    int port = atoi( colon + 1 );
+    if ( host.empty() ) {
+        for ( std::size_t i = 0; i < sources_.Size(); ++i ) {
+            if ( sources_.Get( i )->Owns( upstream ) ) {
+                host = sources_.Host( i );
+                break;
+            }
+        }
+    }
+
+    std::size_t index = 0;
+    Error err = sources_.AddNode( host, port, &index );
+    if ( !err.None() || index >= 0xffff ) {
+        return false;
+    }
+
+    if ( moved ) {
+        MetricFactoryInstance->FetchTimeSum( "cluster_moved" )->Inc();
+        slots_[slot] = index + 1;
+        // the slots are moving, the others may have too
+        sources_.Refresh();
+    } else {
+        MetricFactoryInstance->FetchTimeSum( "cluster_ask" )->Inc();
+    }
+
+    Redirection resent = redirection;
+    resent.hops++;
+    return sources_.Get( index )->Resend( resent, !moved ).None();
+}
+
+/**
+ * backendOf
+ * the master of slot. a slot not known, or none, goes to a master which is
+ * up in cluster mode, since it redirects the ones it does not own. a master
+ * which is down has the slots asked for, it may have been replaced.
+ **/
+Backend* Cluster::backendOf( int slot ) {
+    if ( slot >= 0 && slots_[slot] != 0 ) {
+        Backend* backend = sources_.Get( slots_[slot] - 1 );
+        if ( opt_.ClusterMode && !backend->IsAcceptable() ) {
+            sources_.Refresh();
+        }
+        return backend;
+    }
+
+    if ( !opt_.ClusterMode ) {
+        return sources_.Get( 0 );
+    }
+
+    for ( std::size_t i = 0; i < sources_.Size(); ++i ) {
+        if ( sources_.Get( i )->IsAcceptable() ) {
+            return sources_.Get( i );
+        }
+    }
+    return nullptr;
+}
+
+Error Cluster::PushRequest( const Cmd& cmd, UpstreamReader* reader, uint64_t tag ) {
+    int slot = CmdSlot( cmd );
+    if ( slot == KEYS_UNSEEN && opt_.ClusterMode ) {
+        return Error::KeysUnseen;
+    }
+    // a singular upstream tells about it by itself when it is a cluster node
+    if ( slot == KEYS_CROSS && opt_.ClusterMode ) {
+        // a part for each slot, the server refuses keys of two in one cmd
+        using namespace std::placeholders;
+        return FanOut::Push( cmd, slotBucket, nullptr, std::bind( &Cluster::backendOf, this, _1 ), reader, tag );
+    }
+
+    // fail fast while the master is down
+    Backend* backend = backendOf( slot );
+    if ( backend == nullptr || !backend->IsAcceptable() ) {
+        return Error::Closed;
+    }
+
+    return backend->PushRequest( cmd, reader, tag );
+}
+
+Error Cluster::PushStream( const Buffer& chunk, bool last, UpstreamReader* reader ) {
+    for ( std::size_t i = 0; i < sources_.Size(); ++i ) {
+        Error err = sources_.Get( i )->PushStream( chunk, last, reader );
+        if ( err != Error::Closed ) {
+            return err;
+        }
+    }
+
+    return Error::Closed;
+}
+
+void Cluster::Forget( UpstreamReader* reader ) {
+    for ( std::size_t i = 0; i < sources_.Size(); ++i ) {
+        sources_.Get( i )->Forget( reader );
+    }
+}
+
+}
+
+#ifdef RP_CLUSTER_TEST
+#include <stdio.h>
+
+static bool parsed( const char* name, const char* reply, const char* expected ) {
+    std::vector<rp::SlotRange> ranges;
+    rp::Error err = rp::ParseClusterSlots( rp::Buffer( reply, strlen(reply) ), &ranges );
+
+    std::string got;
+    if ( !err.None() ) {
+        got = "error";
+    }
+    for ( std::size_t i = 0; i < ranges.size() && err.None(); ++i ) {
+        char range[128];
+        snprintf( range, sizeof(range), "%s%d-%d:%s:%d", i > 0 ? "," : "",
+            ranges[i].first, ranges[i].last, ranges[i].host.c_str(), ranges[i].port );
+        got += range;
+    }
+
+    bool ok = got == expected;
+    printf( "%s %s%s%s\n", name, ok ? "ok" : "got ", ok ? "" : got.c_str(), ok ? "" : (std::string(" expected ") + expected).c_str() );
+    return ok;
+}
+
+int main() {
+    int failed = 0;
+
+    // 3.0, a node is "host port"
+    failed += !parsed( "two fields",
+        "*1\r\n*3\r\n:0\r\n:16383\r\n*2\r\n$9\r\n127.0.0.1\r\n:7000\r\n",
+        "0-16383:127.0.0.1:7000" );
+    // 4.0 to 6.x, "host port id", with a replica
+    failed += !parsed( "three fields",
+        "*2\r\n"
+        "*4\r\n:0\r\n:5460\r\n*3\r\n$8\r\n10.0.0.1\r\n:7000\r\n$4\r\nid-a\r\n*3\r\n$8\r\n10.0.0.4\r\n:7003\r\n$4\r\nid-d\r\n"
+        "*3\r\n:5461\r\n:16383\r\n*3\r\n$8\r\n10.0.0.2\r\n:7001\r\n$4\r\nid-b\r\n",
+        "0-5460:10.0.0.1:7000,5461-16383:10.0.0.2:7001" );
+    // 7.0, the metadata of the node comes fourth
+    failed += !parsed( "four fields",
+        "*1\r\n*3\r\n:0\r\n:16383\r\n*4\r\n$8\r\n10.0.0.1\r\n:7000\r\n$4\r\nid-a\r\n"
+        "*2\r\n$8\r\nhostname\r\n$5\r\nnode1\r\n",
+        "0-16383:10.0.0.1:7000" );
+    failed += !parsed( "five fields",
+        "*1\r\n*3\r\n:10\r\n:20\r\n*5\r\n$8\r\n10.0.0.1\r\n:7000\r\n$4\r\nid-a\r\n*0\r\n$-1\r\n",
+        "10-20:10.0.0.1:7000" );
+    // the node asked stands for "?"
+    failed += !parsed( "unknown host",
+        "*1\r\n*3\r\n:0\r\n:16383\r\n*3\r\n$1\r\n?\r\n:7000\r\n$4\r\nid-a\r\n",
+        "0-16383::7000" );
+    failed += !parsed( "no slots", "*0\r\n", "" );
+
+    failed += !parsed( "not an array", "-ERR This instance has cluster support disabled\r\n", "error" );
+    failed += !parsed( "short entry", "*1\r\n*2\r\n:0\r\n:16383\r\n", "error" );
+    failed += !parsed( "short node", "*1\r\n*3\r\n:0\r\n:16383\r\n*1\r\n$8\r\n10.0.0.1\r\n", "error" );
+    failed += !parsed( "string port", "*1\r\n*3\r\n:0\r\n:16383\r\n*2\r\n$8\r\n10.0.0.1\r\n$4\r\n7000\r\n", "error" );
+    failed += !parsed( "reversed", "*1\r\n*3\r\n:9\r\n:8\r\n*2\r\n$8\r\n10.0.0.1\r\n:7000\r\n", "error" );
+    failed += !parsed( "past the slots", "*1\r\n*3\r\n:0\r\n:16384\r\n*2\r\n$8\r\n10.0.0.1\r\n:7000\r\n", "error" );
+    failed += !parsed( "long host", "*1\r\n*3\r\n:0\r\n:1\r\n*2\r\n$80\r\n10.0.0.1\r\n:7000\r\n", "error" );
+
+    // every cut of a good reply is refused, not read past its end
+    const char* good = "*1\r\n*4\r\n:0\r\n:16383\r\n*4\r\n$8\r\n10.0.0.1\r\n:7000\r\n$4\r\nid-a\r\n"
+        "*2\r\n$8\r\nhostname\r\n$5\r\nnode1\r\n*3\r\n$8\r\n10.0.0.4\r\n:7003\r\n$4\r\nid-d\r\n";
+    int cuts = 0;
+    for ( std::size_t size = 0; size < strlen(good); ++size ) {
+        std::vector<rp::SlotRange> ranges;
+        if ( rp::ParseClusterSlots( rp::Buffer( good, size ), &ranges ).None() ) {
+            printf( "cut at %zu parsed\n", size );
+            cuts++;
+        }
+    }
+    printf( "truncated %s\n", cuts == 0 ? "ok" : "failed" );
+    failed += cuts;
+
+    static const struct {
+        const char* key;
+        uint16_t slot;
+    } slots[] = {
+        { "123456789", 12739 }, { "{user1000}.following", 3443 }, { "{user1000}.followers", 3443 },
+        { "foo{}{bar}", 8363 }, { "foo{{bar}}zap", 4015 }, { "foo{bar}{zap}", 5061 }, { "", 0 },
+    };
+    for ( std::size_t i = 0; i < sizeof(slots) / sizeof(slots[0]); ++i ) {
+        uint16_t slot = rp::KeySlot( slots[i].key, strlen(slots[i].key) );
+        printf( "slot(\"%s\") %s", slots[i].key, slot == slots[i].slot ? "ok\n" : "" );
+        if ( slot != slots[i].slot ) {
+            printf( "%u expected %u\n", slot, slots[i].slot );
+            failed++;
+        }
+    }
+
+    printf( "%d failed\n", failed );
+    return failed == 0 ? 0 : 1;
+}
+#endif
@@ -0,0 +1,76 @@
+#ifndef __RP_CLUSTER_H__
+#define __RP_CLUSTER_H__
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "upstream.h"
+#include "sourcemgr.h"
+#include "keys.h"
+
+namespace rp {
+
+/**
+ * KeySlot
+ * the slot of a key as redis cluster computes it, CRC16 (XMODEM) of the key
+ * modulo 16384. when the key has a non-empty "{tag}", only the tag is hashed.
+ **/
+uint16_t KeySlot( const char* key, std::size_t size );
+
+/**
+ * CmdSlot
+ * the slot all the keys of cmd are in, see KeysBucket()
+ **/
+int CmdSlot( const Cmd& cmd );
+
+/**
+ * a request is redirected that many times at most,
+ * the reply of the last is the client's then.
+ **/
+#define CLUSTER_MAX_REDIRECTS   5
+
+/**
+ * Cluster
+ * routes the cmds to the master of their slot. the slot map is loaded from
+ * CLUSTER SLOTS and corrected by every -MOVED on the way, which is followed
+ * like -ASK by sending the request again to the node it names.
+ *
+ * in cluster mode the keyless cmds go to any master which is up, the
+ * multi-key ones with keys in several slots are split, see FanOut. the map
+ * is also asked for when a node is lost, and every RefreshPeriod. on a
+ * singular upstream the map is only learned from the redirections, the
+ * upstream takes everything else and a refresh waits for the first -MOVED.
+ **/
+class Cluster {
+public:
+    Cluster( const ProxyOptions& opt, ConnectionPool* pool ) :
+        opt_(opt), sources_(opt, pool) {}
+
+public:
+    Error Init();
+
+public:
+    Error PushRequest( const Cmd& cmd, UpstreamReader* reader, uint64_t tag );
+    Error PushStream( const Buffer& chunk, bool last, UpstreamReader* reader );
+    void Forget( UpstreamReader* reader );
+
+private:
+    Backend* backendOf( int slot );
+    bool onSlots( const std::vector<SlotRange>& ranges );
+    void onClosed( Upstream* upstream );
+    bool onRedirect( Upstream* upstream, const Buffer& reply, const Redirection& redirection );
+
+private:
+    const ProxyOptions& opt_;
+    SourceManager   sources_;
+
+    /**
+     * index + 1 of the master of each slot in sources_, 0 when not known
+     **/
+    uint16_t    slots_[CLUSTER_SLOTS];
+};
+
+}
+
+#endif
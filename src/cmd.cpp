@@ -1,10 +1,10 @@
 
 #include <stdio.h>
+#include <string.h>
 #include <assert.h>
-#include <sstream>
 
 #include "cmd.h"
-#include "utils.h"
+#include "scan.h"
 
 namespace rp { namespace impl {
 
@@ -16,15 +16,6 @@ struct __init { __init() {
 }} __init;
 
 
-Error InlineParser::HandleResponse( Buffer* buf, BufferReader& br ) {
-    Error err = br.ReadUntil( buf, '\n', 1 );
-    if ( err == Error::NotFound ) {
-        return Error::TryAgain;
-    }
-
-    return Error::OK;
-}
-
 /**
  * Handle from inline format
  **/
@@ -33,130 +24,190 @@ Error InlineParser::HandleRequest( Cmd* cmd, BufferReader& br ) {
     Error err = br.ReadUntil( &buf, kSplitSign );
 
     for ( ; err.None(); err = br.ReadUntil( &buf, kSplitSign ) ) {
-        if ( br.Current() == '\n' ) {
-            if ( br.Last() == '\r' ) {
-                buf.Offset(0, -1);
-            }
+        bool eol = br.Current() == '\n';
+        if ( eol && br.Last() == '\r' ) {
+            buf.Offset(0, -1);
+        }
 
+        // runs of spaces make no empty args
+        if ( !buf.Empty() ) {
             cmd->AppendArg( buf );
-            br.Next();
-                
-            return Error::OK;
-        } else {
-            cmd->AppendArg( buf );
-            br.Next();
         }
-
+        br.Next();
         buf.Clear();
+
+        if ( eol && !cmd->Empty() ) {
+            return Error::OK;
+        }
     }
 
     /**
      * wait for next coming data
      **/
-    if ( err == Error::NotFound ) {
+    if ( err == Error::NotFound || err == Error::OutOfBound ) {
         return Error::TryAgain;
     }
 
     return err;
 }
 
-Error MultibulkParser::HandleResponse( Buffer* pbuf, BufferReader& br ) {
+/**
+ * Handle from multibulk format
+ **/
+Error MultibulkParser::HandleRequest( Cmd* cmd, BufferReader& br ) {
     Error err;
 
-    if ( multibulkLen_ == 0 ) {
-        char ch = br.Current();
-        if ( ch == '*' ) {
-            // read from a new line
-            err = readInt32( &multibulkLen_, br, pbuf );
-            if ( !err.None() ) {
-                return err; 
+    if (multibulkLen_ == 0) {
+        // read from a new line
+        err = readInt32( &multibulkLen_, br );
+        if ( !err.None() ) { return err; }
+
+        if ( multibulkLen_ > CMD_MAX_MULTIBULK ) {
+            return Error::Protocol;
+        }
+
+        /**
+         * the args are reserved up front, but no more than what has come
+         * could hold, a bulk takes 6 bytes at least ("$0\r\n\r\n").
+         **/
+        if ( multibulkLen_ > 0 ) {
+            std::size_t reserve = br.Left() / 6;
+            if ( reserve > std::size_t(multibulkLen_) ) {
+                reserve = std::size_t(multibulkLen_);
             }
-        } else /*if ( ch == '$' )*/ {
-            multibulkLen_ = 1;
+
+            err = cmd->argv_.Reserve( reserve );
+            if ( !err.None() ) { return err; }
         }
     }
 
     for ( ; multibulkIndex_ < multibulkLen_; ++multibulkIndex_ ) {
-        if ( bulkLen_ == 0 ) {
-            err = readInt32( &bulkLen_, br, pbuf );
-            if ( !err.None() ) { 
-                return err; 
-            }
-            
-            if ( bulkLen_ <= 0 ) {
-                bulkLen_ = 0;
-                continue;
+        if ( bulkLen_ < 0 ) {
+            err = readInt32( &bulkLen_, br );
+            if ( !err.None() ) { return err; }
+
+            if ( bulkLen_ < 0 || bulkLen_ > CMD_MAX_BULK ) {
+                return Error::Protocol;
             }
         }
 
-        err = br.Read( pbuf, bulkLen_ + 2 ); // plus endro '\r\n'
-        if ( !err.None() ) {
-            if ( err == Error::OutOfBound ) {
-                return Error::TryAgain;
-            }
-            return err;
+        /**
+         * a large value is not held in full, the request goes on its way
+         * from here and its rest follows by HandleStream() as it comes.
+         * the name comes first, so there is always a cmd to tell.
+         **/
+        if ( streamThreshold_ > 0 && multibulkIndex_ > 0 && bulkLen_ > 0 &&
+            std::size_t(bulkLen_) >= streamThreshold_ && br.Left() < std::size_t(bulkLen_) + 2 ) {
+            streaming_ = true;
+            streamLeft_ = std::size_t(bulkLen_) + 2;
+            cmd->streamedArgs_ = multibulkLen_ - 1;
+            return Error::OK;
         }
 
-        bulkLen_ = 0;
+        // plus endro '\r\n'
+        std::size_t size = std::size_t(bulkLen_) + 2;
+        if ( br.Left() < size ) {
+            return Error::TryAgain;
+        }
+
+        /**
+         * the request stays in front of the reader until it is complete,
+         * where the arg is from there holds when the buffer moves meanwhile.
+         **/
+        Cmd::Arg arg = { br.Offset(), std::size_t(bulkLen_) };
+        err = cmd->argv_.PushBack( arg );
+        if ( !err.None() ) { return err; }
+
+        br.Next( size );
+        bulkLen_ = -1;
     }
 
     return Error::OK;
 }
 
 /**
- * Handle from multibulk format
+ * HandleStream
+ * frames the rest of a streamed request without holding any of it,
+ * the reader is moved over as much as has come.
  **/
-Error MultibulkParser::HandleRequest( Cmd* cmd, BufferReader& br ) {
-    Error err;
+Error MultibulkParser::HandleStream( BufferReader& br ) {
+    for ( ;; ) {
+        if ( streamLeft_ > 0 ) {
+            std::size_t size = br.Left() < streamLeft_ ? br.Left() : streamLeft_;
+            if ( size > 0 ) {
+                br.Next( size );
+            }
 
-    if (multibulkLen_ == 0) {
-        // read from a new line
-        err = readInt32( &multibulkLen_, br );
-        if ( !err.None() ) { return err; }
-    }
+            streamLeft_ -= size;
+            if ( streamLeft_ > 0 ) {
+                return Error::TryAgain;
+            }
 
-    for ( ; multibulkIndex_ < multibulkLen_; ++multibulkIndex_ ) {
-        if ( bulkLen_ == 0 ) {
-            err = readInt32( &bulkLen_, br );
-            if ( !err.None() ) { return err; }
+            multibulkIndex_++;
+            bulkLen_ = -1;
         }
 
-        Buffer buf;
-        err = br.Read( &buf, bulkLen_ + 2 ); // plus endro '\r\n'
+        if ( multibulkIndex_ >= multibulkLen_ ) {
+            return Error::OK;
+        }
+
+        Error err = readInt32( &bulkLen_, br );
         if ( !err.None() ) {
-            if ( err == Error::OutOfBound ) {
-                return Error::TryAgain;
-            }
             return err;
         }
 
-        buf.Offset(0, -2);
-        cmd->AppendArg( buf );
+        if ( bulkLen_ < 0 ) {
+            return Error::Protocol;
+        }
+        streamLeft_ = std::size_t(bulkLen_) + 2;
+    }
+}
+
+/**
+ * readInt32
+ * the number of a "*<n>\r\n" or "$<n>\r\n" line, read in place.
+ * anything else than digits in it, or one out of range, breaks the stream.
+ **/
+Error MultibulkParser::readInt32( int32_t* i, BufferReader& br ) {
+    const char* data = br.Data();
+    std::size_t left = br.Left();
 
-        bulkLen_ = 0;
+    // the line has not fully come yet, or not at all
+    const char* eol = left > 0 ? scan::FindFirst( data, left, '\n' ) : nullptr;
+    if ( eol == nullptr ) {
+        return Error::TryAgain;
     }
 
-    return Error::OK;
-}
+    // passed '*' or '$' and '\r'
+    const char* p = data + 1;
+    const char* end = eol;
+    if ( end > p && end[-1] == '\r' ) {
+        end--;
+    }
 
-Error MultibulkParser::readInt32( int32_t* i, BufferReader& br, Buffer *pbuf ) {
-    Buffer buf;
+    bool negative = p < end && *p == '-';
+    if ( negative ) {
+        p++;
+    }
 
-    // read from a new line
-    Error err = br.ReadUntil( &buf, '\n', 1 );
-    if ( !err.None() ) {
-        if ( err == Error::NotFound ) {
-            return Error::TryAgain;
+    if ( p == end || end - p > 10 ) {
+        return Error::Protocol;
+    }
+
+    int64_t n = 0;
+    for ( ; p < end; ++p ) {
+        if ( *p < '0' || *p > '9' ) {
+            return Error::Protocol;
         }
-        return err;
+        n = n * 10 + (*p - '0');
     }
 
-    if ( pbuf != nullptr ) {
-        pbuf->Append( buf.Data(), buf.Size() );
+    if ( n > INT32_MAX ) {
+        return Error::Protocol;
     }
 
-    // passed '*' or '$' and '\r'
-    *i = ParseInt32( buf, 1, -1 );
+    *i = negative ? -int32_t(n) : int32_t(n);
+    br.Next( eol - data + 1 );
     return Error::OK;
 }
 
@@ -164,32 +215,86 @@ Error MultibulkParser::readInt32( int32_t* i, BufferReader& br, Buffer *pbuf ) {
 
 namespace rp {
 
+const Buffer& Cmd::Raw() const {
+    static const Buffer kNone;
+    return raw_ ? base_ : kNone;
+}
+
+Error Cmd::AppendArg( const char* data, std::size_t size ) {
+    // the request came in shared memory, the args go to memory of their own from here
+    if ( raw_ || base_.Shared() ) {
+        Buffer own;
+        if ( !base_.Empty() ) {
+            Error err = own.Append( base_.Data(), base_.Size() );
+            if ( !err.None() ) {
+                return err;
+            }
+        }
+
+        base_ = std::move( own );
+        raw_ = false;
+    }
+
+    Arg arg = { base_.Size(), size };
+    if ( size > 0 ) {
+        Error err = base_.Append( data, size );
+        if ( !err.None() ) {
+            return err;
+        }
+    }
+
+    return argv_.PushBack( arg );
+}
+
+Error Cmd::Reserve( std::size_t args, std::size_t size ) {
+    // a parsed request is copied out on the first AppendArg() anyway
+    if ( !raw_ && !base_.Shared() ) {
+        Error err = base_.AppendCapacity( size );
+        if ( !err.None() ) {
+            return err;
+        }
+    }
+
+    return argv_.Reserve( argv_.Size() + args );
+}
+
+/**
+ * FormatRESP2
+ * sizes the buffer up front, then writes the headers and args into it.
+ **/
 Error Cmd::FormatRESP2( Buffer* buffer ) const {
-    Error err;
+    // "$<len>\r\n" fits in 16 bytes for any length
+    std::size_t size = 16;
+    for ( std::size_t i = 0; i < argv_.Size(); ++i ) {
+        size += 16 + argv_[i].size + 2;
+    }
 
-    std::stringstream ss;
-    ss << "*" << argv_.size() << "\r\n";
-    std::string s( ss.str() );
-    err = buffer->Append( s.c_str(), s.size() );
+    Error err = buffer->AppendCapacity( size );
     if ( !err.None() ) {
         return err;
     }
 
-    for ( std::size_t i = 0; i < argv_.size(); ++i ) {
-        std::stringstream ss;
-        ss << "$" << argv_[i].Size() << "\r\n";
-        std::string s(ss.str());
-        err = buffer->Append( s.c_str(), s.size() );
-        if (!err.None()) {
+    char head[32];
+    int n = snprintf( head, sizeof(head), "*%zu\r\n", argv_.Size() );
+    err = buffer->Append( head, n );
+    if ( !err.None() ) {
+        return err;
+    }
+
+    for ( std::size_t i = 0; i < argv_.Size(); ++i ) {
+        Slice a = arg( i );
+        n = snprintf( head, sizeof(head), "$%zu\r\n", a.Size() );
+        err = buffer->Append( head, n );
+        if ( !err.None() ) {
             return err;
         }
 
-        err = buffer->Append( argv_[i].Data(), argv_[i].Size() );
+        err = buffer->Append( a.Data(), a.Size() );
         if ( !err.None() ) {
             return err;
         }
 
-        err = buffer->Append("\r\n", 2);
+        err = buffer->Append( "\r\n", 2 );
         if ( !err.None() ) {
             return err;
         }
@@ -217,6 +322,20 @@ Error CmdParser::ParseRequest( Cmd* cmd ) {
     std::size_t currentOffset = inputbr_.Offset();
     if ( parseType_ == TYPE_MULTIBULK ) {
         err = multibulkParser_.HandleRequest( cmd, inputbr_ );
+
+        /**
+         * the request is kept in front of the reader until it is complete,
+         * then it goes to the upstream as it is, without re-encoding.
+         **/
+        if ( err.None() ) {
+            Buffer raw;
+            err = raw.Append( inputb_, 0, inputbr_.Offset() );
+            cmd->base_ = std::move( raw );
+            cmd->raw_ = true;
+            cmd->streaming_ = multibulkParser_.Streaming();
+        } else if ( err == Error::TryAgain ) {
+            return err;
+        }
     } else {
         err = inlineParser_.HandleRequest( cmd, inputbr_ );
     }
@@ -230,38 +349,69 @@ Error CmdParser::ParseRequest( Cmd* cmd ) {
         inputbr_.Reset();
     }
 
+    if ( err.None() && !cmd->Empty() ) {
+        Slice name = cmd->GetCmd();
+        cmd->info_ = LookupCommand( name.Data(), name.Size() );
+    }
+
+    return err;
+}
+
+Error CmdParser::ParseStream( Buffer* chunk ) {
+    if ( parseType_ != TYPE_MULTIBULK || !multibulkParser_.Streaming() ) {
+        return Error::NotFound;
+    }
+
+    Error err = multibulkParser_.HandleStream( inputbr_ );
+    if ( !err.None() && err != Error::TryAgain ) {
+        return err;
+    }
+
+    if ( inputbr_.Offset() > 0 ) {
+        Error aerr = chunk->Append( inputb_, 0, inputbr_.Offset() );
+        inputb_.Offset( inputbr_.Offset() );
+        inputbr_.Reset();
+
+        if ( !aerr.None() ) {
+            return aerr;
+        }
+    }
+
     return err;
 }
 
+/**
+ * ParseResponse
+ * the reply stays in front of the reader until it is complete,
+ * then it is handed out as a slice without copying.
+ **/
 Error CmdParser::ParseResponse( Buffer* resp ) {
-    Error err;
     // No data in buffer
     if ( inputbr_.Eof() ) {
         return Error::TryAgain;
     }
 
-    if ( parseType_ == TYPE_NONE ) {
-        char ch = inputbr_.Current();
-        if ( ch == '*' || ch == '$' ) {
-            parseType_ = TYPE_MULTIBULK;
-        } else if ( ch == '-' || ch == '+' || ch == ':' ) {
-            parseType_ = TYPE_INLINE;
-        } else {
-            return Error::Unknown;
-        }
+    Error err = replyParser_.HandleResponse( inputbr_ );
+    if ( !err.None() ) {
+        return err;
     }
 
-    std::size_t currentOffset = inputbr_.Offset();
-    if ( parseType_ == TYPE_MULTIBULK ) {
-        err = multibulkParser_.HandleResponse( resp, inputbr_ );
-    } else {
-        err = inlineParser_.HandleResponse( resp, inputbr_ );
-    }
+    err = resp->Append( inputb_, 0, inputbr_.Offset() );
+    replyType_ = replyParser_.Type();
+    replyRESP3_ = replyParser_.RESP3();
 
-    if ( currentOffset != inputbr_.Offset() ) {
-        inputb_.Offset( inputbr_.Offset() );
-        inputbr_.Reset();
-    }
+    inputb_.Offset( inputbr_.Offset() );
+    inputbr_.Reset();
+    replyParser_.Reset();
+
+    return err;
+}
+
+Error CmdParser::TakePartialResponse( Buffer* resp ) {
+    Error err = resp->Append( inputb_, 0, inputbr_.Offset() );
+
+    inputb_.Offset( inputbr_.Offset() );
+    inputbr_.Reset();
 
     return err;
 }
@@ -281,10 +431,10 @@ int main() {
     err = buffer->Append( s1, sizeof(s1) - 1 );
 
     parser.ParseRequest( &cmd );
-    if ( cmd.GetCmd() != nullptr ) {
-        printf( "Cmd:[%d]%s\n", cmd.GetCmd()->Size(), cmd.GetCmd()->Data() );
+    if ( !cmd.Empty() ) {
+        printf( "Cmd:[%d]%.*s\n", int(cmd.GetCmd().Size()), int(cmd.GetCmd().Size()), cmd.GetCmd().Data() );
         for ( std::size_t i = 0; i < cmd.GetArgSize(); i++ ) {
-            printf( "Arg:[%d]%s\n", cmd.GetArg(i)->Size(), cmd.GetArg(i)->Data() );
+            printf( "Arg:[%d]%.*s\n", int(cmd.GetArg(i).Size()), int(cmd.GetArg(i).Size()), cmd.GetArg(i).Data() );
         }
     } else {
         printf( "Cmd:<null>\n" );
@@ -305,10 +455,10 @@ int main() {
         return 1;
     }
 
-    if ( cmd.GetCmd() != nullptr ) {
-        printf( "Cmd:[%d]%s\n", cmd.GetCmd()->Size(), cmd.GetCmd()->Data() );
+    if ( !cmd.Empty() ) {
+        printf( "Cmd:[%d]%.*s\n", int(cmd.GetCmd().Size()), int(cmd.GetCmd().Size()), cmd.GetCmd().Data() );
         for ( std::size_t i = 0; i < cmd.GetArgSize(); i++ ) {
-            printf( "Arg:[%d]%s\n", cmd.GetArg(i)->Size(), cmd.GetArg(i)->Data() );
+            printf( "Arg:[%d]%.*s\n", int(cmd.GetArg(i).Size()), int(cmd.GetArg(i).Size()), cmd.GetArg(i).Data() );
         }
     } else {
         printf( "Cmd:<null>\n" );
@@ -369,10 +519,10 @@ int main() {
         printf( "4 Parse failed:%s\n", err.String().c_str() );
     }
 
-    if ( cmd.GetCmd() != nullptr ) {
-        printf( "Cmd:[%d]%s\n", cmd.GetCmd()->Size(), cmd.GetCmd()->Data() );
+    if ( !cmd.Empty() ) {
+        printf( "Cmd:[%d]%.*s\n", int(cmd.GetCmd().Size()), int(cmd.GetCmd().Size()), cmd.GetCmd().Data() );
         for ( std::size_t i = 0; i < cmd.GetArgSize(); i++ ) {
-            printf( "Arg:[%d]%s\n", cmd.GetArg(i)->Size(), cmd.GetArg(i)->Data() );
+            printf( "Arg:[%d]%.*s\n", int(cmd.GetArg(i).Size()), int(cmd.GetArg(i).Size()), cmd.GetArg(i).Data() );
         }
     } else {
         printf( "Cmd:<null>\n" );
@@ -3,35 +3,57 @@
 #define __RP_CMD_H__
 
 #include "buffer_reader.h"
+#include "reply.h"
+#include "command_table.h"
+#include "small_vector.h"
 
 namespace rp {
 
 class CmdParser;
 
+namespace impl {
+class MultibulkParser;
+}
+
+/**
+ * args held in place, most commands have no more
+ **/
+#define CMD_INLINE_ARGS 8
+
 /**
  * Cmd
+ * the args are views into the request as it came in, which the Cmd holds
+ * one reference of, so parsing one does not allocate or touch a count.
+ * args appended by hand go to memory of its own.
  * TODO: consider complement a helper function to handle with Connection::WriteToBuffer()
  **/
 class Cmd {
 public:
-    const Buffer* GetCmd() const {
-        if ( argv_.empty() ) { 
-            return nullptr; 
+    Cmd() : raw_(false), info_(nullptr), streaming_(false), streamedArgs_(0) {}
+
+public:
+    /**
+     * an empty slice for an empty cmd or an arg out of range,
+     * good until the cmd is reset or changed.
+     **/
+    Slice GetCmd() const {
+        if ( argv_.Empty() ) { 
+            return Slice();
         }
 
-        return &argv_[0];
+        return arg( 0 );
     }
 
-    const Buffer* GetArg( int i ) const {
-        if ( argv_.size() >= std::size_t(i + 1) ) {
-            return &argv_[i + 1];
+    Slice GetArg( std::size_t i ) const {
+        if ( argv_.Size() >= i + 2 ) {
+            return arg( i + 1 );
         }
 
-        return nullptr;
+        return Slice();
     }
 
     std::size_t GetArgSize() const {
-        std::size_t size = argv_.size();
+        std::size_t size = argv_.Size();
         if ( size == 0 ) {
             return 0;
         }
@@ -39,24 +61,86 @@ public:
     }
 
 public:
-    bool Empty() const { return argv_.empty(); }
+    bool Empty() const { return argv_.Empty(); }
+
+    /**
+     * what the command is, resolved once by CmdParser::ParseRequest().
+     * nullptr for the ones unknown to the proxy and the ones built by hand.
+     **/
+    const CommandInfo* Info() const { return info_; }
+
+    /**
+     * only the head is in, up to the first bulk of CmdParser::SetStreamThreshold()
+     * or more, Raw() holds it. the rest comes by CmdParser::ParseStream().
+     **/
+    bool Streaming() const { return streaming_; }
+    /**
+     * the args in all, the ones still to come of a streamed cmd too
+     **/
+    std::size_t GetFullArgSize() const { return streaming_ ? streamedArgs_ : GetArgSize(); }
 
 public:
     Error FormatRESP2( Buffer* buffer ) const;
 
+    /**
+     * the request exactly as the client sent it, a slice of the input buffer.
+     * empty for inline requests and changed args, which get re-encoded.
+     **/
+    const Buffer& Raw() const;
+
 public:
-    void AppendArg( const Buffer& arg ) { argv_.push_back(arg); }
-    void Reset() { argv_.clear(); }
+    Error AppendArg( const char* data, std::size_t size );
+    Error AppendArg( const Buffer& arg ) { return AppendArg( arg.Data(), arg.Size() ); }
+    /**
+     * room for that many more args of size bytes in all, ahead of building one by hand
+     **/
+    Error Reserve( std::size_t args, std::size_t size );
+
+    void Reset() { 
+        // a hostile count of args does not keep its memory around
+        if ( argv_.Capacity() > CMD_INLINE_ARGS * 128 ) {
+            argv_.Release();
+        } else {
+            argv_.Clear();
+        }
+
+        base_ = Buffer();
+        raw_ = false;
+        info_ = nullptr;
+        streaming_ = false;
+        streamedArgs_ = 0;
+    }
+
+private:
+    Slice arg( std::size_t i ) const { return Slice( base_.Data() + argv_[i].offset, argv_[i].size ); }
 
 private:
     friend class CmdParser;
+    friend class impl::MultibulkParser;
 
 private:
+    /**
+     * where an arg is in base_
+     **/
+    struct Arg {
+        std::size_t offset;
+        std::size_t size;
+    };
+
     /**
      * 0 - cmd
      * 1..N from argv[0]
      **/
-    std::vector<Buffer> argv_;
+    SmallVector<Arg, CMD_INLINE_ARGS> argv_;
+
+    /**
+     * the memory of the args, the request as it came when raw_
+     **/
+    Buffer  base_;
+    bool    raw_;
+    const CommandInfo*  info_;
+    bool    streaming_;
+    std::size_t streamedArgs_;
 };
 
 
@@ -68,33 +152,56 @@ namespace impl {
 class InlineParser {
 public:
     Error HandleRequest( Cmd* cmd, BufferReader& br );
-    Error HandleResponse( Buffer* buffer, BufferReader& br );
 };
 
+/**
+ * the most args and the longest bulk of a request, as redis takes them.
+ * past them the stream is taken as broken, before anything is reserved.
+ **/
+#define CMD_MAX_MULTIBULK   (1024 * 1024)
+#define CMD_MAX_BULK        (512 * 1024 * 1024)
+
 /**
  * MultibulkParser
  **/
 class MultibulkParser {
 public:
-    MultibulkParser() : multibulkLen_(0), multibulkIndex_(0), bulkLen_(0) {}
+    MultibulkParser() : multibulkLen_(0), multibulkIndex_(0), bulkLen_(-1),
+        streamThreshold_(0), streaming_(false), streamLeft_(0) {}
 
 public:
     Error HandleRequest( Cmd* cmd, BufferReader& br );
-    Error HandleResponse( Buffer* buffer, BufferReader& br );
+    Error HandleStream( BufferReader& br );
     void Reset() {
         multibulkLen_ = 0;
         multibulkIndex_ = 0;
-        bulkLen_ = 0;
+        bulkLen_ = -1;
+        streaming_ = false;
+        streamLeft_ = 0;
     }
 
+public:
+    void SetStreamThreshold( std::size_t threshold ) { streamThreshold_ = threshold; }
+    bool Streaming() const { return streaming_; }
+
 private:
-    Error readInt32( int32_t* i, BufferReader& br, Buffer *buffer = nullptr );
+    Error readInt32( int32_t* i, BufferReader& br );
 
 private:
     int32_t multibulkLen_;
     int32_t multibulkIndex_;
 
+    // -1 until the header of the bulk is read
     int32_t bulkLen_;
+
+    /**
+     * a bulk this long or more does not wait to be complete,
+     * the request is streamed from it on. 0 never.
+     **/
+    std::size_t streamThreshold_;
+    bool    streaming_;
+    // bytes of the current bulk plus its "\r\n" not passed on yet
+    std::size_t streamLeft_;
 };
 
 }
@@ -110,16 +217,39 @@ class CmdParser {
     };
 
 public:
-    CmdParser() : parseType_(TYPE_NONE), inputbr_(inputb_) {}
+    CmdParser() : parseType_(TYPE_NONE), replyType_(0), replyRESP3_(false), inputbr_(inputb_) {}
 
 public:
     Error ParseRequest( Cmd* cmd );
+    /**
+     * chunk gets what has come of the rest of a streamed request, see
+     * Cmd::Streaming(). OK once it is through, TryAgain while more is to come.
+     **/
+    Error ParseStream( Buffer* chunk );
+    void SetStreamThreshold( std::size_t threshold ) { multibulkParser_.SetStreamThreshold( threshold ); }
+    /**
+     * resp gets a slice of the input buffer holding exactly one reply
+     **/
     Error ParseResponse( Buffer* resp );
+    /**
+     * of a reply not complete yet, resp gets the part framed so far which
+     * is let go of, ParseResponse() goes on with the rest.
+     **/
+    Error TakePartialResponse( Buffer* resp );
+    std::size_t PartialSize() const { return inputbr_.Offset(); }
+    char PartialType() const { return replyParser_.Type(); }
+
+    /**
+     * of the last reply parsed, see impl::ReplyParser
+     **/
+    char ReplyType() const { return replyType_; }
+    bool ReplyRESP3() const { return replyRESP3_; }
 
 public:
     void Reset() {
         parseType_ = TYPE_NONE;
         multibulkParser_.Reset();
+        replyParser_.Reset();
     }
 
 public:
@@ -130,6 +260,9 @@ private:
 
     impl::InlineParser  inlineParser_;
     impl::MultibulkParser  multibulkParser_;
+    impl::ReplyParser   replyParser_;
+    char    replyType_;
+    bool    replyRESP3_;
 
 private:
     Buffer          inputb_;
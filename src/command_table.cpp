@@ -0,0 +1,369 @@
+
+#include <string.h>
+
+#include "command_table.h"
+
+namespace rp {
+
+/**
+ * the hash is FNV-1a over the lowercased name starting from COMMAND_HASH_SEED,
+ * its top COMMAND_HASH_BITS bits index slots. the seed was searched for to
+ * give every command its own slot, which is proved by the static_assert below
+ * whenever the table changes, search a new one if it fails.
+ **/
+#define COMMAND_HASH_BITS   11
+#define COMMAND_HASH_SEED   4712264u
+
+static constexpr CommandInfo commandTable[] = {
+    { "get", 2, CMD_READONLY | CMD_FAST, 1, 1, 1 },
+    { "set", -3, CMD_WRITE, 1, 1, 1 },
+    { "setnx", 3, CMD_WRITE | CMD_FAST, 1, 1, 1 },
+    { "setex", 4, CMD_WRITE, 1, 1, 1 },
+    { "psetex", 4, CMD_WRITE, 1, 1, 1 },
+    { "getset", 3, CMD_WRITE | CMD_FAST, 1, 1, 1 },
+    { "getdel", 2, CMD_WRITE | CMD_FAST, 1, 1, 1 },
+    { "getex", -2, CMD_WRITE | CMD_FAST, 1, 1, 1 },
+    { "getrange", 4, CMD_READONLY, 1, 1, 1 },
+    { "setrange", 4, CMD_WRITE, 1, 1, 1 },
+    { "substr", 4, CMD_READONLY, 1, 1, 1 },
+    { "strlen", 2, CMD_READONLY | CMD_FAST, 1, 1, 1 },
+    { "append", 3, CMD_WRITE, 1, 1, 1 },
+    { "incr", 2, CMD_WRITE | CMD_FAST, 1, 1, 1 },
+    { "decr", 2, CMD_WRITE | CMD_FAST, 1, 1, 1 },
+    { "incrby", 3, CMD_WRITE | CMD_FAST, 1, 1, 1 },
+    { "decrby", 3, CMD_WRITE | CMD_FAST, 1, 1, 1 },
+    { "incrbyfloat", 3, CMD_WRITE | CMD_FAST, 1, 1, 1 },
+    { "mget", -2, CMD_READONLY | CMD_FAST, 1, -1, 1 },
+    { "mset", -3, CMD_WRITE, 1, -1, 2 },
+    { "msetnx", -3, CMD_WRITE, 1, -1, 2 },
+    { "lcs", -3, CMD_READONLY, 1, 2, 1 },
+    { "del", -2, CMD_WRITE, 1, -1, 1 },
+    { "unlink", -2, CMD_WRITE | CMD_FAST, 1, -1, 1 },
+    { "exists", -2, CMD_READONLY | CMD_FAST, 1, -1, 1 },
+    { "touch", -2, CMD_READONLY | CMD_FAST, 1, -1, 1 },
+    { "type", 2, CMD_READONLY | CMD_FAST, 1, 1, 1 },
+    { "expire", -3, CMD_WRITE | CMD_FAST, 1, 1, 1 },
+    { "pexpire", -3, CMD_WRITE | CMD_FAST, 1, 1, 1 },
+    { "expireat", -3, CMD_WRITE | CMD_FAST, 1, 1, 1 },
+    { "pexpireat", -3, CMD_WRITE | CMD_FAST, 1, 1, 1 },
+    { "expiretime", 2, CMD_READONLY | CMD_FAST, 1, 1, 1 },
+    { "pexpiretime", 2, CMD_READONLY | CMD_FAST, 1, 1, 1 },
+    { "ttl", 2, CMD_READONLY | CMD_FAST, 1, 1, 1 },
+    { "pttl", 2, CMD_READONLY | CMD_FAST, 1, 1, 1 },
+    { "persist", 2, CMD_WRITE | CMD_FAST, 1, 1, 1 },
+    { "rename", 3, CMD_WRITE, 1, 2, 1 },
+    { "renamenx", 3, CMD_WRITE | CMD_FAST, 1, 2, 1 },
+    { "copy", -3, CMD_WRITE, 1, 2, 1 },
+    { "move", 3, CMD_WRITE | CMD_FAST, 1, 1, 1 },
+    { "dump", 2, CMD_READONLY, 1, 1, 1 },
+    { "restore", -4, CMD_WRITE, 1, 1, 1 },
+    { "keys", 2, CMD_READONLY, 0, 0, 0 },
+    { "scan", -2, CMD_READONLY, 0, 0, 0 },
+    { "randomkey", 1, CMD_READONLY, 0, 0, 0 },
+    { "dbsize", 1, CMD_READONLY | CMD_FAST, 0, 0, 0 },
+    { "object", -2, CMD_READONLY, 2, 2, 1 },
+    { "sort", -2, CMD_WRITE | CMD_MOVABLEKEYS, 1, 1, 1 },
+    { "sort_ro", -2, CMD_READONLY | CMD_MOVABLEKEYS, 1, 1, 1 },
+    { "wait", 3, CMD_NOSCRIPT, 0, 0, 0 },
+    { "select", 2, CMD_FAST, 0, 0, 0 },
+    { "swapdb", 3, CMD_WRITE | CMD_FAST, 0, 0, 0 },
+    { "flushdb", -1, CMD_WRITE, 0, 0, 0 },
+    { "flushall", -1, CMD_WRITE, 0, 0, 0 },
+    { "lpush", -3, CMD_WRITE | CMD_FAST, 1, 1, 1 },
+    { "rpush", -3, CMD_WRITE | CMD_FAST, 1, 1, 1 },
+    { "lpushx", -3, CMD_WRITE | CMD_FAST, 1, 1, 1 },
+    { "rpushx", -3, CMD_WRITE | CMD_FAST, 1, 1, 1 },
+    { "linsert", 5, CMD_WRITE, 1, 1, 1 },
+    { "lpop", -2, CMD_WRITE | CMD_FAST, 1, 1, 1 },
+    { "rpop", -2, CMD_WRITE | CMD_FAST, 1, 1, 1 },
+    { "llen", 2, CMD_READONLY | CMD_FAST, 1, 1, 1 },
+    { "lindex", 3, CMD_READONLY, 1, 1, 1 },
+    { "lset", 4, CMD_WRITE, 1, 1, 1 },
+    { "lrange", 4, CMD_READONLY, 1, 1, 1 },
+    { "ltrim", 4, CMD_WRITE, 1, 1, 1 },
+    { "lrem", 4, CMD_WRITE, 1, 1, 1 },
+    { "lpos", -3, CMD_READONLY, 1, 1, 1 },
+    { "rpoplpush", 3, CMD_WRITE, 1, 2, 1 },
+    { "lmove", 5, CMD_WRITE, 1, 2, 1 },
+    { "blpop", -3, CMD_WRITE | CMD_NOSCRIPT | CMD_BLOCKING, 1, -2, 1 },
+    { "brpop", -3, CMD_WRITE | CMD_NOSCRIPT | CMD_BLOCKING, 1, -2, 1 },
+    { "brpoplpush", 4, CMD_WRITE | CMD_NOSCRIPT | CMD_BLOCKING, 1, 2, 1 },
+    { "blmove", 6, CMD_WRITE | CMD_NOSCRIPT | CMD_BLOCKING, 1, 2, 1 },
+    { "lmpop", -4, CMD_WRITE | CMD_MOVABLEKEYS, 0, 0, 0 },
+    { "blmpop", -5, CMD_WRITE | CMD_BLOCKING | CMD_MOVABLEKEYS, 0, 0, 0 },
+    { "sadd", -3, CMD_WRITE | CMD_FAST, 1, 1, 1 },
+    { "srem", -3, CMD_WRITE | CMD_FAST, 1, 1, 1 },
+    { "smove", 4, CMD_WRITE | CMD_FAST, 1, 2, 1 },
+    { "sismember", 3, CMD_READONLY | CMD_FAST, 1, 1, 1 },
+    { "smismember", -3, CMD_READONLY | CMD_FAST, 1, 1, 1 },
+    { "scard", 2, CMD_READONLY | CMD_FAST, 1, 1, 1 },
+    { "spop", -2, CMD_WRITE | CMD_FAST, 1, 1, 1 },
+    { "srandmember", -2, CMD_READONLY, 1, 1, 1 },
+    { "sinter", -2, CMD_READONLY, 1, -1, 1 },
+    { "sintercard", -3, CMD_READONLY | CMD_MOVABLEKEYS, 0, 0, 0 },
+    { "sinterstore", -3, CMD_WRITE, 1, -1, 1 },
+    { "sunion", -2, CMD_READONLY, 1, -1, 1 },
+    { "sunionstore", -3, CMD_WRITE, 1, -1, 1 },
+    { "sdiff", -2, CMD_READONLY, 1, -1, 1 },
+    { "sdiffstore", -3, CMD_WRITE, 1, -1, 1 },
+    { "smembers", 2, CMD_READONLY, 1, 1, 1 },
+    { "sscan", -3, CMD_READONLY, 1, 1, 1 },
+    { "zadd", -4, CMD_WRITE | CMD_FAST, 1, 1, 1 },
+    { "zincrby", 4, CMD_WRITE | CMD_FAST, 1, 1, 1 },
+    { "zrem", -3, CMD_WRITE | CMD_FAST, 1, 1, 1 },
+    { "zremrangebyscore", 4, CMD_WRITE, 1, 1, 1 },
+    { "zremrangebyrank", 4, CMD_WRITE, 1, 1, 1 },
+    { "zremrangebylex", 4, CMD_WRITE, 1, 1, 1 },
+    { "zunionstore", -4, CMD_WRITE | CMD_MOVABLEKEYS, 1, 1, 1 },
+    { "zinterstore", -4, CMD_WRITE | CMD_MOVABLEKEYS, 1, 1, 1 },
+    { "zdiffstore", -4, CMD_WRITE | CMD_MOVABLEKEYS, 1, 1, 1 },
+    { "zunion", -3, CMD_READONLY | CMD_MOVABLEKEYS, 0, 0, 0 },
+    { "zinter", -3, CMD_READONLY | CMD_MOVABLEKEYS, 0, 0, 0 },
+    { "zdiff", -3, CMD_READONLY | CMD_MOVABLEKEYS, 0, 0, 0 },
+    { "zintercard", -3, CMD_READONLY | CMD_MOVABLEKEYS, 0, 0, 0 },
+    { "zrange", -4, CMD_READONLY, 1, 1, 1 },
+    { "zrangestore", -5, CMD_WRITE, 1, 2, 1 },
+    { "zrangebyscore", -4, CMD_READONLY, 1, 1, 1 },
+    { "zrevrangebyscore", -4, CMD_READONLY, 1, 1, 1 },
+    { "zrangebylex", -4, CMD_READONLY, 1, 1, 1 },
+    { "zrevrangebylex", -4, CMD_READONLY, 1, 1, 1 },
+    { "zcount", 4, CMD_READONLY | CMD_FAST, 1, 1, 1 },
+    { "zlexcount", 4, CMD_READONLY | CMD_FAST, 1, 1, 1 },
+    { "zrevrange", -4, CMD_READONLY, 1, 1, 1 },
+    { "zcard", 2, CMD_READONLY | CMD_FAST, 1, 1, 1 },
+    { "zscore", 3, CMD_READONLY | CMD_FAST, 1, 1, 1 },
+    { "zmscore", -3, CMD_READONLY | CMD_FAST, 1, 1, 1 },
+    { "zrank", -3, CMD_READONLY | CMD_FAST, 1, 1, 1 },
+    { "zrevrank", -3, CMD_READONLY | CMD_FAST, 1, 1, 1 },
+    { "zscan", -3, CMD_READONLY, 1, 1, 1 },
+    { "zpopmin", -2, CMD_WRITE | CMD_FAST, 1, 1, 1 },
+    { "zpopmax", -2, CMD_WRITE | CMD_FAST, 1, 1, 1 },
+    { "bzpopmin", -3, CMD_WRITE | CMD_NOSCRIPT | CMD_BLOCKING | CMD_FAST, 1, -2, 1 },
+    { "bzpopmax", -3, CMD_WRITE | CMD_NOSCRIPT | CMD_BLOCKING | CMD_FAST, 1, -2, 1 },
+    { "zrandmember", -2, CMD_READONLY, 1, 1, 1 },
+    { "zmpop", -4, CMD_WRITE | CMD_MOVABLEKEYS, 0, 0, 0 },
+    { "bzmpop", -5, CMD_WRITE | CMD_BLOCKING | CMD_MOVABLEKEYS, 0, 0, 0 },
+    { "hset", -4, CMD_WRITE | CMD_FAST, 1, 1, 1 },
+    { "hsetnx", 4, CMD_WRITE | CMD_FAST, 1, 1, 1 },
+    { "hget", 3, CMD_READONLY | CMD_FAST, 1, 1, 1 },
+    { "hmset", -4, CMD_WRITE | CMD_FAST, 1, 1, 1 },
+    { "hmget", -3, CMD_READONLY | CMD_FAST, 1, 1, 1 },
+    { "hincrby", 4, CMD_WRITE | CMD_FAST, 1, 1, 1 },
+    { "hincrbyfloat", 4, CMD_WRITE | CMD_FAST, 1, 1, 1 },
+    { "hdel", -3, CMD_WRITE | CMD_FAST, 1, 1, 1 },
+    { "hlen", 2, CMD_READONLY | CMD_FAST, 1, 1, 1 },
+    { "hstrlen", 3, CMD_READONLY | CMD_FAST, 1, 1, 1 },
+    { "hkeys", 2, CMD_READONLY, 1, 1, 1 },
+    { "hvals", 2, CMD_READONLY, 1, 1, 1 },
+    { "hgetall", 2, CMD_READONLY, 1, 1, 1 },
+    { "hexists", 3, CMD_READONLY | CMD_FAST, 1, 1, 1 },
+    { "hrandfield", -2, CMD_READONLY, 1, 1, 1 },
+    { "hscan", -3, CMD_READONLY, 1, 1, 1 },
+    { "pfadd", -2, CMD_WRITE | CMD_FAST, 1, 1, 1 },
+    { "pfcount", -2, CMD_READONLY, 1, -1, 1 },
+    { "pfmerge", -2, CMD_WRITE, 1, -1, 1 },
+    { "setbit", 4, CMD_WRITE, 1, 1, 1 },
+    { "getbit", 3, CMD_READONLY | CMD_FAST, 1, 1, 1 },
+    { "bitcount", -2, CMD_READONLY, 1, 1, 1 },
+    { "bitpos", -3, CMD_READONLY, 1, 1, 1 },
+    { "bitop", -4, CMD_WRITE, 2, -1, 1 },
+    { "bitfield", -2, CMD_WRITE, 1, 1, 1 },
+    { "bitfield_ro", -2, CMD_READONLY | CMD_FAST, 1, 1, 1 },
+    { "geoadd", -5, CMD_WRITE, 1, 1, 1 },
+    { "geodist", -4, CMD_READONLY, 1, 1, 1 },
+    { "geohash", -2, CMD_READONLY, 1, 1, 1 },
+    { "geopos", -2, CMD_READONLY, 1, 1, 1 },
+    { "georadius", -6, CMD_WRITE | CMD_MOVABLEKEYS, 1, 1, 1 },
+    { "georadius_ro", -6, CMD_READONLY, 1, 1, 1 },
+    { "georadiusbymember", -5, CMD_WRITE | CMD_MOVABLEKEYS, 1, 1, 1 },
+    { "georadiusbymember_ro", -5, CMD_READONLY, 1, 1, 1 },
+    { "geosearch", -7, CMD_READONLY, 1, 1, 1 },
+    { "geosearchstore", -8, CMD_WRITE, 1, 2, 1 },
+    { "xadd", -5, CMD_WRITE | CMD_FAST, 1, 1, 1 },
+    { "xrange", -4, CMD_READONLY, 1, 1, 1 },
+    { "xrevrange", -4, CMD_READONLY, 1, 1, 1 },
+    { "xlen", 2, CMD_READONLY | CMD_FAST, 1, 1, 1 },
+    { "xread", -4, CMD_READONLY | CMD_BLOCKING | CMD_MOVABLEKEYS, 0, 0, 0 },
+    { "xreadgroup", -7, CMD_WRITE | CMD_BLOCKING | CMD_MOVABLEKEYS, 0, 0, 0 },
+    { "xgroup", -2, CMD_WRITE, 2, 2, 1 },
+    { "xsetid", -3, CMD_WRITE, 1, 1, 1 },
+    { "xack", -4, CMD_WRITE | CMD_FAST, 1, 1, 1 },
+    { "xpending", -3, CMD_READONLY, 1, 1, 1 },
+    { "xclaim", -6, CMD_WRITE | CMD_FAST, 1, 1, 1 },
+    { "xautoclaim", -6, CMD_WRITE | CMD_FAST, 1, 1, 1 },
+    { "xinfo", -2, CMD_READONLY, 2, 2, 1 },
+    { "xdel", -3, CMD_WRITE | CMD_FAST, 1, 1, 1 },
+    { "xtrim", -4, CMD_WRITE, 1, 1, 1 },
+    { "subscribe", -2, CMD_PUBSUB | CMD_NOSCRIPT, 0, 0, 0 },
+    { "unsubscribe", -1, CMD_PUBSUB | CMD_NOSCRIPT, 0, 0, 0 },
+    { "psubscribe", -2, CMD_PUBSUB | CMD_NOSCRIPT, 0, 0, 0 },
+    { "punsubscribe", -1, CMD_PUBSUB | CMD_NOSCRIPT, 0, 0, 0 },
+    { "publish", 3, CMD_PUBSUB | CMD_FAST, 0, 0, 0 },
+    { "pubsub", -2, CMD_PUBSUB, 0, 0, 0 },
+    { "ssubscribe", -2, CMD_PUBSUB | CMD_NOSCRIPT, 1, -1, 1 },
+    { "sunsubscribe", -1, CMD_PUBSUB | CMD_NOSCRIPT, 1, -1, 1 },
+    { "spublish", 3, CMD_PUBSUB | CMD_FAST, 1, 1, 1 },
+    { "multi", 1, CMD_NOSCRIPT | CMD_FAST, 0, 0, 0 },
+    { "exec", 1, CMD_NOSCRIPT, 0, 0, 0 },
+    { "discard", 1, CMD_NOSCRIPT | CMD_FAST, 0, 0, 0 },
+    { "watch", -2, CMD_NOSCRIPT | CMD_FAST, 1, -1, 1 },
+    { "unwatch", 1, CMD_NOSCRIPT | CMD_FAST, 0, 0, 0 },
+    { "eval", -3, CMD_NOSCRIPT | CMD_MOVABLEKEYS, 0, 0, 0 },
+    { "evalsha", -3, CMD_NOSCRIPT | CMD_MOVABLEKEYS, 0, 0, 0 },
+    { "eval_ro", -3, CMD_READONLY | CMD_NOSCRIPT | CMD_MOVABLEKEYS, 0, 0, 0 },
+    { "evalsha_ro", -3, CMD_READONLY | CMD_NOSCRIPT | CMD_MOVABLEKEYS, 0, 0, 0 },
+    { "script", -2, CMD_NOSCRIPT, 0, 0, 0 },
+    { "fcall", -3, CMD_NOSCRIPT | CMD_MOVABLEKEYS, 0, 0, 0 },
+    { "fcall_ro", -3, CMD_READONLY | CMD_NOSCRIPT | CMD_MOVABLEKEYS, 0, 0, 0 },
+    { "function", -2, CMD_NOSCRIPT, 0, 0, 0 },
+    { "auth", -2, CMD_NOSCRIPT | CMD_FAST, 0, 0, 0 },
+    { "ping", -1, CMD_FAST, 0, 0, 0 },
+    { "echo", 2, CMD_FAST, 0, 0, 0 },
+    { "quit", -1, CMD_FAST, 0, 0, 0 },
+    { "hello", -1, CMD_NOSCRIPT | CMD_FAST, 0, 0, 0 },
+    { "client", -2, CMD_ADMIN | CMD_NOSCRIPT, 0, 0, 0 },
+    { "reset", 1, CMD_NOSCRIPT | CMD_FAST, 0, 0, 0 },
+    { "info", -1, 0, 0, 0, 0 },
+    { "config", -2, CMD_ADMIN | CMD_NOSCRIPT, 0, 0, 0 },
+    { "command", -1, 0, 0, 0, 0 },
+    { "debug", -2, CMD_ADMIN | CMD_NOSCRIPT, 0, 0, 0 },
+    { "monitor", 1, CMD_ADMIN | CMD_NOSCRIPT, 0, 0, 0 },
+    { "slowlog", -2, CMD_ADMIN, 0, 0, 0 },
+    { "latency", -2, CMD_ADMIN | CMD_NOSCRIPT, 0, 0, 0 },
+    { "memory", -2, CMD_READONLY, 0, 0, 0 },
+    { "time", 1, CMD_FAST, 0, 0, 0 },
+    { "lastsave", 1, CMD_FAST, 0, 0, 0 },
+    { "save", 1, CMD_ADMIN | CMD_NOSCRIPT, 0, 0, 0 },
+    { "bgsave", -1, CMD_ADMIN | CMD_NOSCRIPT, 0, 0, 0 },
+    { "bgrewriteaof", 1, CMD_ADMIN | CMD_NOSCRIPT, 0, 0, 0 },
+    { "shutdown", -1, CMD_ADMIN | CMD_NOSCRIPT, 0, 0, 0 },
+    { "replicaof", 3, CMD_ADMIN | CMD_NOSCRIPT, 0, 0, 0 },
+    { "slaveof", 3, CMD_ADMIN | CMD_NOSCRIPT, 0, 0, 0 },
+    { "role", 1, CMD_NOSCRIPT | CMD_FAST, 0, 0, 0 },
+    { "sync", 1, CMD_ADMIN | CMD_NOSCRIPT, 0, 0, 0 },
+    { "psync", -3, CMD_ADMIN | CMD_NOSCRIPT, 0, 0, 0 },
+    { "replconf", -1, CMD_ADMIN | CMD_NOSCRIPT, 0, 0, 0 },
+    { "module", -2, CMD_ADMIN | CMD_NOSCRIPT, 0, 0, 0 },
+    { "acl", -2, CMD_NOSCRIPT, 0, 0, 0 },
+    { "lolwut", -1, CMD_READONLY | CMD_FAST, 0, 0, 0 },
+    { "failover", -1, CMD_ADMIN | CMD_NOSCRIPT, 0, 0, 0 },
+    { "cluster", -2, 0, 0, 0, 0 },
+    { "asking", 1, CMD_FAST, 0, 0, 0 },
+    { "readonly", 1, CMD_FAST, 0, 0, 0 },
+    { "readwrite", 1, CMD_FAST, 0, 0, 0 },
+    { "migrate", -6, CMD_WRITE | CMD_MOVABLEKEYS, 3, 3, 1 },
+};
+
+static constexpr std::size_t commandCount = sizeof(commandTable) / sizeof(commandTable[0]);
+
+// slots keep the index + 1, 0 for none
+static_assert( commandCount < 255, "the slots do not fit the table anymore" );
+
+static constexpr char foldCase( char ch ) {
+    return ( ch >= 'A' && ch <= 'Z' ) ? char(ch - 'A' + 'a') : ch;
+}
+
+static constexpr uint32_t hashName( const char* name, std::size_t size, uint32_t h ) {
+    return size == 0 ? h : hashName( name + 1, size - 1, (h ^ uint8_t(foldCase(*name))) * 16777619u );
+}
+
+static constexpr uint32_t hashName( const char* name, uint32_t h ) {
+    return *name == '\0' ? h : hashName( name + 1, (h ^ uint8_t(*name)) * 16777619u );
+}
+
+static constexpr uint32_t slotOf( const char* name ) {
+    return hashName( name, COMMAND_HASH_SEED ) >> (32 - COMMAND_HASH_BITS);
+}
+
+static constexpr bool slotTaken( std::size_t i, std::size_t j ) {
+    return j < commandCount && ( slotOf(commandTable[i].name) == slotOf(commandTable[j].name) || slotTaken(i, j + 1) );
+}
+
+static constexpr bool perfect( std::size_t i ) {
+    return i >= commandCount || ( !slotTaken(i, i + 1) && perfect(i + 1) );
+}
+
+static_assert( perfect(0), "two commands hash to the same slot, change COMMAND_HASH_SEED" );
+
+/**
+ * commandSlots
+ * the slot index of the table, built once at startup from the same
+ * hash the static_assert checked. c++0x can not fill an array in constexpr.
+ **/
+static struct CommandSlots {
+    CommandSlots() {
+        memset( index, 0, sizeof(index) );
+        for ( std::size_t i = 0; i < commandCount; ++i ) {
+            index[slotOf(commandTable[i].name)] = uint8_t(i + 1);
+        }
+    }
+
+    uint8_t index[1 << COMMAND_HASH_BITS];
+} commandSlots;
+
+std::size_t CommandCount() {
+    return commandCount;
+}
+
+const CommandInfo* LookupCommand( const char* name, std::size_t size ) {
+    uint32_t slot = hashName( name, size, COMMAND_HASH_SEED ) >> (32 - COMMAND_HASH_BITS);
+    uint8_t index = commandSlots.index[slot];
+    if ( index == 0 ) {
+        return nullptr;
+    }
+
+    // whatever hashes there, unknown ones included, it has to be the same name
+    const CommandInfo* info = &commandTable[index - 1];
+    for ( std::size_t i = 0; i < size; ++i ) {
+        if ( info->name[i] == '\0' || info->name[i] != foldCase(name[i]) ) {
+            return nullptr;
+        }
+    }
+
+    return info->name[size] == '\0' ? info : nullptr;
+}
+
+}
+
+#ifdef RP_COMMAND_TABLE_TEST
+/**
+ * g++ -std=c++0x -DRP_COMMAND_TABLE_TEST command_table.cpp -o command_table_test
+ **/
+#include <stdio.h>
+#include <ctype.h>
+
+int main() {
+    int failed = 0;
+    for ( std::size_t i = 0; i < rp::commandCount; ++i ) {
+        const char* name = rp::commandTable[i].name;
+        char upper[64];
+        std::size_t size = strlen( name );
+        for ( std::size_t j = 0; j < size; ++j ) {
+            upper[j] = toupper( name[j] );
+        }
+
+        if ( rp::LookupCommand(name, size) != &rp::commandTable[i] ||
+            rp::LookupCommand(upper, size) != &rp::commandTable[i] ) {
+            printf( "%s not found\n", name );
+            failed++;
+        }
+
+        // a prefix or a longer name must not match
+        if ( rp::LookupCommand(name, size - 1) == &rp::commandTable[i] ) {
+            printf( "prefix of %s found\n", name );
+            failed++;
+        }
+    }
+
+    static const char* unknown[] = { "", "gett", "foo", "hget\0x", "mgetx", "c1uster" };
+    for ( std::size_t i = 0; i < sizeof(unknown) / sizeof(unknown[0]); ++i ) {
+        if ( rp::LookupCommand(unknown[i], strlen(unknown[i]) + (i == 3 ? 2 : 0)) != nullptr ) {
+            printf( "%s found\n", unknown[i] );
+            failed++;
+        }
+    }
+
+    printf( "%zu commands, %d failed\n", rp::commandCount, failed );
+    return failed == 0 ? 0 : 1;
+}
+#endif
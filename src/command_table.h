@@ -0,0 +1,54 @@
+#ifndef __RP_COMMAND_TABLE_H__
+#define __RP_COMMAND_TABLE_H__
+
+#include <cstddef>
+#include <stdint.h>
+
+namespace rp {
+
+/**
+ * flags of a command, as redis gives them in COMMAND
+ **/
+enum {
+    CMD_WRITE       = 1 << 0,
+    CMD_READONLY    = 1 << 1,
+    CMD_ADMIN       = 1 << 2,
+    CMD_PUBSUB      = 1 << 3,
+    CMD_NOSCRIPT    = 1 << 4,
+    CMD_BLOCKING    = 1 << 5,
+    CMD_FAST        = 1 << 6,
+    // the keys are found by parsing the args, firstKey..lastKey do not tell
+    CMD_MOVABLEKEYS = 1 << 7,
+};
+
+/**
+ * CommandInfo
+ * arity is the number of args with the name, negative for "at least -arity".
+ * keys are at firstKey, firstKey + keyStep ... lastKey, a negative lastKey
+ * counts from the end, -1 being the last arg. firstKey 0 for no keys.
+ **/
+struct CommandInfo {
+    const char* name;
+    int         arity;
+    uint32_t    flags;
+    int         firstKey;
+    int         lastKey;
+    int         keyStep;
+};
+
+/**
+ * LookupCommand
+ * the entry of the command named name[0..size) in any case,
+ * nullptr for commands unknown to the proxy.
+ **/
+const CommandInfo* LookupCommand( const char* name, std::size_t size );
+
+/**
+ * CommandCount
+ * the number of commands in the table, as COMMAND COUNT tells
+ **/
+std::size_t CommandCount();
+
+}
+
+#endif
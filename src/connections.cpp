@@ -1,6 +1,10 @@
 #include <stdio.h>
+#include <sys/epoll.h>
+#include <limits.h>
+#include <errno.h>
 
 #include "connections.h"
+#include "resolver.h"
 #include "metric.h"
 
 namespace rp {
@@ -39,26 +43,154 @@ void ConnectionPool::RemoveConnection( Connection* conn ) {
 }
 
 Connection::Connection( const ConnectionOptions& opt, ConnectionPool* pool ) :
-    io::Event( pool->Context() ), opt_(opt), flag_(0), connected_(false),
-    sendBuffers_(opt.ConnSendBufferCount), connectionPool_(pool) {;}
+    io::Event( pool->Context() ), opt_(opt), flag_(0), state_(CONN_STATE_CLOSED),
+    sendBuffers_(opt.ConnSendBufferCount), sendSize_(0), resolveId_(0), connectionPool_(pool) {
+    edgeTriggered = opt.NetOpt.EdgeTriggered;
+    connectTimer_.SetCallback( std::bind(&Connection::onConnectTimeout, this) );
+}
+
+Connection::~Connection() {
+    if ( resolveId_ != 0 && context->resolver != nullptr ) {
+        context->resolver->Cancel( resolveId_ );
+    }
+
+    printf("~Connection()\n");
+}
 
 Error Connection::Accept( const io::Addr& addr ) {
     addr_ = addr;
-    connected_ = true;
+    state_ = CONN_STATE_CONNECTED;
 
     return Error::OK;
 }
 
 Error Connection::Connect( const io::Addr& addr ) {
     addr_ = addr;
-    connected_ = true;
-
-    return io::Connect( this, addr_, opt_.NetOpt );
+    return connect();
 }
 
 Error Connection::Reconnect() {
-    connected_ = true;
-    return io::Connect( this, addr_, opt_.NetOpt );
+    return connect();
+}
+
+/**
+ * connect
+ * host names come from the resolver of the loop, when it has to
+ * look one up the connecting goes on in onResolved().
+ * the whole of it is bounded by ConnectTimeout.
+ **/
+Error Connection::connect() {
+    if ( IsConnecting() || IsConnected() ) {
+        return Error::OK;
+    }
+
+    io::ResolvedAddr resolved;
+    Error err;
+
+    flag_ = 0;
+    state_ = CONN_STATE_RESOLVING;
+    if ( opt_.ConnectTimeout > 0 ) {
+        Timers().Start( &connectTimer_, opt_.ConnectTimeout );
+    }
+
+    if ( context->resolver != nullptr ) {
+        using namespace std::placeholders;
+        err = context->resolver->Resolve( addr_, &resolved,
+            std::bind( &Connection::onResolved, this, _1, _2 ), &resolveId_ );
+        if ( err == Error::TryAgain ) {
+            return Error::OK;
+        }
+    } else {
+        err = io::Resolve( addr_, &resolved );
+    }
+
+    if ( err.None() ) {
+        err = startConnect( resolved );
+    }
+
+    if ( !err.None() ) {
+        state_ = CONN_STATE_CLOSED;
+        connectTimer_.Cancel();
+    }
+
+    return err;
+}
+
+Error Connection::startConnect( const io::ResolvedAddr& resolved ) {
+    Error err = io::Connect( this, addr_, resolved, opt_.NetOpt );
+    if ( !err.None() ) {
+        return err;
+    }
+
+    // it completes once the socket turns writable, see finishConnect()
+    state_ = CONN_STATE_CONNECTING;
+    return WatchWritable( true );
+}
+
+/**
+ * finishConnect
+ * the socket became writable, SO_ERROR tells whether connect() made it.
+ **/
+Error Connection::finishConnect() {
+    int soerr = 0;
+    socklen_t len = sizeof(soerr);
+    if ( getsockopt(fd, SOL_SOCKET, SO_ERROR, &soerr, &len) == -1 ) {
+        soerr = errno;
+    }
+
+    if ( soerr != 0 ) {
+        OnError( Error(soerr, strerror(soerr)) );
+        Close();
+        return Error::Closed;
+    }
+
+    WatchWritable( false );
+    connectTimer_.Cancel();
+    state_ = CONN_STATE_CONNECTED;
+
+    // the interest was dropped along with the previous socket
+    if ( readEventHander_ ) {
+        SetReadable( true );
+    }
+
+    if ( !sendBuffers_.Empty() ) {
+        SetWritable( true );
+    }
+
+    if ( connectedEventHandler_ ) {
+        connectedEventHandler_( this );
+    }
+
+    return Error::OK;
+}
+
+void Connection::onResolved( const Error& err, const io::ResolvedAddr& resolved ) {
+    resolveId_ = 0;
+
+    Error cerr( err );
+    if ( cerr.None() ) {
+        cerr = startConnect( resolved );
+    }
+
+    if ( !cerr.None() ) {
+        OnError( cerr );
+        Close();
+    }
+}
+
+void Connection::onConnectTimeout() {
+    if ( resolveId_ != 0 ) {
+        context->resolver->Cancel( resolveId_ );
+        resolveId_ = 0;
+    }
+
+    OnError( Error(ETIMEDOUT, "connect timed out") );
+    Close();
+}
+
+Error Connection::OnConnectedEvent( ConnectedEventHandlerType handler ) {
+    connectedEventHandler_ = handler;
+    return Error::OK;
 }
 
 Error Connection::OnReadEvent( ReadEventHandlerType handler, Buffer* pb ) {
@@ -72,18 +204,47 @@ Error Connection::OnClosedEvent( ClosedEventHandlerType handler ) {
     return Error::OK;
 }
 
+Error Connection::OnWriteEvent( WriteEventHandlerType handler ) {
+    writeEventHander_ = handler;
+    return Error::OK;
+}
+
 Error Connection::WriteToBuffer( const Buffer& b, int flags ) {
-    Error err = SetWritable( true );
-    if ( !err.None() ) {
-        return err; 
+    Error err;
+    if ( IsConnected() ) {
+        err = SetWritable( true );
+        if ( !err.None() ) {
+            return err; 
+        }
+    } else if ( !IsConnecting() ) {
+        return Error::Closed;
     }
 
-    err = sendBuffer_.Append( b.Data(), b.Size() );
-    /**
-    err = sendBuffers_.Push( b );
-    */
-    if ( !err.None() ) {
-        return err; 
+    if ( !b.Empty() ) {
+        err = sendBuffers_.Push( b );
+        if ( err == Error::Full ) {
+            /**
+             * too many slices queued, merge this one into the latest,
+             * which gets a private copy first since the memory is shared.
+             **/
+            Buffer& last( sendBuffers_.Back() );
+            if ( last.Shared() ) {
+                Buffer copy;
+                err = copy.Append( last.Data(), last.Size() );
+                if ( !err.None() ) {
+                    return err;
+                }
+                last = copy;
+            }
+
+            err = last.Append( b.Data(), b.Size() );
+        }
+
+        if ( !err.None() ) {
+            return err; 
+        }
+
+        sendSize_ += b.Size();
     }
 
     if ( NET_FLAG_RST & flags ) {
@@ -94,17 +255,79 @@ Error Connection::WriteToBuffer( const Buffer& b, int flags ) {
     return Error::OK;
 }
 
+/**
+ * flush
+ * writes the queued slices with writev() until all were sent or
+ * the socket would block, returns TryAgain in the latter case.
+ **/
+Error Connection::flush() {
+    iovec iov[IOV_MAX];
+    const Buffer* pins[IOV_MAX];
+
+    while ( !sendBuffers_.Empty() ) {
+        int iovcnt = 0;
+        std::size_t batchSize = 0;
+
+        BuffersType::IteratorType it;
+        sendBuffers_.FromBegin( &it );
+        for ( ; !it.Eof() && iovcnt < IOV_MAX; it.Next() ) {
+            Buffer& buf( *it );
+            iov[iovcnt].iov_base = buf.Data();
+            iov[iovcnt].iov_len = buf.Size();
+            pins[iovcnt] = &buf;
+            batchSize += buf.Size();
+            iovcnt++;
+        }
+
+        //TimeSumMetric* writeDev = MetricFactoryInstance->FetchTimeSum("writedev");
+
+        //writeDev->TimingBegin();
+        std::size_t nwrite = 0;
+        Error err = Writev( iov, pins, iovcnt, &nwrite );
+        //writeDev->Inc();
+
+        if ( !err.None() ) {
+            return err;
+        }
+
+        sendSize_ -= nwrite;
+        bool partial = nwrite < batchSize;
+
+        // release what has been sent, the last one might be partially
+        sendBuffers_.FromBegin( &it );
+        while ( nwrite > 0 ) {
+            Buffer& buf( *it );
+            if ( nwrite < buf.Size() ) {
+                buf.Offset( nwrite );
+                break;
+            }
+
+            nwrite -= buf.Size();
+            buf = Buffer();
+            it.Next();
+        }
+        sendBuffers_.EraseUntil( it );
+
+        if ( partial && !edgeTriggered ) {
+            // the socket is full, wait for the next round
+            return Error::TryAgain;
+        }
+    }
+
+    return Error::OK;
+}
+
 Error Connection::OnWritable() {
-    if ( sendBuffer_.Size() == 0 ) {
+    if ( state_ == CONN_STATE_CONNECTING ) {
+        return finishConnect();
+    }
+
+    if ( sendBuffers_.Empty() && !(flag_ & NET_FLAG_CLOSE) ) {
         SetWritable( false );
         return Error::OK;
     }
 
-    //TimeSumMetric* writeDev = MetricFactoryInstance->FetchTimeSum("writedev");
-
-    //writeDev->TimingBegin();
-    Error err = Write( &sendBuffer_ );
-    //writeDev->Inc();
+    Error err = flush();
 
     bool sentOut = true;
     if ( !err.None() ) {
@@ -114,41 +337,13 @@ Error Connection::OnWritable() {
             printf("write failed:%s\n", err.String().c_str());
             return err;
         }
-    } else {
-        sendBuffer_.Clear();
-    }
-    /**
-    BuffersType::IteratorType it;
-    sendBuffers_.FromBegin( &it );
-    for( ; !it.Eof(); it.Next() ) {
-        Buffer& buf( *it );
-
-        if ( buf.Size() == 0 ) {
-            continue;
-        }
-
-        writeDev->TimingBegin();
-        Error err = Write( &buf );
-        writeDev->Inc();
-
-        if ( !err.None() ) {
-            if ( err == Error::TryAgain ) {
-                sentOut = false;
-                break;
-            } else {
-                printf("write failed:%s\n", err.String().c_str());
-                return;
-            }
-        }        
     }
-    sendBuffers_.EraseUntil(it);
-    */
 
     if (writeEventHander_) {
         writeEventHander_( this );
     }
 
-    if ( flag_ & NET_FLAG_CLOSE ) {
+    if ( sentOut && (flag_ & NET_FLAG_CLOSE) ) {
         Error err = Close( flag_ );
         if ( !err.None() ) {
             // Log this error
@@ -157,7 +352,8 @@ Error Connection::OnWritable() {
         return Error::Closed;
     }
 
-    if ( sentOut ) {
+    // the handler might have queued more
+    if ( sentOut && sendBuffers_.Empty() ) {
         SetWritable( false );
     }
 
@@ -171,25 +367,47 @@ Error Connection::OnReadable() {
         return Error::OK;
     }
 
-    Error err = Read( recvBuffer_ );
-    if ( !err.None() ) {
-        if ( err != Error::Full ) { 
-            printf("Read failed:%s\n", err.String().c_str());
-            return err; 
+    do {
+        Error err = Read( recvBuffer_ );
+        if ( !err.None() ) {
+            if ( err == Error::TryAgain ) {
+                // drained
+                break;
+            }
+
+            if ( err != Error::Full ) { 
+                printf("Read failed:%s\n", err.String().c_str());
+                return err; 
+            }
+            
+            printf("recv buffer is unexpected full\n");
         }
-        
-        printf("recv buffer is unexpected full\n");
-    }
 
-    if (readEventHander_) {
-        readEventHander_( this, recvBuffer_ );
-    }
+        if (readEventHander_) {
+            readEventHander_( this, recvBuffer_ );
+        }
+
+        /**
+         * under edge-triggered mode, read until EAGAIN unless 
+         * the handler paused reading, which requeues it when resumed.
+         **/
+    } while ( edgeTriggered && (events & EPOLLIN) );
 
     return Error::OK;
 }
 
 void Connection::OnClosed() {
-    connected_ = false;
+    state_ = CONN_STATE_CLOSED;
+    connectTimer_.Cancel();
+
+    // nothing queued makes sense on another socket
+    BuffersType::IteratorType it;
+    for ( sendBuffers_.FromBegin( &it ); !it.Eof(); it.Next() ) {
+        *it = Buffer();
+    }
+    sendBuffers_.EraseUntil( it );
+    sendSize_ = 0;
+    flag_ = 0;
 
     if (closedEventHandler_) {
         closedEventHandler_( this );
@@ -25,6 +25,27 @@ struct ConnectionOptions : public OptionsLoader {
     std::size_t ConnSendBufferCount;
     std::size_t ConnPoolSize;
 
+    /**
+     * in ms, bounds resolving plus connecting, 0 waits forever.
+     * a lost upstream is retried after ReconnectInterval, which
+     * doubles with each failure in a row, up to 32 times as long.
+     **/
+    int ConnectTimeout;
+    int ReconnectInterval;
+
+    /**
+     * of clients, a request with a bulk of StreamBulkSize or more is passed
+     * on as it comes instead of held in full, 0 holds them all.
+     * of upstreams, such a request waits while StreamPendingSize is queued
+     * to the server and not sent yet, 0 does not wait.
+     * the same the other way: a reply of StreamBulkSize or more goes to the
+     * client as it comes, and its upstream stops reading while the client
+     * has StreamPendingSize queued, the replies behind it on that upstream
+     * wait as well then.
+     **/
+    std::size_t StreamBulkSize;
+    std::size_t StreamPendingSize;
+
     std::string name;
     ConnectionOptions( const std::string& n );
     virtual ~ConnectionOptions() {}
@@ -35,6 +56,10 @@ struct ConnectionOptions : public OptionsLoader {
         else if ( key == "ReadBufferMinSize" ) { ReadBufferMinSize = std::stoi(value); }
         else if ( key == "ConnSendBufferCount" ) { ConnSendBufferCount = std::stoi(value); }
         else if ( key == "ConnPoolSize" ) { ConnPoolSize = std::stoi(value); }
+        else if ( key == "ConnectTimeout" ) { ConnectTimeout = std::stoi(value); }
+        else if ( key == "ReconnectInterval" ) { ReconnectInterval = std::stoi(value); }
+        else if ( key == "StreamBulkSize" ) { StreamBulkSize = std::stoul(value); }
+        else if ( key == "StreamPendingSize" ) { StreamPendingSize = std::stoul(value); }
         else {
             return Error::Unknown;
         }
@@ -56,6 +81,13 @@ enum {
     CONN_SEND_BUFFER_SIZE   = 32
 };
 
+enum {
+    CONN_STATE_CLOSED,
+    CONN_STATE_RESOLVING,
+    CONN_STATE_CONNECTING,
+    CONN_STATE_CONNECTED,
+};
+
 class Session;
 class ConnectionPool;
 
@@ -66,12 +98,13 @@ class Connection : public io::Event {
 public:
     typedef std::function<Error ( Connection* )>  WriteEventHandlerType;
     typedef std::function<Error ( Connection* )>  ClosedEventHandlerType;
+    typedef std::function<Error ( Connection* )>  ConnectedEventHandlerType;
     typedef std::function<Error ( Connection*, Buffer* )>  ReadEventHandlerType;
     typedef std::function<Error ( Connection*, const Error& )>  ErrorEventHandlerType;
 
 public:
     explicit Connection( const ConnectionOptions& opt, ConnectionPool* pool );
-    virtual ~Connection() { printf("~Connection()\n"); }
+    virtual ~Connection();
 
 public:
     const io::Addr& GetAddr() const { return addr_; } 
@@ -81,17 +114,24 @@ public:
     Error Reconnect();
 
 public:
-    bool IsConnected() const { return connected_; }
+    bool IsConnected() const { return state_ == CONN_STATE_CONNECTED; }
+    /**
+     * resolving or waiting for connect() to complete,
+     * what is written meanwhile is sent once connected.
+     **/
+    bool IsConnecting() const { return state_ == CONN_STATE_RESOLVING || state_ == CONN_STATE_CONNECTING; }
     bool IsClosed() const;
     bool IsError() const;
     bool IsIdle() const;
 
 public:
     Error WriteToBuffer( const Buffer& b, int flags = 0 ); //NET_FLAG_CLOSE | NET_FLAG_RST
+    std::size_t PendingSize() const { return sendSize_; }
 
 public:
     Error OnWriteEvent( WriteEventHandlerType handler );
     Error OnClosedEvent( ClosedEventHandlerType handler );
+    Error OnConnectedEvent( ConnectedEventHandlerType handler );
     Error OnReadEvent( ReadEventHandlerType handler, Buffer* pb );
     Error OnErrorEvent( ErrorEventHandlerType handler );
 
@@ -113,19 +153,39 @@ private:
     const ConnectionOptions& opt_;
     io::Addr    addr_;
     int flag_;
-    bool connected_;
+    int state_;
 
 private:
     Buffer* recvBuffer_;
-    Buffer sendBuffer_;
 
+    /**
+     * the slices waiting to be sent, they share the memory with
+     * whoever produced them and are flushed by writev().
+     **/
     typedef Recycle<Buffer> BuffersType;
     BuffersType sendBuffers_;
+    std::size_t sendSize_;
+
+private:
+    Error flush();
+    Error connect();
+    Error startConnect( const io::ResolvedAddr& resolved );
+    Error finishConnect();
+    void onResolved( const Error& err, const io::ResolvedAddr& resolved );
+    void onConnectTimeout();
+
+    Timer   connectTimer_;
+
+    /**
+     * the pending lookup of the resolver, 0 if none
+     **/
+    uint64_t resolveId_;
 
 private:
     WriteEventHandlerType    writeEventHander_;
     ReadEventHandlerType    readEventHander_;
     ClosedEventHandlerType  closedEventHandler_;
+    ConnectedEventHandlerType   connectedEventHandler_;
     ErrorEventHandlerType    errorEventHander_;
 
 private:
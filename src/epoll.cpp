@@ -1,5 +1,7 @@
 
+#ifndef RP_USE_URING
 #define RP_USE_EPOLL
+#endif
 
 #ifdef RP_USE_EPOLL
 
@@ -15,7 +17,12 @@
 
 namespace rp { namespace io {
 
-struct epollState {
+enum {
+    EPOLL_EVENTS_INIT   = 128,
+    EPOLL_EVENTS_MAX    = 16384,
+};
+
+struct epollState : public LoopState {
     int epfd;
 
     epoll_event *events;
@@ -34,7 +41,7 @@ Error Init( ContextType* context, const NetIoOptions& opt ) {
         return Error::InitFailed;
     }
 
-    es->eventsLength = 100;
+    es->eventsLength = EPOLL_EVENTS_INIT;
     es->events = new epoll_event[ es->eventsLength ];
 
     *context = static_cast<ContextType>(es);
@@ -44,6 +51,8 @@ Error Init( ContextType* context, const NetIoOptions& opt ) {
 Error Deinit( ContextType context ) {
     epollState* es = static_cast<epollState*>(context);
     if ( es != nullptr ) {
+        close( es->epfd );
+        delete[] es->events;
         delete es;
     }
     
@@ -56,28 +65,42 @@ Error Deinit( ContextType context ) {
 Error PollOnce( ContextType context, Event* listenEvt, const NetIoOptions& opt ) {
     epollState* es = static_cast<epollState*>(context);
 
-    //TimeSumMetric* acceptMetric = MetricFactoryInstance->FetchTimeSum( "accept" );
     //TimeSumMetric* readMetric = MetricFactoryInstance->FetchTimeSum( "read" );
     //TimeSumMetric* writeMetric = MetricFactoryInstance->FetchTimeSum( "write" );
     //TimeSumMetric* epollwaitMetric = MetricFactoryInstance->FetchTimeSum( "epollwait" );
 
-    Event::HandleWriteEvents();
+    Event::HandleWriteEvents( context );
+    Event::HandleReadEvents( context );
+
+    int timeout = PollTimeout( context, opt );
+    int numevents = 0;
 
-    //epollwaitMetric->TimingBegin();
-    int numevents = epoll_wait( es->epfd, es->events, es->eventsLength, 10 );
-    //epollwaitMetric->Inc();
+    if ( opt.BusyPollUs > 0 && timeout > 0 ) {
+        // spin for a while before giving the cpu away
+        int64_t deadline = context->timers.UpdateClock() + opt.BusyPollUs;
+        do {
+            numevents = epoll_wait( es->epfd, es->events, es->eventsLength, 0 );
+        } while ( numevents == 0 && context->timers.UpdateClock() < deadline );
+    }
+
+    if ( numevents == 0 ) {
+        //epollwaitMetric->TimingBegin();
+        numevents = epoll_wait( es->epfd, es->events, es->eventsLength, timeout );
+        //epollwaitMetric->Inc();
+    }
+
+    // one clock reading for everything done in this round
+    context->timers.UpdateClock();
 
     if ( numevents > 0 ) {
         for ( int i = 0; i < numevents; i++ ) {
             epoll_event& evData( es->events[i] );
             
             if ( evData.data.ptr == listenEvt ) {
-                //acceptMetric->TimingBegin();
                 Error err = Accept( listenEvt, opt );
-                //acceptMetric->Inc();
 
                 if ( !err.None() ) {
-                    LogErrorf( "Accept() failed:%s", err.Message() );
+                    LogErrorf( "Accept() failed:%s", err.String().c_str() );
                 }
             } else {
                 Event* evt = static_cast<Event*>(evData.data.ptr);
@@ -86,6 +109,18 @@ Error PollOnce( ContextType context, Event* listenEvt, const NetIoOptions& opt )
                 if ( evData.events & (EPOLLHUP | EPOLLERR) ) {
                     evt->OnError( Error(evData.events, "epoll events") );
                     evt->Close();
+                } else if ( evt->edgeTriggered ) {
+                    // registered for both directions, filter by the current interest
+                    if ( (evData.events & (EPOLLIN | EPOLLRDHUP)) && (evt->events & EPOLLIN) ) {
+                        Error err = evt->OnReadable();
+                        if ( !err.None() ) {
+                            continue;
+                        }
+                    }
+
+                    if ( (evData.events & EPOLLOUT) && (evt->events & EPOLLOUT) ) {
+                        evt->OnWritable();
+                    }
                 } else {
                     if ( evData.events & EPOLLIN ) {
                         //readMetric->TimingBegin();
@@ -113,6 +148,15 @@ Error PollOnce( ContextType context, Event* listenEvt, const NetIoOptions& opt )
         }
     }
 
+    if ( numevents == es->eventsLength && es->eventsLength < EPOLL_EVENTS_MAX ) {
+        // the array was filled up, more are probably ready
+        es->eventsLength *= 2;
+        delete[] es->events;
+        es->events = new epoll_event[ es->eventsLength ];
+    }
+
+    context->timers.Run();
+
     return Error::OK;
 }
 
@@ -125,12 +169,20 @@ Error Event::Attach() {
     if ( fd == -1 ) { 
         return Error::InitFailed; 
     }
-    
-    if ( events == 0 ) { 
-        return Error::OK; 
+
+    if ( edgeTriggered ) {
+        if ( registered ) {
+            return Error::OK;
+        }
+        // once for all, the interest is filtered in PollOnce()
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    } else {
+        if ( kernelInterest() == 0 ) { 
+            return Error::OK; 
+        }
+        ev.events = kernelInterest();
     }
 
-    ev.events = events;
     ev.data.ptr = this;
 
     epollState* es = static_cast<epollState*>(context);
@@ -138,46 +190,65 @@ Error Event::Attach() {
         return Error( errno, strerror(errno) );
     }
 
+    registered = true;
+    if ( edgeTriggered && (events & EPOLLIN) ) {
+        // the data might have come before being registered
+        queueRead();
+    }
+
     return Error::OK;
 }
 
 Error Event::RemoveNotify() {
+    dequeue();
+    events = 0;
+    registered = false;
+
     epollState* es = static_cast<epollState*>(context);
     if( epoll_ctl(es->epfd, EPOLL_CTL_DEL, fd, NULL) == -1 ) {
         return Error( errno, strerror(errno) );
     }
 
-    events = 0;
     return Error::OK;
 }
 
-Error Event::SetWritable( bool flag ) {
-    if ( flag ) {
-        if ( !(events & EPOLLOUT) ) {
-            events |= EPOLLOUT;
-            writeListPos = writeEvents.insert( writeEvents.end(), this );
-        }
-    } else {
-        if ( events & EPOLLOUT ) {
-            events &= ~EPOLLOUT;
-            writeEvents.erase( writeListPos );
-        }
-    }
+Error Event::SetReadable( bool flag ) {
+    return operateNotify( EPOLLIN, flag );
+}
 
-    return Error::OK;
-    //return operateNotify( EPOLLOUT, flag );
+ssize_t Event::receive( char* data, std::size_t size ) {
+    return read( fd, data, size );
 }
 
-Error Event::SetReadable( bool flag ) {
-    return operateNotify( EPOLLIN, flag );
+ssize_t Event::transmit( const iovec* iov, const Buffer* const* pins, int iovcnt ) {
+    return writev( fd, iov, iovcnt );
 }
 
 Error Event::operateNotify( int newEvents, bool flag ) {
     epoll_event evData;
 
-    int op = EPOLL_CTL_MOD;
-    if ( events == 0 ) {
-        op = EPOLL_CTL_ADD;
+    if ( edgeTriggered ) {
+        int oldEvents = events;
+        if (flag) {
+            events |= newEvents;
+        } else {
+            events &= ~newEvents;
+        }
+
+        if ( fd == -1 ) {
+            return Error::OK;
+        }
+
+        if ( !registered ) {
+            return Attach();
+        }
+
+        if ( (events & EPOLLIN) && !(oldEvents & EPOLLIN) ) {
+            // the edge might have been consumed while it was disabled
+            queueRead();
+        }
+
+        return Error::OK;
     }
 
     if (flag) {
@@ -197,11 +268,20 @@ Error Event::operateNotify( int newEvents, bool flag ) {
         return Error::OK;
     }
 
-    if ( events == 0 ) {
+    /**
+     * the EPOLLOUT of the write list is polled by the loop itself,
+     * what the kernel has is told by `registered` instead.
+     **/
+    int kernelEvents = kernelInterest();
+    int op = registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+    if ( kernelEvents == 0 ) {
+        if ( !registered ) {
+            return Error::OK;
+        }
         op = EPOLL_CTL_DEL;
     }
 
-    evData.events = events;
+    evData.events = kernelEvents;
     evData.data.ptr = static_cast<void *>(this);
 
     epollState* es = static_cast<epollState*>(context);
@@ -209,6 +289,7 @@ Error Event::operateNotify( int newEvents, bool flag ) {
         return Error( errno, strerror(errno) );
     }
 
+    registered = op != EPOLL_CTL_DEL;
     return Error::OK;
 }
 
@@ -23,6 +23,10 @@ const Error Error::Exhausted(-502, "Exhausted");
 const Error Error::OutOfBound(-504, "OutOfBound");
 const Error Error::NotFound(-404, "NotFound");
 
+const Error Error::Protocol(-400, "Protocol");
+const Error Error::CrossSlot(-409, "CrossSlot");
+const Error Error::KeysUnseen(-410, "KeysUnseen");
+
 }
 
 namespace rp {
@@ -29,6 +29,12 @@ public:
     const static Error OutOfBound;
     const static Error NotFound;
 
+    const static Error Protocol;
+    // the keys of a request are in more than one cluster slot
+    const static Error CrossSlot;
+    // a streamed request has keys after its head, it can not be placed
+    const static Error KeysUnseen;
+
 private:
     //mem::RefType   data_;
     int code_;
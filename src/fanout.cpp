@@ -0,0 +1,511 @@
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unordered_map>
+
+#include "fanout.h"
+#include "reply.h"
+#include "metric.h"
+
+namespace rp {
+
+enum {
+    // the values of the parts in one array, in the order of the keys
+    MERGE_ARRAY = 0,
+    // the sum of the integers of the parts
+    MERGE_SUM   = 1,
+    // +OK once every part is
+    MERGE_OK    = 2,
+};
+
+static const struct {
+    const char* name;
+    int merge;
+} fanOutCommands[] = {
+    { "mget", MERGE_ARRAY }, { "mset", MERGE_OK }, { "del", MERGE_SUM },
+    { "exists", MERGE_SUM }, { "touch", MERGE_SUM }, { "unlink", MERGE_SUM },
+};
+
+static int mergeOf( const Cmd& cmd ) {
+    const CommandInfo* info = cmd.Info();
+    if ( info == nullptr || cmd.Streaming() ) {
+        return -1;
+    }
+
+    for ( std::size_t i = 0; i < sizeof(fanOutCommands) / sizeof(fanOutCommands[0]); ++i ) {
+        if ( strcmp( info->name, fanOutCommands[i].name ) == 0 ) {
+            return info->keyStep > 0 ? fanOutCommands[i].merge : -1;
+        }
+    }
+    return -1;
+}
+
+bool FanOut::Splits( const Cmd& cmd ) {
+    return mergeOf( cmd ) >= 0;
+}
+
+Error FanOut::Push( const Cmd& cmd, KeyBucketType bucket, const void* ctx,
+    BackendOfType backendOf, UpstreamReader* reader, uint64_t tag ) {
+    int merge = mergeOf( cmd );
+    if ( merge < 0 ) {
+        return Error::CrossSlot;
+    }
+
+    // MSET without the value of its last key, the server refuses it as a whole
+    if ( cmd.GetArgSize() % cmd.Info()->keyStep != 0 ) {
+        Slice key = cmd.GetArg( 0 );
+        Backend* backend = backendOf( bucket( ctx, key.Data(), key.Size() ) );
+        if ( backend == nullptr || !backend->IsAcceptable() ) {
+            return Error::Closed;
+        }
+        return backend->PushRequest( cmd, reader, tag );
+    }
+
+    FanOut* fanOut = new FanOut( reader, tag, merge );
+    Error err = fanOut->split( cmd, bucket, ctx );
+    if ( err.None() ) {
+        err = fanOut->push( backendOf );
+    }
+
+    if ( !err.None() ) {
+        delete fanOut;
+        // more parts than a link can queue, the client has to split it
+        if ( err == Error::Exhausted ) {
+            return Error::CrossSlot;
+        }
+        return err;
+    }
+
+    MetricFactoryInstance->FetchTimeSum( "fanout" )->Inc();
+    return Error::OK;
+}
+
+/**
+ * split
+ * the keys are grouped by their bucket, each with its value for MSET,
+ * into a cmd of the same name for each bucket.
+ **/
+Error FanOut::split( const Cmd& cmd, KeyBucketType bucket, const void* ctx ) {
+    int step = cmd.Info()->keyStep;
+    std::size_t keys = cmd.GetArgSize() / step;
+
+    std::unordered_map<int, uint32_t> partOf;
+    std::vector<std::size_t> sizes;
+    owners_.resize( keys );
+    for ( std::size_t k = 0; k < keys; ++k ) {
+        Slice key = cmd.GetArg( k * step );
+        int b = bucket( ctx, key.Data(), key.Size() );
+
+        std::pair<std::unordered_map<int, uint32_t>::iterator, bool> it = partOf.insert( std::make_pair( b, (uint32_t)parts_.size() ) );
+        if ( it.second ) {
+            parts_.push_back( Part() );
+            parts_.back().bucket = b;
+            parts_.back().keys = 0;
+            sizes.push_back( 0 );
+        }
+
+        uint32_t p = it.first->second;
+        owners_[k] = p;
+        parts_[p].keys++;
+        for ( int i = 0; i < step; ++i ) {
+            sizes[p] += cmd.GetArg( k * step + i ).Size();
+        }
+    }
+
+    Slice name = cmd.GetCmd();
+    for ( std::size_t p = 0; p < parts_.size(); ++p ) {
+        Part& part( parts_[p] );
+        Error err = part.cmd.Reserve( 1 + part.keys * step, name.Size() + sizes[p] );
+        if ( err.None() ) {
+            err = part.cmd.AppendArg( name.Data(), name.Size() );
+        }
+        if ( !err.None() ) {
+            return err;
+        }
+    }
+
+    for ( std::size_t k = 0; k < keys; ++k ) {
+        Cmd& part( parts_[owners_[k]].cmd );
+        for ( int i = 0; i < step; ++i ) {
+            Slice arg = cmd.GetArg( k * step + i );
+            Error err = part.AppendArg( arg.Data(), arg.Size() );
+            if ( !err.None() ) {
+                return err;
+            }
+        }
+    }
+
+    return Error::OK;
+}
+
+/**
+ * push
+ * every link the parts go on is asked for room for all of its parts first,
+ * a part can not go out alone and leave the others waiting.
+ **/
+Error FanOut::push( BackendOfType backendOf ) {
+    std::vector<Backend*> backends( parts_.size() );
+    for ( std::size_t p = 0; p < parts_.size(); ++p ) {
+        backends[p] = backendOf( parts_[p].bucket );
+        if ( backends[p] == nullptr || !backends[p]->IsAcceptable() ) {
+            return Error::Closed;
+        }
+    }
+
+    std::unordered_map<Upstream*, std::size_t> counts;
+    for ( std::size_t p = 0; p < parts_.size(); ++p ) {
+        parts_[p].upstream = backends[p]->Pick( this );
+        counts[parts_[p].upstream]++;
+    }
+
+    for ( std::unordered_map<Upstream*, std::size_t>::iterator it = counts.begin(); it != counts.end(); ++it ) {
+        Error err = it->first->Reserve( it->second, reader_ );
+        if ( !err.None() ) {
+            return err;
+        }
+    }
+
+    static const char msg[] = "-ERR upstream unavailable\r\n";
+
+    // held until every part is out, a reply can not complete it meanwhile
+    pending_ = parts_.size() + 1;
+    for ( std::size_t p = 0; p < parts_.size(); ++p ) {
+        Error err = parts_[p].upstream->PushRequest( parts_[p].cmd, this, p );
+        if ( !err.None() ) {
+            if ( p == 0 ) {
+                return err;
+            }
+
+            LogWarnf( "fan-out part failed:%s", err.String().c_str() );
+            parts_[p].reply = Buffer( msg, sizeof(msg) - 1 );
+            pending_--;
+        }
+    }
+
+    OnServerWrite( Buffer(), parts_.size() );
+    return Error::OK;
+}
+
+void FanOut::SetLink( int link ) {
+    link_ = link;
+    reader_->SetLink( link );
+}
+
+void FanOut::OnServerWrite( const Buffer& buffer, uint64_t tag ) {
+    if ( tag < parts_.size() ) {
+        parts_[tag].reply = buffer;
+    }
+
+    if ( --pending_ > 0 ) {
+        return;
+    }
+
+    if ( reader_->Identity() == identity_ ) {
+        reader_->OnServerWrite( merge(), tag_ );
+    }
+    delete this;
+}
+
+static Buffer errorReply( const char* msg ) {
+    return Buffer( msg, strlen(msg) );
+}
+
+Buffer FanOut::merge() const {
+    // the first error in the order of the parts stands for the whole
+    for ( std::size_t p = 0; p < parts_.size(); ++p ) {
+        const Buffer& reply( parts_[p].reply );
+        if ( reply.Empty() ) {
+            return errorReply( "-ERR upstream connection lost\r\n" );
+        }
+        if ( reply.Data()[0] == '-' || reply.Data()[0] == '!' ) {
+            return reply;
+        }
+    }
+
+    switch ( merge_ ) {
+    case MERGE_ARRAY:
+        return mergeArray();
+    case MERGE_SUM:
+        return mergeSum();
+    default:
+        return parts_[0].reply;
+    }
+}
+
+/**
+ * mergeArray
+ * the elements of each part are framed one by one, then laid out again
+ * by the key they answer.
+ **/
+Buffer FanOut::mergeArray() const {
+    // where the elements of each part begin in spans
+    std::vector<std::size_t> first( parts_.size() );
+    std::vector<std::pair<std::size_t, std::size_t> > spans;
+    spans.reserve( owners_.size() );
+
+    std::size_t size = 0;
+    for ( std::size_t p = 0; p < parts_.size(); ++p ) {
+        const Part& part( parts_[p] );
+        const char* data = part.reply.Data();
+        const char* cr = (const char *)memchr( data, '\r', part.reply.Size() );
+        if ( data[0] != '*' || cr == nullptr || strtoll( data + 1, nullptr, 10 ) != (long long)part.keys ) {
+            return errorReply( "-ERR bad reply from upstream\r\n" );
+        }
+
+        std::size_t head = cr - data + 2;
+        Buffer elements;
+        if ( head > part.reply.Size() || !elements.Append( part.reply, head, part.reply.Size() - head ).None() ) {
+            return errorReply( "-ERR bad reply from upstream\r\n" );
+        }
+
+        first[p] = spans.size();
+        BufferReader br( elements );
+        impl::ReplyParser parser;
+        for ( std::size_t i = 0; i < part.keys; ++i ) {
+            std::size_t offset = br.Offset();
+            if ( !parser.HandleResponse( br ).None() ) {
+                return errorReply( "-ERR bad reply from upstream\r\n" );
+            }
+            parser.Reset();
+
+            spans.push_back( std::make_pair( head + offset, br.Offset() - offset ) );
+            size += br.Offset() - offset;
+        }
+    }
+
+    char head[32];
+    int n = snprintf( head, sizeof(head), "*%zu\r\n", owners_.size() );
+
+    Buffer reply;
+    Error err = reply.AppendCapacity( n + size );
+    if ( err.None() ) {
+        err = reply.Append( head, n );
+    }
+
+    std::vector<std::size_t> next( first );
+    for ( std::size_t k = 0; k < owners_.size() && err.None(); ++k ) {
+        uint32_t p = owners_[k];
+        const std::pair<std::size_t, std::size_t>& span( spans[next[p]++] );
+        err = reply.Append( parts_[p].reply.Data() + span.first, span.second );
+    }
+
+    if ( !err.None() ) {
+        return errorReply( "-ERR out of memory merging the reply\r\n" );
+    }
+    return reply;
+}
+
+Buffer FanOut::mergeSum() const {
+    long long sum = 0;
+    for ( std::size_t p = 0; p < parts_.size(); ++p ) {
+        const Buffer& reply( parts_[p].reply );
+        if ( reply.Data()[0] != ':' ) {
+            return errorReply( "-ERR bad reply from upstream\r\n" );
+        }
+        sum += strtoll( reply.Data() + 1, nullptr, 10 );
+    }
+
+    char reply[32];
+    int n = snprintf( reply, sizeof(reply), ":%lld\r\n", sum );
+    return Buffer( reply, n );
+}
+
+}
+
+#ifdef RP_FANOUT_TEST
+/**
+ * g++ -std=c++0x -DRP_FANOUT_TEST fanout.cpp <the other objects but main.o> -o fanout_test
+ **/
+#include <map>
+#include <string>
+
+namespace rp {
+
+struct TestReader : public UpstreamReader {
+    std::string reply;
+    uint64_t tag;
+    int replies;
+
+    TestReader() : tag(0), replies(0) {}
+    virtual uint64_t Identity() const { return 1; }
+    virtual void OnServerWrite( const Buffer& buffer, uint64_t t ) {
+        reply.assign( buffer.Data(), buffer.Size() );
+        tag = t;
+        replies++;
+    }
+};
+
+/**
+ * FanOutTest
+ * a cmd split for real, the parts answered by a server made up here,
+ * in the reverse order. a key is in the bucket of its first letter.
+ **/
+struct FanOutTest {
+    std::map<std::string, std::string> store;
+    int bucketed;
+
+    FanOutTest() : bucketed(0) {}
+
+    static int bucketOf( const void* ctx, const char* key, std::size_t size ) {
+        const_cast<FanOutTest *>( static_cast<const FanOutTest *>( ctx ) )->bucketed++;
+        return size > 0 ? key[0] - 'a' : 0;
+    }
+
+    static Error parse( const char* request, Cmd* cmd ) {
+        static CmdParser parser;
+        parser.Reset();
+        Error err = parser.GetInputBuffer()->Append( request, strlen(request) );
+        if ( err.None() ) {
+            err = parser.GetInputBuffer()->Append( "\r\n", 2 );
+        }
+        if ( err.None() ) {
+            err = parser.ParseRequest( cmd );
+        }
+        return err;
+    }
+
+    /**
+     * the reply of a part: a key with "err" in it fails it, "short" has
+     * an element missing of MGET, "cut" has the link lost.
+     **/
+    std::string serve( const Cmd& cmd ) {
+        std::string name( cmd.GetCmd().Data(), cmd.GetCmd().Size() );
+        std::vector<std::string> args;
+        for ( std::size_t i = 0; i < cmd.GetArgSize(); ++i ) {
+            args.push_back( std::string( cmd.GetArg( i ).Data(), cmd.GetArg( i ).Size() ) );
+        }
+
+        for ( std::size_t i = 0; i < args.size(); ++i ) {
+            if ( args[i].find( "err" ) != std::string::npos ) {
+                return "-ERR " + args[i] + "\r\n";
+            }
+            if ( args[i].find( "cut" ) != std::string::npos ) {
+                return "";
+            }
+        }
+
+        if ( name == "mset" ) {
+            for ( std::size_t i = 0; i + 1 < args.size(); i += 2 ) {
+                store[args[i]] = args[i + 1];
+            }
+            return "+OK\r\n";
+        }
+
+        std::string reply;
+        std::size_t count = 0;
+        for ( std::size_t i = 0; i < args.size(); ++i ) {
+            std::map<std::string, std::string>::iterator it = store.find( args[i] );
+            if ( it == store.end() ) {
+                reply += "$-1\r\n";
+                continue;
+            }
+
+            count++;
+            if ( name == "del" ) {
+                store.erase( it );
+            } else {
+                reply += "$" + std::to_string( it->second.size() ) + "\r\n" + it->second + "\r\n";
+            }
+        }
+
+        if ( name == "mget" ) {
+            std::size_t elements = args.size();
+            if ( args[0].find( "short" ) != std::string::npos ) {
+                elements--;
+                reply = reply.substr( 0, reply.rfind( "$" ) );
+            }
+            return "*" + std::to_string( elements ) + "\r\n" + reply;
+        }
+        return ":" + std::to_string( count ) + "\r\n";
+    }
+
+    std::string run( const char* request, std::size_t* parts = nullptr ) {
+        Cmd cmd;
+        if ( !parse( request, &cmd ).None() || !FanOut::Splits( cmd ) ) {
+            return "not split";
+        }
+
+        TestReader reader;
+        FanOut* fanOut = new FanOut( &reader, 7, mergeOf( cmd ) );
+        if ( !fanOut->split( cmd, bucketOf, this ).None() ) {
+            delete fanOut;
+            return "split failed";
+        }
+
+        std::size_t n = fanOut->parts_.size();
+        if ( parts != nullptr ) {
+            *parts = n;
+        }
+
+        // as push() leaves it
+        fanOut->pending_ = n + 1;
+        fanOut->OnServerWrite( Buffer(), n );
+        for ( std::size_t p = n; p-- > 0; ) {
+            std::string reply = serve( fanOut->parts_[p].cmd );
+            fanOut->OnServerWrite( Buffer( reply.data(), reply.size() ), p );
+        }
+
+        if ( reader.replies != 1 || reader.tag != 7 ) {
+            return "replied " + std::to_string( reader.replies ) + " times";
+        }
+        return reader.reply;
+    }
+};
+
+}
+
+static int failed = 0;
+
+static void expect( const char* name, const std::string& got, const std::string& expected ) {
+    if ( got == expected ) {
+        printf( "%s ok\n", name );
+        return;
+    }
+
+    printf( "%s got %s expected %s\n", name, got.c_str(), expected.c_str() );
+    failed++;
+}
+
+static rp::Backend* noBackend( std::vector<int>* asked, int bucket ) {
+    asked->push_back( bucket );
+    return nullptr;
+}
+
+int main() {
+    rp::FanOutTest t;
+    std::size_t parts = 0;
+
+    expect( "mset", t.run( "mset a1 x b1 y a2 z c1 w", &parts ), "+OK\r\n" );
+    expect( "mset parts", std::to_string( parts ), "3" );
+    // in the order of the keys, the missing ones nil
+    expect( "mget", t.run( "mget c1 a1 b9 b1 a2 a9" ),
+        "*6\r\n$1\r\nw\r\n$1\r\nx\r\n$-1\r\n$1\r\ny\r\n$1\r\nz\r\n$-1\r\n" );
+    expect( "mget one key twice", t.run( "mget a1 b1 a1" ), "*3\r\n$1\r\nx\r\n$1\r\ny\r\n$1\r\nx\r\n" );
+    expect( "exists", t.run( "exists a1 b1 b9 c1 a1" ), ":4\r\n" );
+    expect( "del", t.run( "del a1 b1 b9 c1" ), ":3\r\n" );
+    expect( "del again", t.run( "del a1 b1 c1 a2" ), ":1\r\n" );
+    expect( "touch", t.run( "touch a2 b2" ), ":0\r\n" );
+
+    // the error of the first part, though the parts replied the other way round
+    expect( "first error", t.run( "mget a1 berr1 cerr2" ), "-ERR berr1\r\n" );
+    expect( "first error of sum", t.run( "del cerr1 a1 berr2" ), "-ERR cerr1\r\n" );
+    expect( "link lost", t.run( "mget a1 bcut cerr" ), "-ERR upstream connection lost\r\n" );
+    expect( "wrong element count", t.run( "mget a1 bshort b2" ), "-ERR bad reply from upstream\r\n" );
+    expect( "not a multi-key cmd", t.run( "get a1" ), "not split" );
+
+    // MSET without the value of its last key goes whole to the first key
+    rp::Cmd cmd;
+    rp::TestReader reader;
+    std::vector<int> asked;
+    t.bucketed = 0;
+    rp::FanOutTest::parse( "mset b1 x a1", &cmd );
+    rp::Error err = rp::FanOut::Push( cmd, rp::FanOutTest::bucketOf, &t,
+        std::bind( noBackend, &asked, std::placeholders::_1 ), &reader, 7 );
+    expect( "odd mset", err.String() + " " + std::to_string( t.bucketed ) + " " + std::to_string( asked.size() ) +
+        " " + std::to_string( asked.empty() ? -1 : asked[0] ), rp::Error::Closed.String() + " 1 1 1" );
+
+    printf( "%d failed\n", failed );
+    return failed == 0 ? 0 : 1;
+}
+#endif
@@ -0,0 +1,103 @@
+#ifndef __RP_FANOUT_H__
+#define __RP_FANOUT_H__
+
+#include <stdint.h>
+#include <vector>
+#include <functional>
+
+#include "upstream.h"
+#include "keys.h"
+
+namespace rp {
+
+/**
+ * FanOut
+ * a multi-key cmd with its keys in more than one bucket, split into one cmd
+ * for the keys of each bucket. the parts go out together and the replies
+ * are put back together in the order of the keys, the reader which pushed
+ * the whole gets one reply with its tag as if one server had answered.
+ * it lives until the last part has replied and deletes itself then.
+ *
+ * MGET has the values merged in one array, DEL, EXISTS, TOUCH and UNLINK
+ * the counts summed up, MSET +OK once all the parts are set. an error of
+ * any part is the reply of the whole, though the other parts did run.
+ **/
+class FanOut : public UpstreamReader {
+public:
+    /**
+     * the backend of a bucket, nullptr when there is none
+     **/
+    typedef std::function<Backend* (int bucket)>    BackendOfType;
+
+public:
+    /**
+     * cmd is one of the commands which are split
+     **/
+    static bool Splits( const Cmd& cmd );
+
+    /**
+     * Push
+     * splits cmd by the bucket of its keys and pushes the parts to the
+     * backends of their buckets. nothing goes out unless every part can,
+     * Closed while a backend is down, TryAgain while one has no room.
+     **/
+    static Error Push( const Cmd& cmd, KeyBucketType bucket, const void* ctx,
+        BackendOfType backendOf, UpstreamReader* reader, uint64_t tag );
+
+public:
+    virtual int Protocol() const { return reader_->Protocol(); }
+    virtual void OnServerWrite( const Buffer& buffer, uint64_t tag );
+    virtual int Link() const { return link_ >= 0 ? link_ : reader_->Link(); }
+    virtual void SetLink( int link );
+
+#ifdef RP_FANOUT_TEST
+    friend struct FanOutTest;
+#endif
+
+private:
+    FanOut( UpstreamReader* reader, uint64_t tag, int merge ) :
+        reader_(reader), identity_(reader->Identity()), tag_(tag), merge_(merge), link_(-1), pending_(0) {}
+    virtual ~FanOut() {}
+
+    Error split( const Cmd& cmd, KeyBucketType bucket, const void* ctx );
+    Error push( BackendOfType backendOf );
+    Buffer merge() const;
+    Buffer mergeArray() const;
+    Buffer mergeSum() const;
+
+private:
+    UpstreamReader* reader_;
+    uint64_t    identity_;
+    uint64_t    tag_;
+    int merge_;
+
+    /**
+     * the link the parts go on, the one of the reader when it has one.
+     * the reader's next requests take it too, to run after them.
+     **/
+    int link_;
+
+    struct Part {
+        int bucket;
+        Upstream* upstream;
+        Cmd cmd;
+        // the number of keys, also the elements of its MGET reply
+        std::size_t keys;
+        Buffer reply;
+    };
+    std::vector<Part>   parts_;
+
+    /**
+     * the part of each key, in the order of the keys
+     **/
+    std::vector<uint32_t>   owners_;
+
+    /**
+     * parts not replied yet
+     **/
+    std::size_t pending_;
+};
+
+}
+
+#endif
@@ -7,16 +7,20 @@
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <netinet/tcp.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <string.h>
+#include <stdio.h>
 #include <list>
 
 #include "options.h"
 #include "buffer.h"
 #include "logger.h"
+#include "timer.h"
 
 namespace rp {
 
@@ -26,6 +30,7 @@ namespace io {
 
 struct Event;
 struct Addr;
+class Resolver;
 
 typedef std::function<Error (Connection**)> NewConnectionHandlerType;
 
@@ -36,17 +41,48 @@ struct NetIoOptions : public OptionsLoader {
     NewConnectionHandlerType    NewConnectionHandler;
 
     int ListenBacklog;
+    bool ListenReusePort;
+    int AcceptBatch;
     bool SocketNoDelay;
     bool SocketNonBlock;
     int SocketKeepAlive;
+    bool EdgeTriggered;
+
+    /**
+     * longest wait of the poller in ms when nothing is due,
+     * and the time in us to spin on a zero timeout before sleeping,
+     * also applied as SO_BUSY_POLL to the sockets. 0 disables it.
+     **/
+    int PollTimeout;
+    int BusyPollUs;
+
+    /**
+     * the io_uring backend receives into a ring of that many buffers of
+     * that size shared by the sockets of a loop, 0 has it poll and read()
+     **/
+    int UringRecvBuffers;
+    int UringRecvBufferSize;
+
+    /**
+     * how long a resolved host name is used before it is looked up again, in ms
+     **/
+    int ResolveCacheTTL;
 
     NetIoOptions();
     virtual ~NetIoOptions() {}
     virtual Error Load( const std::string& key, const std::string& value ) {
         if ( key == "ListenBacklog" ) { ListenBacklog = std::stoi(value); }
+        else if ( key == "ListenReusePort" ) { ListenReusePort = std::stoi(value); }
+        else if ( key == "AcceptBatch" ) { AcceptBatch = std::stoi(value); }
         else if ( key == "SocketNoDelay" ) { SocketNoDelay = std::stoi(value); }
         else if ( key == "SocketNonBlock" ) { SocketNonBlock = std::stoi(value); }
         else if ( key == "SocketKeepAlive" ) { SocketKeepAlive = std::stoi(value); }
+        else if ( key == "EdgeTriggered" ) { EdgeTriggered = std::stoi(value); }
+        else if ( key == "PollTimeout" ) { PollTimeout = std::stoi(value); }
+        else if ( key == "BusyPollUs" ) { BusyPollUs = std::stoi(value); }
+        else if ( key == "UringRecvBuffers" ) { UringRecvBuffers = std::stoi(value); }
+        else if ( key == "UringRecvBufferSize" ) { UringRecvBufferSize = std::stoi(value); }
+        else if ( key == "ResolveCacheTTL" ) { ResolveCacheTTL = std::stoi(value); }
         else {
             return Error::Unknown;
         }
@@ -61,9 +97,14 @@ namespace rp { namespace io {
 
 /**
  * Addr
+ * "unix:/path" as the host stands for a unix domain socket,
+ * the port is ignored then.
  **/
 struct Addr {
-    char ip[INET6_ADDRSTRLEN];
+    /**
+     * the ip, or the path of a unix domain socket
+     **/
+    char ip[sizeof(sockaddr_un::sun_path)];
     int port;
     int family;
 
@@ -71,17 +112,35 @@ public:
     Addr() : port(0), family(AF_UNSPEC) {
         ip[0] = 0;
     }
-    Addr( const char* rip, int rport ) : family(AF_UNSPEC) {
-        strcpy( ip, rip );
-        port = rport;
+    Addr( const char* rip, int rport ) : port(rport), family(AF_UNSPEC) {
+        if ( strncmp(rip, "unix:", 5) == 0 ) {
+            rip += 5;
+            family = AF_UNIX;
+            port = 0;
+        }
+        snprintf( ip, sizeof(ip), "%s", rip );
     }
 
     int Family() const { return family; }
+    bool IsUnix() const { return family == AF_UNIX; }
 
     const char* Host() const { return ip; }
     int Port() const { return port; }
 };
 
+/**
+ * ResolvedAddr
+ **/
+struct ResolvedAddr {
+    sockaddr_storage sa;
+    socklen_t salen;
+
+public:
+    ResolvedAddr() : salen(0) {
+        sa.ss_family = AF_UNSPEC;
+    }
+};
+
 }}
 
 /**
@@ -89,9 +148,26 @@ public:
  **/
 namespace rp { namespace io {
 
+/**
+ * Resolve blocks on getaddrinfo() for host names,
+ * pass AI_NUMERICHOST to only accept what resolves without a lookup.
+ **/
+Error Resolve( const Addr& addr, ResolvedAddr* resolved, int flags = 0 );
+
 Error Listen( Event* evt, const Addr& addr, const NetIoOptions& opt );
+/**
+ * watch a listen socket owned by another loop, for the addresses
+ * which can not be bound more than once like the unix domain sockets
+ **/
+Error ListenShared( Event* evt, const Event* listenEvt );
 Error Connect( Event* evt, const Addr& addr, const NetIoOptions& opt );
+Error Connect( Event* evt, const Addr& addr, const ResolvedAddr& resolved, const NetIoOptions& opt );
 Error Accept( Event* listenEvt, const NetIoOptions& opt );
+/**
+ * a socket accepted by the poller itself, handed over to a new connection
+ * like Accept() does. the peer address is not known then and left empty.
+ **/
+Error AcceptSocket( Event* listenEvt, int s, const NetIoOptions& opt );
 
 Error Open( Event* evt, const std::string& filename );
 Error Create( Event* evt, const std::string& filename );
@@ -103,8 +179,35 @@ Error Create( Event* evt, const std::string& filename );
  **/
 namespace rp { namespace io {
 
+/**
+ * LoopState
+ * the part of a poller context shared by every backend,
+ * each worker thread owns exactly one of it.
+ **/
+struct LoopState {
+    typedef std::list<Event*> EventListType;
+    EventListType writeEvents;
+    /**
+     * edge-triggered events whose reading was re-enabled,
+     * they would not be notified again for the data already there.
+     **/
+    EventListType readEvents;
+
+    /**
+     * deadlines of everything driven by this loop, and its clock
+     **/
+    TimerWheel timers;
+
+    /**
+     * set by the owner of the loop, nullptr resolves in place
+     **/
+    Resolver* resolver;
+
+    LoopState() : resolver(nullptr) {}
+    virtual ~LoopState() {}
+};
 
-typedef void* ContextType;
+typedef LoopState* ContextType;
 /**
  * 
  **/
@@ -112,6 +215,12 @@ Error Init( ContextType* context, const NetIoOptions& opt );
 Error PollOnce( ContextType context, Event* listenEvt, const NetIoOptions& opt );
 Error Deinit( ContextType context );
 
+/**
+ * how long the poller may sleep in ms, 0 when some work is already pending,
+ * otherwise until the next timer is due but no more than opt.PollTimeout
+ **/
+int PollTimeout( ContextType context, const NetIoOptions& opt );
+
 /**
  * Event
  **/
@@ -120,14 +229,25 @@ struct Event {
     int fd;
     int events;
 
-    typedef std::list<Event*> EventListType;
-    EventListType::iterator writeListPos;
-    static EventListType writeEvents;
+    /**
+     * edge-triggered events are registered once for both directions,
+     * SetReadable/SetWritable only flip the bits of `events` then.
+     **/
+    bool edgeTriggered;
+    bool registered;
+
+    LoopState::EventListType::iterator writeListPos;
+    LoopState::EventListType::iterator readListPos;
+    bool writeQueued;
+    bool readQueued;
+
 public:
-    static Error HandleWriteEvents();
+    static Error HandleWriteEvents( ContextType context );
+    static Error HandleReadEvents( ContextType context );
 
 public:
-    Event( ContextType ctx ) : context(ctx), fd(-1), events(0) {}
+    Event( ContextType ctx ) : context(ctx), fd(-1), events(0), 
+        edgeTriggered(false), registered(false), writeQueued(false), readQueued(false) {}
 
     virtual ~Event() {
         if ( fd != -1 ) {
@@ -135,21 +255,51 @@ public:
         }
     }
 
+public:
+    TimerWheel& Timers() { return context->timers; }
+
 public:
     Error SetWritable( bool flag );
     Error SetReadable( bool flag );
 
+    /**
+     * SetWritable() only queues the event to be written every round,
+     * this asks the poller to report the socket becoming writable,
+     * which is how a non-blocking connect() completes.
+     **/
+    Error WatchWritable( bool flag );
+
 public:
     Error Attach();
 
 public:
     Error Write( Buffer* buffer );
+    /**
+     * Writev
+     * writes as much of the segments as the socket takes, the caller
+     * consumes `nwrite` bytes from them. pins are the buffers behind iov:
+     * the io_uring backend holds them while it sends the segments itself,
+     * answers TryAgain meanwhile and the count to the next call.
+     **/
+    Error Writev( const iovec* iov, const Buffer* const* pins, int iovcnt, std::size_t* nwrite );
     Error Read( Buffer* buffer );
     Error Close( int flags = 0 );
     Error RemoveNotify();
 
 private:
     Error operateNotify( int newEvents, bool flag );
+    /**
+     * read() as the backend does it, the io_uring one hands over
+     * what has been received for the socket already
+     **/
+    ssize_t receive( char* data, std::size_t size );
+    /**
+     * writev() as the backend does it
+     **/
+    ssize_t transmit( const iovec* iov, const Buffer* const* pins, int iovcnt );
+    int kernelInterest() const;
+    void queueRead();
+    void dequeue();
 
 public:
     virtual Error OnWritable() { return Error::NotImplemented; }
@@ -0,0 +1,176 @@
+
+#include <string.h>
+#include <strings.h>
+
+#include "keys.h"
+
+namespace rp {
+
+Slice HashTag( const char* key, std::size_t size ) {
+    const char* open = (const char *)memchr( key, '{', size );
+    if ( open != nullptr ) {
+        std::size_t from = open - key + 1;
+        const char* close = (const char *)memchr( open + 1, '}', size - from );
+        // "{}" places the whole key
+        if ( close != nullptr && close != open + 1 ) {
+            return Slice( open + 1, close - open - 1 );
+        }
+    }
+
+    return Slice( key, size );
+}
+
+/**
+ * Walk
+ * the cmd whose keys are looked at, and how one is placed
+ **/
+struct Walk {
+    const Cmd& cmd;
+    // the args in the head, and in all for a streamed cmd
+    int argc;
+    int total;
+    KeyBucketType bucket;
+    const void* ctx;
+
+    Walk( const Cmd& c, KeyBucketType b, const void* x ) :
+        cmd(c), argc((int)c.GetArgSize() + 1), total((int)c.GetFullArgSize() + 1), bucket(b), ctx(x) {}
+
+    Slice Arg( int i ) const {
+        return i == 0 ? cmd.GetCmd() : cmd.GetArg( i - 1 );
+    }
+};
+
+/**
+ * keysBucket
+ * folds the keys at first, first + step ... last into bucket
+ **/
+static int keysBucket( const Walk& w, int first, int last, int step, int bucket ) {
+    if ( bucket == KEYS_UNSEEN ) {
+        return bucket;
+    }
+
+    if ( last >= w.total ) {
+        last = w.total - 1;
+    }
+    // the last key has not come with the head of a streamed cmd
+    if ( last >= w.argc ) {
+        if ( first <= last && first + (last - first) / step * step >= w.argc ) {
+            return KEYS_UNSEEN;
+        }
+        last = w.argc - 1;
+    }
+
+    for ( int i = first; i <= last && bucket != KEYS_CROSS; i += step ) {
+        Slice key = w.Arg( i );
+        int b = w.bucket( w.ctx, key.Data(), key.Size() );
+        bucket = (bucket == KEYS_NONE || bucket == b) ? b : (int)KEYS_CROSS;
+    }
+    return bucket;
+}
+
+static bool parseCount( const Slice& arg, int* n ) {
+    if ( arg.Empty() || arg.Size() > 9 ) {
+        return false;
+    }
+
+    int v = 0;
+    for ( std::size_t i = 0; i < arg.Size(); ++i ) {
+        char c = arg.Data()[i];
+        if ( c < '0' || c > '9' ) {
+            return false;
+        }
+        v = v * 10 + (c - '0');
+    }
+
+    *n = v;
+    return true;
+}
+
+/**
+ * numkeysBucket
+ * "numkeys key [key ...]" with numkeys at argv[at]. a count which does not
+ * fit leaves it to the server to refuse.
+ **/
+static int numkeysBucket( const Walk& w, int at, int bucket ) {
+    if ( at >= w.argc ) {
+        return at < w.total ? (int)KEYS_UNSEEN : bucket;
+    }
+
+    int n = 0;
+    if ( !parseCount( w.Arg( at ), &n ) || n > w.total - at - 1 ) {
+        return bucket;
+    }
+
+    return keysBucket( w, at + 1, at + n, 1, bucket );
+}
+
+/**
+ * streamsBucket
+ * the keys are the first half of the args after STREAMS, the ids the other
+ **/
+static int streamsBucket( const Walk& w, int from ) {
+    for ( int i = from; i < w.argc; ++i ) {
+        Slice arg = w.Arg( i );
+        if ( arg.Size() == 7 && strncasecmp( arg.Data(), "streams", 7 ) == 0 ) {
+            int n = (w.total - i - 1) / 2;
+            return keysBucket( w, i + 1, i + n, 1, KEYS_NONE );
+        }
+    }
+
+    // it may be in the rest
+    return w.argc < w.total ? (int)KEYS_UNSEEN : (int)KEYS_NONE;
+}
+
+/**
+ * where numkeys is for the MOVABLEKEYS commands taking "numkeys key [key ...]"
+ **/
+static const struct {
+    const char* name;
+    int at;
+} numkeysCommands[] = {
+    { "eval", 2 }, { "evalsha", 2 }, { "eval_ro", 2 }, { "evalsha_ro", 2 },
+    { "fcall", 2 }, { "fcall_ro", 2 }, { "blmpop", 2 }, { "bzmpop", 2 },
+    { "zunion", 1 }, { "zinter", 1 }, { "zdiff", 1 }, { "zintercard", 1 },
+    { "sintercard", 1 }, { "lmpop", 1 }, { "zmpop", 1 },
+};
+
+int KeysBucket( const Cmd& cmd, KeyBucketType bucket, const void* ctx ) {
+    const CommandInfo* info = cmd.Info();
+    if ( info == nullptr ) {
+        return KEYS_NONE;
+    }
+
+    Walk w( cmd, bucket, ctx );
+    if ( info->flags & CMD_MOVABLEKEYS ) {
+        const char* name = info->name;
+        for ( std::size_t i = 0; i < sizeof(numkeysCommands) / sizeof(numkeysCommands[0]); ++i ) {
+            if ( strcmp( name, numkeysCommands[i].name ) == 0 ) {
+                return numkeysBucket( w, numkeysCommands[i].at, KEYS_NONE );
+            }
+        }
+
+        // the destination, then "numkeys key [key ...]"
+        if ( strcmp( name, "zunionstore" ) == 0 || strcmp( name, "zinterstore" ) == 0 || strcmp( name, "zdiffstore" ) == 0 ) {
+            return numkeysBucket( w, 2, keysBucket( w, 1, 1, 1, KEYS_NONE ) );
+        }
+
+        if ( strcmp( name, "xread" ) == 0 ) {
+            return streamsBucket( w, 1 );
+        }
+        if ( strcmp( name, "xreadgroup" ) == 0 ) {
+            // past "GROUP group consumer"
+            return streamsBucket( w, 4 );
+        }
+
+        // the rest, like SORT ... STORE, by the table alone
+    }
+
+    if ( info->firstKey == 0 || info->keyStep <= 0 ) {
+        return KEYS_NONE;
+    }
+
+    int last = info->lastKey < 0 ? w.total + info->lastKey : info->lastKey;
+    return keysBucket( w, info->firstKey, last, info->keyStep, KEYS_NONE );
+}
+
+}
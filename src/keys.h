@@ -0,0 +1,43 @@
+#ifndef __RP_KEYS_H__
+#define __RP_KEYS_H__
+
+#include <cstddef>
+
+#include "cmd.h"
+
+namespace rp {
+
+/**
+ * HashTag
+ * the part of a key deciding where it goes: the inside of the first
+ * "{...}" when it is not empty, the whole key otherwise.
+ **/
+Slice HashTag( const char* key, std::size_t size );
+
+enum {
+    // the cmd has no keys
+    KEYS_NONE   = -1,
+    // its keys fall in more than one bucket
+    KEYS_CROSS  = -2,
+    // a streamed cmd with keys in the part still to come
+    KEYS_UNSEEN = -3,
+};
+
+/**
+ * the bucket of a key, a slot or a server, 0 or more
+ **/
+typedef int (*KeyBucketType)( const void* ctx, const char* key, std::size_t size );
+
+/**
+ * KeysBucket
+ * the bucket all the keys of cmd fall in. the keys are found by the key
+ * positions of the command table, or by parsing the args for the
+ * MOVABLEKEYS ones it knows the syntax of.
+ * a streamed cmd is KEYS_UNSEEN when a key is past its head, the bucket
+ * of the keys in the head would not be the one of them all.
+ **/
+int KeysBucket( const Cmd& cmd, KeyBucketType bucket, const void* ctx );
+
+}
+
+#endif
@@ -55,6 +55,15 @@ public:
         return *this;
     }
 
+    /**
+     * for the durations measured elsewhere, in us
+     **/
+    TimeSumMetric& Add( int64_t take, const uint64_t& count = 1 ) {
+        sumTake += take;
+        sum += count;
+        return *this;
+    }
+
     virtual void Clear() {
         timeTake = 0;
         sumTake = 0;
@@ -99,7 +108,7 @@ private:
     MetricMapType   metricMap_;
 };
 
-extern MetricFactory* MetricFactoryInstance;
+extern thread_local MetricFactory* MetricFactoryInstance;
 
 }
 
@@ -4,6 +4,9 @@
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <stddef.h>
 #include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <string.h>
@@ -49,6 +52,23 @@ static Error SetReuseAddr( int fd ) {
     return Error::OK;
 }
 
+static Error SetReusePort( int fd ) {
+    int optval = 1;
+    if ( setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(int)) == -1 ) {
+        return Error( errno, strerror(errno) );
+    }
+
+    return Error::OK;
+}
+
+static Error SetBusyPoll( int fd, int us ) {
+    if ( setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &us, sizeof(us)) == -1 ) {
+        return Error( errno, strerror(errno) );
+    }
+
+    return Error::OK;
+}
+
 static Error SetNoDelay( int fd, int optval = 1 ) {
     if ( setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(int)) == -1 ) 
     {
@@ -90,6 +110,11 @@ static Error ConvertAddrInfo( Addr* addr, const sockaddr_storage& sa ) {
         const sockaddr_in *s = (const sockaddr_in *)&sa;
         inet_ntop( AF_INET,(void*)&(s->sin_addr), addr->ip, sizeof(addr->ip) );
         addr->port = ntohs( s->sin_port );
+    } else if ( sa.ss_family == AF_UNIX ) {
+        // the peers are mostly unnamed
+        const sockaddr_un *s = (const sockaddr_un *)&sa;
+        snprintf( addr->ip, sizeof(addr->ip), "%s", s->sun_path );
+        addr->port = 0;
     } else {
         const sockaddr_in6 *s = (const sockaddr_in6 *)&sa;
         inet_ntop( AF_INET6,(void*)&(s->sin6_addr), addr->ip, sizeof(addr->ip) );
@@ -100,9 +125,21 @@ static Error ConvertAddrInfo( Addr* addr, const sockaddr_storage& sa ) {
 }
 
 /**
- * GetAddrInfo
+ * Resolve
+ * the result is copied out, getaddrinfo() owns the memory it points to.
  **/
-static Error GetAddrInfo( const Addr& addr, addrinfo* holder ) {
+Error Resolve( const Addr& addr, ResolvedAddr* resolved, int flags ) {
+    sockaddr_storage* sa = &resolved->sa;
+    memset( sa, 0, sizeof(*sa) );
+
+    if ( addr.IsUnix() ) {
+        sockaddr_un* un = (sockaddr_un*)sa;
+        un->sun_family = AF_UNIX;
+        memcpy( un->sun_path, addr.ip, sizeof(un->sun_path) );
+        resolved->salen = offsetof(sockaddr_un, sun_path) + strlen(un->sun_path) + 1;
+        return Error::OK;
+    }
+
     addrinfo hints, *info;
     int rv;
     char buf[33];
@@ -110,29 +147,102 @@ static Error GetAddrInfo( const Addr& addr, addrinfo* holder ) {
     memset( &hints, 0, sizeof(hints) );
     hints.ai_family = addr.Family();
     hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = flags;
 
     sprintf( buf, "%d", addr.port );
     if ( (rv = getaddrinfo(addr.ip, buf, &hints, &info)) != 0 ) {
         return Error( rv, gai_strerror(rv) );
     }
         
-    memcpy( holder, info, sizeof(addrinfo) );
+    memcpy( sa, info->ai_addr, info->ai_addrlen );
+    resolved->salen = info->ai_addrlen;
     freeaddrinfo(info);
     
     return Error::OK;
 }
 
+/**
+ * UnlinkStaleSocket
+ * a unix socket file left by a previous run would make bind() fail
+ **/
+static Error UnlinkStaleSocket( const Addr& addr ) {
+    struct stat st;
+    if ( stat(addr.ip, &st) == -1 ) {
+        return Error::OK;
+    }
+
+    if ( !S_ISSOCK(st.st_mode) ) {
+        return Error( EADDRINUSE, "not a socket" );
+    }
+
+    if ( unlink(addr.ip) == -1 ) {
+        return Error( errno, strerror(errno) );
+    }
+
+    return Error::OK;
+}
+
+/**
+ * setListenTcpOptions
+ * the accepted sockets inherit these from the listener,
+ * which saves the setsockopt() calls for every client.
+ **/
+static Error setListenTcpOptions( int s, const NetIoOptions& opt ) {
+    Error err = SetReuseAddr( s );
+    if ( !err.None() ) {
+        return err; 
+    }
+
+    if ( opt.ListenReusePort ) {
+        err = SetReusePort( s );
+        if ( !err.None() ) {
+            return err; 
+        }
+    }
+
+    if ( opt.SocketNoDelay ) {
+        err = SetNoDelay( s );
+        if ( !err.None() ) {
+            return err;
+        }
+    }
+
+    if ( opt.SocketKeepAlive > 0 ) {
+        err = SetKeepAlive( s, opt.SocketKeepAlive );
+        if ( !err.None() ) {
+            return err;
+        }
+    }
+
+    if ( opt.BusyPollUs > 0 ) {
+        // raising it needs CAP_NET_ADMIN, spinning in PollOnce works without
+        err = SetBusyPoll( s, opt.BusyPollUs );
+        if ( !err.None() ) {
+            LogWarnf( "SO_BUSY_POLL not set:%s", err.String().c_str() );
+        }
+    }
+
+    return Error::OK;
+}
+
 /**
  * Listen
  **/
 Error Listen( Event* evt, const Addr& addr, const NetIoOptions& opt ) {
-    addrinfo holder;
-    Error err = GetAddrInfo( addr, &holder );
+    ResolvedAddr resolved;
+    Error err = Resolve( addr, &resolved );
     if ( !err.None() ) {
         return err; 
     }
 
-    int s = socket(holder.ai_family, holder.ai_socktype, holder.ai_protocol);
+    if ( addr.IsUnix() ) {
+        err = UnlinkStaleSocket( addr );
+        if ( !err.None() ) {
+            return err;
+        }
+    }
+
+    int s = socket(resolved.sa.ss_family, SOCK_STREAM, 0);
     if ( s == -1 ) {
         return Error( errno, strerror(errno) );
     }
@@ -143,13 +253,16 @@ Error Listen( Event* evt, const Addr& addr, const NetIoOptions& opt ) {
         return err; 
     }
 
-    err = SetReuseAddr( s );
-    if ( !err.None() ) {
-        close( s );
-        return err; 
+    // the rest only applies to TCP
+    if ( !addr.IsUnix() ) {
+        err = setListenTcpOptions( s, opt );
+        if ( !err.None() ) {
+            close( s );
+            return err;
+        }
     }
 
-    if ( bind(s, holder.ai_addr, holder.ai_addrlen) == -1 ) {
+    if ( bind(s, (const sockaddr*)&resolved.sa, resolved.salen) == -1 ) {
         Error err( errno, strerror(errno) );
         close( s );
         return err;
@@ -168,115 +281,110 @@ Error Listen( Event* evt, const Addr& addr, const NetIoOptions& opt ) {
 }
 
 /**
- * Connect
+ * ListenShared
  **/
-Error Connect( Event* evt, const Addr& addr, const NetIoOptions& opt ) {
-    addrinfo holder;
-    Error err = GetAddrInfo( addr, &holder );
-    if ( !err.None() ) {
-        return err; 
-    }
-
-    int s = socket(holder.ai_family, holder.ai_socktype, holder.ai_protocol);
-    if ( s < 0 ) {
+Error ListenShared( Event* evt, const Event* listenEvt ) {
+    int s = fcntl( listenEvt->fd, F_DUPFD_CLOEXEC, 0 );
+    if ( s == -1 ) {
         return Error( errno, strerror(errno) );
     }
 
+    evt->fd = s;
+    evt->events = EPOLLIN;
+
+    return evt->Attach();
+}
+
+/**
+ * setConnectTcpOptions
+ **/
+static Error setConnectTcpOptions( int s, const NetIoOptions& opt ) {
+    Error err;
     if ( opt.SocketNoDelay ) {
         err = SetNoDelay(s);
         if ( !err.None() ) {
-            close(s);
             return err;
         }
     } else {
         printf("unset SocketNoDelay of s:%d", s);
     }
-    
-    if ( opt.SocketNonBlock ) {
-        err = SetNonblock(s);
-        if ( !err.None() ) {
-            close(s);
-            return err;
-        }
-    } else {
-        printf("unset SocketNonBlock of s:%d", s);
-    }
 
     if ( opt.SocketKeepAlive > 0 ) {
         err = SetKeepAlive(s, opt.SocketKeepAlive);
         if ( !err.None() ) {
-            close(s);
             return err;
         }
     }
 
-    if( connect(s, holder.ai_addr, holder.ai_addrlen) == -1 ) {
-        if( errno != EINPROGRESS ) {
-            Error err( errno, strerror(errno) );
-
-            close( s );
-            return err;
+    if ( opt.BusyPollUs > 0 ) {
+        err = SetBusyPoll(s, opt.BusyPollUs);
+        if ( !err.None() ) {
+            LogWarnf( "SO_BUSY_POLL not set:%s", err.String().c_str() );
         }
     }
 
-    evt->fd = s;
-    return evt->Attach();
+    return Error::OK;
 }
 
 /**
- * Accept
+ * Connect
  **/
-Error Accept( Event* listenEvt, const NetIoOptions& opt ) {
-    int s;
-    sockaddr_storage sa;
-    socklen_t salen = sizeof(sa);
-
-    while( true ) {
-        s = accept( listenEvt->fd, reinterpret_cast<sockaddr *>(&sa), &salen );
-        if ( s == -1 ) {
-            if ( errno == EINTR ) {
-                continue;
-            } else {
-                return Error( errno, strerror(errno) );
-            }
-        }
-        break;
+Error Connect( Event* evt, const Addr& addr, const NetIoOptions& opt ) {
+    ResolvedAddr resolved;
+    Error err = Resolve( addr, &resolved );
+    if ( !err.None() ) {
+        return err; 
     }
 
+    return Connect( evt, addr, resolved, opt );
+}
+
+Error Connect( Event* evt, const Addr& addr, const ResolvedAddr& resolved, const NetIoOptions& opt ) {
     Error err;
-    if ( opt.SocketNoDelay ) {
-        err = SetNoDelay(s);
-        if ( !err.None() ) {
-            close(s);
-            return err;
-        }
+    int s = socket(resolved.sa.ss_family, SOCK_STREAM, 0);
+    if ( s < 0 ) {
+        return Error( errno, strerror(errno) );
     }
-    
+
     if ( opt.SocketNonBlock ) {
         err = SetNonblock(s);
         if ( !err.None() ) {
             close(s);
             return err;
         }
+    } else {
+        printf("unset SocketNonBlock of s:%d", s);
     }
 
-    if ( opt.SocketKeepAlive > 0 ) {
-        err = SetKeepAlive(s, opt.SocketKeepAlive);
+    // the rest only applies to TCP
+    if ( !addr.IsUnix() ) {
+        err = setConnectTcpOptions( s, opt );
         if ( !err.None() ) {
             close(s);
             return err;
         }
     }
 
-    Addr addr;
-    err = ConvertAddrInfo( &addr, sa );
-    if ( !err.None() ) {
-        close(s);
-        return err;
+    if( connect(s, (const sockaddr*)&resolved.sa, resolved.salen) == -1 ) {
+        if( errno != EINPROGRESS ) {
+            Error err( errno, strerror(errno) );
+
+            close( s );
+            return err;
+        }
     }
 
+    evt->fd = s;
+    return evt->Attach();
+}
+
+/**
+ * acceptConnection
+ * hand an accepted socket over to a new connection
+ **/
+static Error acceptConnection( Event* listenEvt, int s, const Addr& addr, const NetIoOptions& opt ) {
     Connection* conn;
-    err = opt.NewConnectionHandler( &conn );
+    Error err = opt.NewConnectionHandler( &conn );
     if ( !err.None() ) {
         close(s);
         return err;
@@ -300,12 +408,84 @@ Error Accept( Event* listenEvt, const NetIoOptions& opt ) {
     return err;
 }
 
+/**
+ * Accept
+ * accepts up to AcceptBatch sockets per call, the listener is level-triggered
+ * so whatever is left in the backlog will be notified again.
+ * TCP_NODELAY and keepalive were set on the listener and are inherited.
+ **/
+Error Accept( Event* listenEvt, const NetIoOptions& opt ) {
+    int flags = SOCK_CLOEXEC;
+    if ( opt.SocketNonBlock ) {
+        flags |= SOCK_NONBLOCK;
+    }
+
+    TimeSumMetric* acceptMetric = MetricFactoryInstance->FetchTimeSum( "accept" );
+
+    Error err;
+    int accepted = 0;
+    int batch = opt.AcceptBatch > 0 ? opt.AcceptBatch : 1;
+
+    while( accepted < batch ) {
+        sockaddr_storage sa;
+        socklen_t salen = sizeof(sa);
+
+        int s = accept4( listenEvt->fd, reinterpret_cast<sockaddr *>(&sa), &salen, flags );
+        if ( s == -1 ) {
+            if ( errno == EINTR ) {
+                continue;
+            }
+
+            if ( errno != EAGAIN && errno != EWOULDBLOCK ) {
+                err = Error( errno, strerror(errno) );
+            }
+            break;
+        }
+
+        accepted++;
+
+        // a failing client should not stop the others
+        Addr addr;
+        Error cerr = ConvertAddrInfo( &addr, sa );
+        if ( cerr.None() ) {
+            cerr = acceptConnection( listenEvt, s, addr, opt );
+        } else {
+            close( s );
+        }
+        if ( !cerr.None() ) {
+            LogErrorf( "accept connection failed:%s", cerr.String().c_str() );
+        }
+    }
+
+    acceptMetric->Inc( accepted );
+    return err;
+}
+
+/**
+ * AcceptSocket
+ **/
+Error AcceptSocket( Event* listenEvt, int s, const NetIoOptions& opt ) {
+    MetricFactoryInstance->FetchTimeSum( "accept" )->Inc();
+    return acceptConnection( listenEvt, s, Addr(), opt );
+}
+
+/**
+ * PollTimeout
+ **/
+int PollTimeout( ContextType context, const NetIoOptions& opt ) {
+    if ( !context->readEvents.empty() ) {
+        return 0;
+    }
+
+    return context->timers.NextTimeout( opt.PollTimeout );
+}
+
 /**
  * static method
  **/
-Event::EventListType Event::writeEvents;
-Error Event::HandleWriteEvents() {
-    for ( EventListType::iterator it = writeEvents.begin(); it != writeEvents.end(); ) {
+Error Event::HandleWriteEvents( ContextType context ) {
+    LoopState::EventListType& writeEvents( context->writeEvents );
+    for ( LoopState::EventListType::iterator it = writeEvents.begin(); it != writeEvents.end(); ) {
         Event* evt( *it ); ++it;
         
         Error err = evt->OnWritable();
@@ -317,6 +497,77 @@ Error Event::HandleWriteEvents() {
     return Error::OK;
 }
 
+Error Event::HandleReadEvents( ContextType context ) {
+    LoopState::EventListType& readEvents( context->readEvents );
+    while ( !readEvents.empty() ) {
+        Event* evt = readEvents.front();
+        readEvents.pop_front();
+        evt->readQueued = false;
+
+        if ( evt->events & EPOLLIN ) {
+            evt->OnReadable();
+        }
+    }
+
+    return Error::OK;
+}
+
+void Event::queueRead() {
+    if ( !readQueued ) {
+        readListPos = context->readEvents.insert( context->readEvents.end(), this );
+        readQueued = true;
+    }
+}
+
+/**
+ * the part of `events` the poller watches, the EPOLLOUT of
+ * the write list is polled by the loop each round.
+ **/
+int Event::kernelInterest() const {
+    return writeQueued ? (events & ~EPOLLOUT) : events;
+}
+
+/**
+ * drop the event from the pending lists before it goes away
+ **/
+void Event::dequeue() {
+    if ( readQueued ) {
+        context->readEvents.erase( readListPos );
+        readQueued = false;
+    }
+
+    if ( writeQueued ) {
+        context->writeEvents.erase( writeListPos );
+        writeQueued = false;
+        events &= ~EPOLLOUT;
+    }
+}
+
+/**
+ * SetWritable
+ **/
+Error Event::SetWritable( bool flag ) {
+    if ( flag ) {
+        if ( !writeQueued ) {
+            events |= EPOLLOUT;
+            writeListPos = context->writeEvents.insert( context->writeEvents.end(), this );
+            writeQueued = true;
+        }
+    } else {
+        if ( writeQueued ) {
+            events &= ~EPOLLOUT;
+            context->writeEvents.erase( writeListPos );
+            writeQueued = false;
+        }
+    }
+
+    return Error::OK;
+}
+
+Error Event::WatchWritable( bool flag ) {
+    return operateNotify( EPOLLOUT, flag );
+}
+
 /**
  * Write
  **/
@@ -352,6 +603,26 @@ Error Event::Write( Buffer* buffer ) {
     return Error::OK;
 }
 
+/**
+ * Writev
+ **/
+Error Event::Writev( const iovec* iov, const Buffer* const* pins, int iovcnt, std::size_t* nwrite ) {
+    *nwrite = 0;
+
+    ssize_t n = transmit( iov, pins, iovcnt );
+    if ( n < 0 ) {
+        if ( errno == EAGAIN || errno == EINTR ) {
+            return Error::TryAgain;
+        }
+
+        SetWritable( false );
+        return Error( errno, strerror(errno) );
+    }
+
+    *nwrite = std::size_t(n);
+    return Error::OK;
+}
+
 /**
  * Read
  **/
@@ -363,7 +634,7 @@ Error Event::Read( Buffer* buffer ) {
     }
 
 
-    int nread = read( fd, buffer->Tail(), freeSize );
+    int nread = receive( buffer->Tail(), freeSize );
     if ( nread < 0 ) {
         if ( errno == EAGAIN || errno == EINTR ) {
             return Error::TryAgain;
@@ -389,12 +660,18 @@ Error Event::Read( Buffer* buffer ) {
  * Close
  **/
 Error Event::Close( int flags ) {
-    Error err = RemoveNotify();
-    if ( flags & NET_FLAG_RST ) {
-        SetCloseNoWait(fd);
-    }
+    Error err;
 
-    close(fd);
+    // it might be closed before a socket was made, like a connect timing out
+    if ( fd != -1 ) {
+        err = RemoveNotify();
+        if ( flags & NET_FLAG_RST ) {
+            SetCloseNoWait(fd);
+        }
+
+        close(fd);
+        fd = -1;
+    }
 
     OnClosed();
     return err;
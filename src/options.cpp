@@ -9,6 +9,20 @@ namespace rp {
 SingularOptions::SingularOptions() {
     UpstreamHost = "127.0.0.1";
     UpstreamPort = 6300;
+    Protocol = 2;
+    FollowRedirects = false;
+}
+
+ClusterOptions::ClusterOptions() {
+    Seeds = "127.0.0.1:7000";
+    Protocol = 2;
+    RefreshInterval = 1000;
+    RefreshPeriod = 30000;
+}
+
+ShardedOptions::ShardedOptions() {
+    Servers = "127.0.0.1:6300:1";
+    Protocol = 2;
 }
 
 ProxyOptions::ProxyOptions() {
@@ -16,11 +30,17 @@ ProxyOptions::ProxyOptions() {
     ClientOpt = new ConnectionOptions("client");
     UpstreamOpt = new ConnectionOptions("upstream");
     SingularOpt = new SingularOptions();
+    ClusterOpt = new ClusterOptions();
+    ShardedOpt = new ShardedOptions();
 
     BindHost = "0.0.0.0";
     BindPort = 9877;
 
+    WorkerThreads = 1;
+    UpstreamConnections = 1;
+
     ClusterMode = false;
+    ShardedMode = false;
 }
 
 ProxyOptions::~ProxyOptions() {
@@ -28,6 +48,8 @@ ProxyOptions::~ProxyOptions() {
     delete ClientOpt;
     delete UpstreamOpt;
     delete SingularOpt;
+    delete ClusterOpt;
+    delete ShardedOpt;
 }
 
 ConnectionOptions::ConnectionOptions(const std::string& n) : name(n) {
@@ -35,15 +57,27 @@ ConnectionOptions::ConnectionOptions(const std::string& n) : name(n) {
     ReadBufferMinSize = 1024;
     ConnSendBufferCount = 10000;
     ConnPoolSize = 768;
+    ConnectTimeout = 1000;
+    ReconnectInterval = 100;
+    StreamBulkSize = 1024 * 1024;
+    StreamPendingSize = 1024 * 1024;
 }
 
 namespace io {
 
 NetIoOptions::NetIoOptions() {
     ListenBacklog = 1024;
+    ListenReusePort = false;
+    AcceptBatch = 64;
     SocketNoDelay = true;
     SocketNonBlock = true;
     SocketKeepAlive = 0;
+    EdgeTriggered = false;
+    PollTimeout = 10;
+    BusyPollUs = 0;
+    UringRecvBuffers = 256;
+    UringRecvBufferSize = 16 * 1024;
+    ResolveCacheTTL = 30000;
 }
 
 }
@@ -32,6 +32,17 @@ struct SingularOptions : public OptionsLoader {
     std::string Password;
     std::string UpstreamHost;
     int UpstreamPort;
+    /**
+     * RESP version spoken to the upstream, 3 sends HELLO 3 on connecting.
+     * clients on RESP2 get the replies converted.
+     **/
+    int Protocol;
+    /**
+     * the upstream is a node of a redis cluster, the -MOVED and -ASK of
+     * the keys of the other nodes are followed instead of handed to the client.
+     * costs a slot lookup and keeping every request until its reply.
+     **/
+    bool FollowRedirects;
 
     SingularOptions();
     virtual ~SingularOptions() {}
@@ -40,6 +51,72 @@ struct SingularOptions : public OptionsLoader {
         if ( key == "Password" ) { Password = value; }
         else if ( key == "UpstreamHost" ) { UpstreamHost = value; }
         else if ( key == "UpstreamPort" ) { UpstreamPort = std::stoi(value); }
+        else if ( key == "Protocol" ) { Protocol = std::stoi(value); }
+        else if ( key == "FollowRedirects" ) { FollowRedirects = std::stoi(value); }
+        else {
+            return Error::Unknown;
+        }
+        return Error::OK;
+    }
+    virtual std::string String() { return ""; }
+};
+
+/**
+ * Cluster
+ **/
+struct ClusterOptions : public OptionsLoader {
+    /**
+     * host:port of nodes, comma separated. they are asked for
+     * CLUSTER SLOTS in turn until one answers.
+     **/
+    std::string Seeds;
+    std::string Password;
+    int Protocol;
+    /**
+     * CLUSTER SLOTS is asked again on -MOVED, at most once in that many ms
+     **/
+    int RefreshInterval;
+    /**
+     * CLUSTER SLOTS is asked again every that many ms anyway, 0 never
+     **/
+    int RefreshPeriod;
+
+    ClusterOptions();
+    virtual ~ClusterOptions() {}
+    virtual std::string Name() const { return "cluster"; }
+    virtual Error Load( const std::string& key, const std::string& value ) {
+        if ( key == "Seeds" ) { Seeds = value; }
+        else if ( key == "Password" ) { Password = value; }
+        else if ( key == "Protocol" ) { Protocol = std::stoi(value); }
+        else if ( key == "RefreshInterval" ) { RefreshInterval = std::stoi(value); }
+        else if ( key == "RefreshPeriod" ) { RefreshPeriod = std::stoi(value); }
+        else {
+            return Error::Unknown;
+        }
+        return Error::OK;
+    }
+    virtual std::string String() { return ""; }
+};
+
+/**
+ * Sharded
+ **/
+struct ShardedOptions : public OptionsLoader {
+    /**
+     * host:port:weight of standalone servers, comma separated,
+     * the weight is 1 when left out.
+     **/
+    std::string Servers;
+    std::string Password;
+    int Protocol;
+
+    ShardedOptions();
+    virtual ~ShardedOptions() {}
+    virtual std::string Name() const { return "sharded"; }
+    virtual Error Load( const std::string& key, const std::string& value ) {
+        if ( key == "Servers" ) { Servers = value; }
+        else if ( key == "Password" ) { Password = value; }
+        else if ( key == "Protocol" ) { Protocol = std::stoi(value); }
         else {
             return Error::Unknown;
         }
@@ -59,15 +136,33 @@ struct ProxyOptions : public OptionsLoader {
     std::string BindHost;
     int BindPort;
 
+    /**
+     * number of event loops, each one runs in its own thread
+     * and owns its listener, connections and upstreams.
+     * 0 means one per online cpu.
+     **/
+    int WorkerThreads;
+
+    /**
+     * links of each worker to each server, the clients are spread over them
+     **/
+    int UpstreamConnections;
+
     bool ClusterMode;
+    bool ShardedMode;
     SingularOptions*    SingularOpt;
+    ClusterOptions*     ClusterOpt;
+    ShardedOptions*     ShardedOpt;
 
     ProxyOptions();
     virtual ~ProxyOptions();
     virtual Error Load( const std::string& key, const std::string& value ) {
         if ( key == "BindHost" ) { BindHost = value; }
         else if ( key == "ClusterMode" ) { ClusterMode = std::stoi(value); }
+        else if ( key == "ShardedMode" ) { ShardedMode = std::stoi(value); }
         else if ( key == "BindPort" ) { BindPort = std::stoi(value); }
+        else if ( key == "WorkerThreads" ) { WorkerThreads = std::stoi(value); }
+        else if ( key == "UpstreamConnections" ) { UpstreamConnections = std::stoi(value); }
         else {
             return Error::Unknown;
         }
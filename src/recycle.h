@@ -4,6 +4,7 @@
 
 #include <assert.h>
 #include <vector>
+#include <utility>
 
 namespace rp {
 
@@ -88,11 +89,25 @@ public:
             return Error::Empty;
         }
 
-        *data = holder_[start_];
+        // moved out, what the entry holds is not kept alive by the ring
+        *data = std::move( holder_[start_] );
         start_ = (start_ + 1) % holder_.size();
         return Error::OK;
     }
 
+public:
+    /**
+     * the oldest and the latest pushed ones, the queue must not be empty
+     **/
+    T& Front() {
+        assert( !Empty() );
+        return holder_[start_];
+    }
+    T& Back() {
+        assert( !Empty() );
+        return holder_[(end_ + holder_.size() - 1) % holder_.size()];
+    }
+
 public:
     T& Get( const std::size_t& index ) {
         return holder_[index];
@@ -109,6 +124,12 @@ public:
         std::size_t newEnd = (end_ + 1) % holder_.size();
         return newEnd == start_;
     }
+    std::size_t Size() const {
+        return (end_ + holder_.size() - start_) % holder_.size();
+    }
+    std::size_t Capacity() const {
+        return holder_.size() - 1;
+    }
 
 private:
     friend class Iterator<T>;
@@ -0,0 +1,512 @@
+
+#include <stdio.h>
+#include <string.h>
+
+#include "reply.h"
+#include "scan.h"
+
+namespace rp { namespace impl {
+
+/**
+ * parseLength
+ * the signed decimal of a "$" or "*" header, up to the "\r\n"
+ **/
+static bool parseLength( const char* p, const char* eol, int64_t* value ) {
+    bool negative = false;
+    if ( p < eol && *p == '-' ) {
+        negative = true;
+        p++;
+    }
+
+    const char* begin = p;
+    int64_t n = 0;
+    for ( ; p < eol && *p >= '0' && *p <= '9'; ++p ) {
+        if ( p - begin >= 18 ) {
+            return false;
+        }
+        n = n * 10 + (*p - '0');
+    }
+
+    if ( p == begin || (p != eol && !(*p == '\r' && p + 1 == eol)) ) {
+        return false;
+    }
+
+    *value = negative ? -n : n;
+    return true;
+}
+
+/**
+ * elementDone
+ * counts a finished element against the open aggregates,
+ * true when that completed the whole reply.
+ **/
+bool ReplyParser::elementDone() {
+    while ( !stack_.empty() ) {
+        Frame& frame( stack_.back() );
+        if ( --frame.left > 0 ) {
+            return false;
+        }
+
+        bool attribute = frame.attribute;
+        stack_.pop_back();
+        if ( attribute ) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+Error ReplyParser::HandleResponse( BufferReader& br ) {
+    for ( ;; ) {
+        if ( bulkLeft_ >= 0 ) {
+            // the body is passed over as it comes, so a part framed can go out
+            std::size_t left = br.Left();
+            if ( left < std::size_t(bulkLeft_) ) {
+                if ( left > 0 ) {
+                    br.Next( left );
+                }
+                bulkLeft_ -= left;
+                return Error::TryAgain;
+            }
+
+            br.Next( bulkLeft_ );
+            bulkLeft_ = -1;
+
+            if ( elementDone() ) {
+                return Error::OK;
+            }
+            continue;
+        }
+
+        const char* line = br.Data();
+        const char* eol = scan::FindFirst( line, br.Left(), '\n' );
+        if ( eol == nullptr ) {
+            return Error::TryAgain;
+        }
+
+        char type = line[0];
+        int64_t n = 0;
+        int64_t elements = 0;
+        switch ( type ) {
+        case '+':
+        case '-':
+        case ':':
+            break;
+
+        // null, boolean, double, big number
+        case '_':
+        case '#':
+        case ',':
+        case '(':
+            resp3_ = true;
+            break;
+
+        // blob error, verbatim string
+        case '!':
+        case '=':
+            resp3_ = true;
+            // fall through
+        case '$':
+            if ( !parseLength( line + 1, eol, &n ) ) {
+                return Error::Protocol;
+            }
+            if ( n >= 0 ) {
+                bulkLeft_ = n + 2;
+            }
+            break;
+
+        // map, attribute, set, push
+        case '%':
+        case '|':
+        case '~':
+        case '>':
+            resp3_ = true;
+            // fall through
+        case '*':
+            if ( !parseLength( line + 1, eol, &n ) ) {
+                return Error::Protocol;
+            }
+            elements = (type == '%' || type == '|') ? n * 2 : n;
+            break;
+
+        default:
+            return Error::Protocol;
+        }
+
+        if ( stack_.empty() ) {
+            type_ = type;
+        }
+
+        br.Next( eol - line + 1 );
+
+        if ( bulkLeft_ >= 0 ) {
+            continue;
+        }
+
+        if ( elements > 0 ) {
+            if ( stack_.size() >= REPLY_MAX_DEPTH ) {
+                return Error::Protocol;
+            }
+
+            Frame frame = { elements, type == '|' };
+            stack_.push_back( frame );
+            continue;
+        }
+
+        // nothing is decorated by an empty attribute
+        if ( type == '|' ) {
+            continue;
+        }
+
+        if ( elementDone() ) {
+            return Error::OK;
+        }
+    }
+}
+
+static inline bool isBulk( char type ) {
+    return type == '$' || type == '!' || type == '=';
+}
+
+static inline bool isAggregate( char type ) {
+    return type == '*' || type == '%' || type == '~' || type == '>' || type == '|';
+}
+
+/**
+ * appendBulk
+ **/
+static Error appendBulk( Buffer* out, const char* data, std::size_t size ) {
+    char head[32];
+    int n = snprintf( head, sizeof(head), "$%zu\r\n", size );
+
+    Error err = out->Append( head, n );
+    if ( err.None() ) {
+        err = out->Append( data, size );
+    }
+    if ( err.None() ) {
+        err = out->Append( "\r\n", 2 );
+    }
+    return err;
+}
+
+Error ConvertToRESP2( const Buffer& reply, Buffer* out ) {
+    const char* p = reply.Data();
+    const char* end = p + reply.Size();
+
+    Error err = out->AppendCapacity( reply.Size() + 64 );
+
+    /**
+     * elements left of the attribute being dropped, the nested aggregates
+     * add theirs to it so no stack is needed to find where it ends.
+     **/
+    int64_t skip = 0;
+
+    while ( p < end && err.None() ) {
+        const char* eol = scan::FindFirst( p, end - p, '\n' );
+        if ( eol == nullptr ) {
+            return Error::Protocol;
+        }
+
+        const char* next = eol + 1;
+        const char* body = p + 1;
+        std::size_t bodySize = (eol > body && eol[-1] == '\r') ? eol - 1 - body : eol - body;
+        char type = p[0];
+
+        int64_t n = -1;
+        if ( (isBulk(type) || isAggregate(type)) && !parseLength( body, eol, &n ) ) {
+            return Error::Protocol;
+        }
+
+        if ( n >= 0 && isBulk(type) ) {
+            next += n + 2;
+            if ( next > end ) {
+                return Error::Protocol;
+            }
+        }
+
+        if ( type == '|' || skip > 0 ) {
+            if ( type != '|' ) {
+                skip--;
+            }
+            if ( n > 0 && isAggregate(type) ) {
+                skip += (type == '%' || type == '|') ? n * 2 : n;
+            }
+
+            p = next;
+            continue;
+        }
+
+        char head[32];
+        switch ( type ) {
+        case '_':
+            err = out->Append( "$-1\r\n", 5 );
+            break;
+
+        case '#':
+            err = out->Append( body[0] == 't' ? ":1\r\n" : ":0\r\n", 4 );
+            break;
+
+        case ',':
+        case '(':
+            err = appendBulk( out, body, bodySize );
+            break;
+
+        case '=':
+            // "txt:" or "mkd:" in front of the text
+            if ( n >= 4 ) {
+                err = appendBulk( out, eol + 1 + 4, n - 4 );
+            } else if ( n >= 0 ) {
+                err = appendBulk( out, eol + 1, n );
+            } else {
+                err = out->Append( "$-1\r\n", 5 );
+            }
+            break;
+
+        case '!':
+            if ( n < 0 ) {
+                err = out->Append( "-ERR\r\n", 6 );
+                break;
+            }
+
+            err = out->Append( "-", 1 );
+            for ( const char* c = eol + 1; c < eol + 1 + n && err.None(); ++c ) {
+                err = out->Append( (*c == '\r' || *c == '\n') ? " " : c, 1 );
+            }
+            if ( err.None() ) {
+                err = out->Append( "\r\n", 2 );
+            }
+            break;
+
+        case '%':
+        case '~':
+        case '>':
+            err = out->Append( head, snprintf( head, sizeof(head), "*%lld\r\n",
+                (long long)(type == '%' && n > 0 ? n * 2 : n) ) );
+            break;
+
+        default:
+            err = out->Append( p, next - p );
+            break;
+        }
+
+        p = next;
+    }
+
+    return err;
+}
+
+}}
+
+#if defined(RP_REPLY_FUZZ) || defined(RP_REPLY_BENCH)
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+
+/**
+ * the seed corpus, every shape of reply the framer has to get right
+ **/
+static const char* kReplyCorpus[] = {
+    "+OK\r\n",
+    "-ERR unknown command 'foo'\r\n",
+    ":1000\r\n",
+    ":-1\r\n",
+    "$-1\r\n",
+    "$0\r\n\r\n",
+    "$5\r\nhello\r\n",
+    "$12\r\nline\r\nbreaks\r\n",
+    "*-1\r\n",
+    "*0\r\n",
+    "*2\r\n$3\r\nfoo\r\n$-1\r\n",
+    "*3\r\n:1\r\n:2\r\n:3\r\n",
+    // EXEC
+    "*3\r\n+OK\r\n*2\r\n$1\r\na\r\n$1\r\nb\r\n-ERR wrong type\r\n",
+    // SCAN
+    "*2\r\n$1\r\n0\r\n*3\r\n$2\r\nk1\r\n$2\r\nk2\r\n$2\r\nk3\r\n",
+    // XRANGE
+    "*1\r\n*2\r\n$15\r\n1526985054069-0\r\n*4\r\n$8\r\ndistance\r\n$2\r\n12\r\n$4\r\nname\r\n$3\r\nfoo\r\n",
+    // CLUSTER SLOTS
+    "*1\r\n*4\r\n:0\r\n:5460\r\n*3\r\n$9\r\n127.0.0.1\r\n:30001\r\n$40\r\n"
+        "09dbe9720cda62f7865eabc5fd8857c5d2678366\r\n*3\r\n$9\r\n127.0.0.1\r\n:30004\r\n$40\r\n"
+        "821d8ca00d7ccf931ed3ffc7e3db0599d2271abf\r\n",
+    "*4\r\n*2\r\n$1\r\na\r\n*2\r\n$1\r\nb\r\n$-1\r\n:5\r\n*0\r\n*-1\r\n",
+    "*1\r\n*1\r\n*1\r\n*1\r\n*1\r\n*1\r\n+deep\r\n",
+    // RESP3
+    "_\r\n",
+    "#t\r\n",
+    ",3.14\r\n",
+    ",inf\r\n",
+    "(3492890328409238509324850943850943825024385\r\n",
+    "!21\r\nSYNTAX invalid syntax\r\n",
+    "=15\r\ntxt:Some string\r\n",
+    "%2\r\n+first\r\n:1\r\n+second\r\n%1\r\n$1\r\nk\r\n~2\r\n#f\r\n_\r\n",
+    "~3\r\n+a\r\n+b\r\n+c\r\n",
+    ">3\r\n$10\r\ninvalidate\r\n*1\r\n$3\r\nfoo\r\n_\r\n",
+    "|1\r\n+key-popularity\r\n%1\r\n$1\r\na\r\n,0.19\r\n*2\r\n:2039123\r\n:9543892\r\n",
+    "*2\r\n|1\r\n+ttl\r\n:3600\r\n$1\r\nv\r\n|0\r\n:7\r\n",
+    // broken ones
+    "$abc\r\n",
+    "*1\r\n?\r\n",
+    "$3\r\nfoo",
+    "*2\r\n:1\r\n",
+};
+
+/**
+ * frameAll
+ * feeds `data` in pieces of `step` bytes and records the size of
+ * every reply framed, or -1 where the stream got rejected.
+ **/
+static void frameAll( const char* data, std::size_t size, std::size_t step, std::vector<long>* sizes ) {
+    rp::Buffer input;
+    rp::BufferReader br( input );
+    rp::impl::ReplyParser parser;
+
+    input.AppendCapacity( size + 1 );
+
+    std::size_t fed = 0;
+    for ( ;; ) {
+        if ( fed < size ) {
+            std::size_t n = size - fed < step ? size - fed : step;
+            input.Append( data + fed, n );
+            fed += n;
+        }
+
+        rp::Error err = parser.HandleResponse( br );
+        if ( err.None() && parser.RESP3() ) {
+            // whatever RESP3 framed has to come out as one plain RESP2 reply
+            rp::Buffer reply, converted;
+            reply.Append( input, 0, br.Offset() );
+            rp::BufferReader cbr( converted );
+            rp::impl::ReplyParser check;
+
+            if ( !rp::impl::ConvertToRESP2( reply, &converted ).None() ||
+                !check.HandleResponse( cbr ).None() || check.RESP3() || !cbr.Eof() ) {
+                fprintf( stderr, "bad RESP2 conversion of %.*s\n", (int)reply.Size(), reply.Data() );
+                abort();
+            }
+        }
+
+        if ( err.None() ) {
+            sizes->push_back( long(br.Offset()) );
+            input.Offset( br.Offset() );
+            br.Reset();
+            parser.Reset();
+        } else if ( err == rp::Error::TryAgain ) {
+            if ( fed == size ) {
+                break;
+            }
+        } else {
+            sizes->push_back( -1 );
+            break;
+        }
+    }
+}
+
+#endif
+
+#ifdef RP_REPLY_FUZZ
+/**
+ * clang++ -g -O1 -fsanitize=fuzzer,address -DRP_REPLY_FUZZ -DRP_LIBFUZZER \
+ *     reply.cpp buffer_reader.cpp buffer.cpp scan.cpp mem_alloc.cpp error.cpp
+ * without -DRP_LIBFUZZER a main replays the seed corpus and random
+ * mutations of it, which builds with g++ as well.
+ * the framing of a stream must not depend on how it was split.
+ **/
+extern "C" int LLVMFuzzerTestOneInput( const uint8_t* data, std::size_t size ) {
+    std::vector<long> whole;
+    frameAll( (const char *)data, size, size + 1, &whole );
+
+    std::size_t steps[] = { 1, 2, 7 };
+    for ( std::size_t i = 0; i < sizeof(steps) / sizeof(steps[0]); ++i ) {
+        std::vector<long> split;
+        frameAll( (const char *)data, size, steps[i], &split );
+        if ( split != whole ) {
+            fprintf( stderr, "framing differs with step %zu\n", steps[i] );
+            abort();
+        }
+    }
+
+    return 0;
+}
+
+#ifndef RP_LIBFUZZER
+int main( int argc, char** argv ) {
+    int rounds = argc > 1 ? atoi(argv[1]) : 100000;
+    std::size_t ncorpus = sizeof(kReplyCorpus) / sizeof(kReplyCorpus[0]);
+
+    srand( 1 );
+    for ( std::size_t i = 0; i < ncorpus; ++i ) {
+        std::vector<long> sizes;
+        frameAll( kReplyCorpus[i], strlen(kReplyCorpus[i]), 1, &sizes );
+        printf( "%-3zu %s\n", i, sizes.empty() ? "incomplete" : (sizes[0] < 0 ? "rejected" : "framed") );
+
+        LLVMFuzzerTestOneInput( (const uint8_t *)kReplyCorpus[i], strlen(kReplyCorpus[i]) );
+    }
+
+    for ( int r = 0; r < rounds; ++r ) {
+        std::string s;
+        for ( int n = 1 + rand() % 4; n > 0; --n ) {
+            s += kReplyCorpus[rand() % ncorpus];
+        }
+        for ( int n = rand() % 3; n > 0; --n ) {
+            s[rand() % s.size()] = "*$:+-%~|>_#,!=\r\n0123-x"[rand() % 22];
+        }
+
+        LLVMFuzzerTestOneInput( (const uint8_t *)s.data(), s.size() );
+    }
+
+    printf( "%d mutations framed the same however split\n", rounds );
+    return 0;
+}
+#endif
+#endif
+
+#ifdef RP_REPLY_BENCH
+/**
+ * g++ -O3 -std=c++0x -DRP_REPLY_BENCH reply.cpp buffer_reader.cpp buffer.cpp scan.cpp mem_alloc.cpp error.cpp
+ * frames a stream made of the valid seeds, as the upstream reader does.
+ **/
+#include <time.h>
+
+int main( int argc, char** argv ) {
+    int rounds = argc > 1 ? atoi(argv[1]) : 200;
+    std::size_t ncorpus = sizeof(kReplyCorpus) / sizeof(kReplyCorpus[0]) - 4;
+
+    std::string stream;
+    std::size_t replies = 0;
+    while ( stream.size() < 4 * 1024 * 1024 ) {
+        stream += kReplyCorpus[replies++ % ncorpus];
+    }
+
+    rp::Buffer input;
+    input.Append( stream.data(), stream.size() );
+
+    timespec begin, end;
+    clock_gettime( CLOCK_MONOTONIC, &begin );
+
+    std::size_t framed = 0;
+    for ( int r = 0; r < rounds; ++r ) {
+        rp::Buffer view( input );
+        rp::BufferReader br( view );
+        rp::impl::ReplyParser parser;
+
+        while ( parser.HandleResponse( br ).None() ) {
+            rp::Buffer reply;
+            reply.Append( view, 0, br.Offset() );
+            view.Offset( br.Offset() );
+            br.Reset();
+            parser.Reset();
+            framed++;
+        }
+    }
+
+    clock_gettime( CLOCK_MONOTONIC, &end );
+    double secs = (end.tv_sec - begin.tv_sec) + (end.tv_nsec - begin.tv_nsec) / 1e9;
+
+    printf( "%zu replies of %.1f bytes avg: %.1f MB/s, %.1f ns/reply\n",
+        framed, double(stream.size()) / replies,
+        double(stream.size()) * rounds / secs / 1e6, secs * 1e9 / framed );
+    return 0;
+}
+#endif
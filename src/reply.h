@@ -0,0 +1,84 @@
+#ifndef __RP_REPLY_H__
+#define __RP_REPLY_H__
+
+#include <stdint.h>
+#include <vector>
+
+#include "buffer_reader.h"
+
+namespace rp { namespace impl {
+
+/**
+ * arrays nested deeper than this are taken as a broken stream
+ **/
+#define REPLY_MAX_DEPTH 512
+
+/**
+ * ReplyParser
+ * frames one RESP2 or RESP3 reply of any nesting. the aggregates opened
+ * and not completed yet are kept on a stack instead of recursing, so a
+ * reply cut anywhere resumes where it stopped on the next call.
+ * it only moves the reader, over every byte framed so far, the caller slices
+ * out the reply once done or hands out the part before the reader meanwhile.
+ * the streamed aggregates of RESP3 ("$?", "*?") are not supported.
+ **/
+class ReplyParser {
+public:
+    ReplyParser() : bulkLeft_(-1), type_(0), resp3_(false) {}
+
+public:
+    Error HandleResponse( BufferReader& br );
+    void Reset() {
+        stack_.clear();
+        bulkLeft_ = -1;
+        type_ = 0;
+        resp3_ = false;
+    }
+
+public:
+    /**
+     * the type byte of the reply, attributes in front of it aside.
+     * '>' is an out-of-band push, which answers no request.
+     **/
+    char Type() const { return type_; }
+    /**
+     * the reply holds types RESP2 does not have, see ConvertToRESP2()
+     **/
+    bool RESP3() const { return resp3_; }
+
+private:
+    bool elementDone();
+
+private:
+    struct Frame {
+        int64_t left;
+        // an attribute decorates the element after it and counts for nothing
+        bool attribute;
+    };
+
+    /**
+     * elements still to come of every open aggregate, the innermost last
+     **/
+    std::vector<Frame> stack_;
+
+    /**
+     * bytes of the current bulk body plus its "\r\n" not read yet,
+     * -1 between elements.
+     **/
+    int64_t bulkLeft_;
+
+    char type_;
+    bool resp3_;
+};
+
+/**
+ * ConvertToRESP2
+ * rewrites a framed RESP3 reply for a client speaking RESP2 the way
+ * redis does: maps and sets become arrays, null $-1, booleans integers,
+ * doubles and big numbers bulk strings, attributes are dropped.
+ **/
+Error ConvertToRESP2( const Buffer& reply, Buffer* out );
+
+}}
+
+#endif
@@ -0,0 +1,226 @@
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "resolver.h"
+#include "metric.h"
+
+namespace rp { namespace io {
+
+enum {
+    // failed lookups are retried no sooner than this, in ms
+    RESOLVE_NEGATIVE_TTL    = 1000,
+};
+
+Resolver::~Resolver() {
+    {
+        std::lock_guard<std::mutex> guard( lock_ );
+        stop_ = true;
+    }
+    cond_.notify_one();
+
+    if ( thread_.joinable() ) {
+        thread_.join();
+    }
+
+    if ( fd != -1 ) {
+        RemoveNotify();
+        close( fd );
+        fd = -1;
+    }
+}
+
+Error Resolver::Init( const NetIoOptions& opt ) {
+    ttl_ = opt.ResolveCacheTTL;
+
+    int efd = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC );
+    if ( efd == -1 ) {
+        return Error( errno, strerror(errno) );
+    }
+
+    fd = efd;
+    events = EPOLLIN;
+
+    Error err = Attach();
+    if ( !err.None() ) {
+        return err;
+    }
+
+    thread_ = std::thread( std::bind(&Resolver::run, this) );
+    return Error::OK;
+}
+
+std::string Resolver::keyOf( const Addr& addr ) {
+    return std::string(addr.Host()) + ":" + std::to_string(addr.Port());
+}
+
+Error Resolver::Resolve( const Addr& addr, ResolvedAddr* resolved, CallbackType cb, uint64_t* id ) {
+    // ip literals and unix paths need no lookup
+    if ( addr.IsUnix() || io::Resolve(addr, resolved, AI_NUMERICHOST).None() ) {
+        return Error::OK;
+    }
+
+    std::string key( keyOf(addr) );
+    Entry& entry( entries_[key] );
+
+    if ( entry.valid ) {
+        MetricFactoryInstance->FetchTimeSum( "resolve_hit" )->Inc();
+
+        if ( entry.expire <= Timers().Now() && !entry.resolving ) {
+            // keep serving the old one meanwhile
+            post( key, addr );
+        }
+
+        if ( !entry.err.None() ) {
+            return entry.err;
+        }
+
+        *resolved = entry.resolved;
+        return Error::OK;
+    }
+
+    MetricFactoryInstance->FetchTimeSum( "resolve_miss" )->Inc();
+
+    if ( !entry.resolving ) {
+        post( key, addr );
+    }
+
+    Waiter waiter;
+    waiter.id = ++nextId_;
+    waiter.cb = cb;
+    entry.waiters.push_back( waiter );
+
+    *id = waiter.id;
+    return Error::TryAgain;
+}
+
+void Resolver::Cancel( uint64_t id ) {
+    for ( EntryMapType::iterator it = entries_.begin(); it != entries_.end(); ++it ) {
+        std::vector<Waiter>& waiters( it->second.waiters );
+        for ( std::size_t i = 0; i < waiters.size(); i++ ) {
+            if ( waiters[i].id == id ) {
+                waiters.erase( waiters.begin() + i );
+                return;
+            }
+        }
+    }
+}
+
+Error Resolver::Prefetch( const Addr& addr ) {
+    ResolvedAddr resolved;
+    if ( addr.IsUnix() || io::Resolve(addr, &resolved, AI_NUMERICHOST).None() ) {
+        return Error::OK;
+    }
+
+    int64_t start = ustime();
+    Error err = io::Resolve( addr, &resolved );
+    MetricFactoryInstance->FetchTimeSum( "resolve" )->Add( ustime() - start );
+
+    update( entries_[keyOf(addr)], err, resolved );
+    return err;
+}
+
+void Resolver::update( Entry& entry, const Error& err, const ResolvedAddr& resolved ) {
+    int64_t now = Timers().Now();
+
+    if ( err.None() ) {
+        entry.resolved = resolved;
+        entry.err = Error::OK;
+        entry.expire = now + ttl_;
+    } else if ( entry.valid && entry.err.None() ) {
+        // better an old address than none
+        LogWarnf( "refreshing an address failed:%s", err.String().c_str() );
+        entry.expire = now + RESOLVE_NEGATIVE_TTL;
+    } else {
+        entry.err = err;
+        entry.expire = now + RESOLVE_NEGATIVE_TTL;
+    }
+
+    entry.valid = true;
+}
+
+void Resolver::post( const std::string& key, const Addr& addr ) {
+    entries_[key].resolving = true;
+
+    Job job;
+    job.key = key;
+    job.addr = addr;
+    job.takeUs = 0;
+
+    {
+        std::lock_guard<std::mutex> guard( lock_ );
+        jobs_.push_back( job );
+    }
+    cond_.notify_one();
+}
+
+/**
+ * run
+ * the helper thread, it only touches jobs_ and done_
+ **/
+void Resolver::run() {
+    std::unique_lock<std::mutex> guard( lock_ );
+
+    while ( true ) {
+        cond_.wait( guard, [this]() { return stop_ || !jobs_.empty(); } );
+        if ( stop_ ) {
+            break;
+        }
+
+        Job job( jobs_.front() );
+        jobs_.pop_front();
+        guard.unlock();
+
+        int64_t start = ustime();
+        job.err = io::Resolve( job.addr, &job.resolved );
+        job.takeUs = ustime() - start;
+
+        guard.lock();
+        done_.push_back( job );
+
+        uint64_t one = 1;
+        if ( write(fd, &one, sizeof(one)) == -1 ) {
+            // the counter is already non-zero
+        }
+    }
+}
+
+/**
+ * OnReadable
+ * the helper has finished some lookups
+ **/
+Error Resolver::OnReadable() {
+    uint64_t count;
+    if ( read(fd, &count, sizeof(count)) == -1 ) {
+        return Error::OK;
+    }
+
+    std::list<Job> done;
+    {
+        std::lock_guard<std::mutex> guard( lock_ );
+        done.swap( done_ );
+    }
+
+    TimeSumMetric* resolveMetric = MetricFactoryInstance->FetchTimeSum( "resolve" );
+
+    for ( std::list<Job>::iterator it = done.begin(); it != done.end(); ++it ) {
+        resolveMetric->Add( it->takeUs );
+
+        Entry& entry( entries_[it->key] );
+        entry.resolving = false;
+        update( entry, it->err, it->resolved );
+
+        if ( !it->err.None() ) {
+            LogErrorf( "resolving %s failed:%s", it->key.c_str(), it->err.String().c_str() );
+        }
+
+        std::vector<Waiter> waiters;
+        waiters.swap( entry.waiters );
+        for ( std::size_t i = 0; i < waiters.size(); i++ ) {
+            waiters[i].cb( entry.err, entry.resolved );
+        }
+    }
+
+    return Error::OK;
+}
+
+}}
@@ -0,0 +1,105 @@
+#ifndef __RP_RESOLVER_H__
+#define __RP_RESOLVER_H__
+
+#include <string>
+#include <map>
+#include <list>
+#include <vector>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include "io.h"
+
+namespace rp { namespace io {
+
+/**
+ * Resolver
+ * caches the upstream addresses of one loop and looks the host names up
+ * on a helper thread, so neither a connect nor a reconnect storm ever
+ * waits on DNS inside the loop.
+ *
+ * an expired entry is still handed out while it is refreshed in the
+ * background; only the first lookup of a name has to wait, its callback
+ * is invoked from the loop once the helper is done.
+ **/
+class Resolver : public Event {
+public:
+    typedef std::function<void (const Error&, const ResolvedAddr&)>    CallbackType;
+
+public:
+    explicit Resolver( ContextType ctx ) : Event(ctx), ttl_(0), nextId_(0), stop_(false) {}
+    virtual ~Resolver();
+
+public:
+    Error Init( const NetIoOptions& opt );
+
+    /**
+     * returns OK with `resolved` filled when it is known already,
+     * TryAgain when `cb` will be called later, with `*id` to cancel it.
+     **/
+    Error Resolve( const Addr& addr, ResolvedAddr* resolved, CallbackType cb, uint64_t* id );
+    void Cancel( uint64_t id );
+
+    /**
+     * blocking lookup filling the cache, for the startup only
+     **/
+    Error Prefetch( const Addr& addr );
+
+public:
+    virtual Error OnReadable();
+
+private:
+    struct Waiter {
+        uint64_t id;
+        CallbackType cb;
+    };
+
+    struct Entry {
+        ResolvedAddr resolved;
+        Error err;
+        int64_t expire;
+        bool valid;
+        bool resolving;
+        std::vector<Waiter> waiters;
+
+        Entry() : expire(0), valid(false), resolving(false) {}
+    };
+
+    struct Job {
+        std::string key;
+        Addr addr;
+        ResolvedAddr resolved;
+        Error err;
+        int64_t takeUs;
+    };
+
+private:
+    static std::string keyOf( const Addr& addr );
+
+    void update( Entry& entry, const Error& err, const ResolvedAddr& resolved );
+    void post( const std::string& key, const Addr& addr );
+    void run();
+
+private:
+    int64_t ttl_;
+    uint64_t nextId_;
+
+    typedef std::map<std::string, Entry>    EntryMapType;
+    EntryMapType entries_;
+
+    /**
+     * shared with the helper thread
+     **/
+    std::mutex  lock_;
+    std::condition_variable cond_;
+    std::list<Job>  jobs_;
+    std::list<Job>  done_;
+    bool stop_;
+    std::thread thread_;
+};
+
+}}
+
+#endif
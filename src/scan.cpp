@@ -0,0 +1,298 @@
+
+#include <string.h>
+#include <stdint.h>
+#include <atomic>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define RP_SCAN_X86
+#endif
+
+#include "scan.h"
+
+namespace rp { namespace scan {
+
+/**
+ * the vector paths keep one broadcast register per byte of the set,
+ * larger sets go to the scalar one.
+ **/
+#define MAX_VECTOR_SET  4
+
+typedef const char* (*FindFirstOfType)( const char*, std::size_t, const char*, int );
+
+static inline bool matchByte( char ch, const char* set, int nset ) {
+    for ( int i = 0; i < nset; ++i ) {
+        if ( ch == set[i] ) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * findScalar
+ * checks 8 bytes a time with the has-zero-byte trick on word ^ broadcast,
+ * a hit in the word is then located byte by byte.
+ **/
+static const char* findScalar( const char* data, std::size_t size, const char* set, int nset ) {
+    static const uint64_t ones = 0x0101010101010101ULL;
+    static const uint64_t highs = 0x8080808080808080ULL;
+
+    if ( nset == 1 ) {
+        return (const char *)memchr( data, set[0], size );
+    }
+
+    const char* end = data + size;
+    const char* p = data;
+    if ( nset <= MAX_VECTOR_SET ) {
+        uint64_t needles[MAX_VECTOR_SET];
+        for ( int i = 0; i < nset; ++i ) {
+            needles[i] = ones * (uint8_t)set[i];
+        }
+
+        for ( ; p + 8 <= end; p += 8 ) {
+            uint64_t word;
+            memcpy( &word, p, 8 );
+
+            uint64_t hit = 0;
+            for ( int i = 0; i < nset; ++i ) {
+                uint64_t x = word ^ needles[i];
+                hit |= (x - ones) & ~x & highs;
+            }
+
+            if ( hit != 0 ) {
+                break;
+            }
+        }
+    }
+
+    for ( ; p < end; ++p ) {
+        if ( matchByte(*p, set, nset) ) {
+            return p;
+        }
+    }
+
+    return nullptr;
+}
+
+#ifdef RP_SCAN_X86
+
+static inline int matchSSE2( const char* p, const __m128i* needles, int nset ) {
+    __m128i block = _mm_loadu_si128( (const __m128i *)p );
+    __m128i hit = _mm_cmpeq_epi8( block, needles[0] );
+    for ( int i = 1; i < nset; ++i ) {
+        hit = _mm_or_si128( hit, _mm_cmpeq_epi8(block, needles[i]) );
+    }
+    return _mm_movemask_epi8( hit );
+}
+
+static const char* findSSE2( const char* data, std::size_t size, const char* set, int nset ) {
+    if ( size < 16 || nset > MAX_VECTOR_SET ) {
+        return findScalar( data, size, set, nset );
+    }
+
+    __m128i needles[MAX_VECTOR_SET];
+    for ( int i = 0; i < nset; ++i ) {
+        needles[i] = _mm_set1_epi8( set[i] );
+    }
+
+    const char* end = data + size;
+    const char* p = data;
+    for ( ; p + 16 <= end; p += 16 ) {
+        int mask = matchSSE2( p, needles, nset );
+        if ( mask != 0 ) {
+            return p + __builtin_ctz( mask );
+        }
+    }
+
+    /**
+     * the tail goes with one more block ending at `end`, overlapping
+     * bytes known to be no match, so the first hit is still the first.
+     **/
+    if ( p < end ) {
+        p = end - 16;
+        int mask = matchSSE2( p, needles, nset );
+        if ( mask != 0 ) {
+            return p + __builtin_ctz( mask );
+        }
+    }
+
+    return nullptr;
+}
+
+__attribute__((target("avx2")))
+static inline int matchAVX2( const char* p, const __m256i* needles, int nset ) {
+    __m256i block = _mm256_loadu_si256( (const __m256i *)p );
+    __m256i hit = _mm256_cmpeq_epi8( block, needles[0] );
+    for ( int i = 1; i < nset; ++i ) {
+        hit = _mm256_or_si256( hit, _mm256_cmpeq_epi8(block, needles[i]) );
+    }
+    return _mm256_movemask_epi8( hit );
+}
+
+__attribute__((target("avx2")))
+static const char* findAVX2( const char* data, std::size_t size, const char* set, int nset ) {
+    if ( size < 32 || nset > MAX_VECTOR_SET ) {
+        return findSSE2( data, size, set, nset );
+    }
+
+    __m256i needles[MAX_VECTOR_SET];
+    for ( int i = 0; i < nset; ++i ) {
+        needles[i] = _mm256_set1_epi8( set[i] );
+    }
+
+    const char* end = data + size;
+    const char* p = data;
+    for ( ; p + 32 <= end; p += 32 ) {
+        int mask = matchAVX2( p, needles, nset );
+        if ( mask != 0 ) {
+            return p + __builtin_ctz( mask );
+        }
+    }
+
+    // overlapping tail, the same as findSSE2()
+    if ( p < end ) {
+        p = end - 32;
+        int mask = matchAVX2( p, needles, nset );
+        if ( mask != 0 ) {
+            return p + __builtin_ctz( mask );
+        }
+    }
+
+    return nullptr;
+}
+
+#endif
+
+static const char* findResolve( const char* data, std::size_t size, const char* set, int nset );
+
+static std::atomic<FindFirstOfType> findImpl( findResolve );
+static const char* implName = "scalar";
+
+/**
+ * findResolve
+ * picks the implementation on the first call, whichever thread makes it
+ **/
+static const char* findResolve( const char* data, std::size_t size, const char* set, int nset ) {
+    FindFirstOfType impl = findScalar;
+
+#ifdef RP_SCAN_X86
+    __builtin_cpu_init();
+    if ( __builtin_cpu_supports("avx2") ) {
+        impl = findAVX2;
+        implName = "avx2";
+    } else if ( __builtin_cpu_supports("sse2") ) {
+        impl = findSSE2;
+        implName = "sse2";
+    }
+#endif
+
+    findImpl.store( impl, std::memory_order_relaxed );
+    return impl( data, size, set, nset );
+}
+
+const char* FindFirstOf( const char* data, std::size_t size, const char* set, int nset ) {
+    return findImpl.load( std::memory_order_relaxed )( data, size, set, nset );
+}
+
+const char* Implementation() {
+    findResolve( "", 0, "", 1 );
+    return implName;
+}
+
+}}
+
+#ifdef RP_SCAN_BENCH
+/**
+ * g++ -O3 -std=c++0x -DRP_SCAN_BENCH scan.cpp -o scan_bench
+ * tokenizes inline commands of 40-200 bytes the way InlineParser does,
+ * and reports the bytes per cycle of every implementation.
+ **/
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+#include <x86intrin.h>
+
+struct BenchCmd {
+    const char* data;
+    std::size_t size;
+};
+
+// one memchr() per delimiter over the rest, as BufferReader used to
+static const char* findMemchrEach( const char* data, std::size_t size, const char* set, int nset ) {
+    const char* first = nullptr;
+    for ( int i = 0; i < nset; ++i ) {
+        const char* p = (const char *)memchr( data, set[i], size );
+        if ( p != nullptr && (first == nullptr || p < first) ) {
+            first = p;
+        }
+    }
+    return first;
+}
+
+static double bench( const char* name, rp::scan::FindFirstOfType find,
+    const std::vector<BenchCmd>& cmds, std::size_t total, int rounds ) {
+    static const char split[] = { ' ', '\n' };
+    std::size_t tokens = 0;
+
+    uint64_t begin = __rdtsc();
+    for ( int r = 0; r < rounds; ++r ) {
+        for ( std::size_t i = 0; i < cmds.size(); ++i ) {
+            const char* p = cmds[i].data;
+            const char* end = p + cmds[i].size;
+            while ( p < end ) {
+                const char* hit = find( p, end - p, split, 2 );
+                if ( hit == nullptr ) {
+                    break;
+                }
+                tokens++;
+                p = hit + 1;
+            }
+        }
+    }
+    uint64_t cycles = __rdtsc() - begin;
+
+    double bpc = double(total) * rounds / double(cycles);
+    printf( "%-12s %8.3f bytes/cycle %8.1f cycles/cmd  (%zu tokens)\n", name, bpc,
+        double(cycles) / (double(cmds.size()) * rounds), tokens );
+    return bpc;
+}
+
+int main( int argc, char** argv ) {
+    int ncmds = 4096;
+    int rounds = argc > 1 ? atoi(argv[1]) : 200;
+
+    std::vector<char> storage( ncmds * 256 );
+    std::vector<BenchCmd> cmds;
+    std::size_t total = 0;
+
+    srand( 1 );
+    char* w = &storage[0];
+    for ( int i = 0; i < ncmds; ++i ) {
+        int len = 40 + rand() % 161;
+        int n = snprintf( w, len, "set key:%08d ", rand() );
+        for ( ; n < len - 2; ++n ) {
+            w[n] = 'a' + rand() % 26;
+        }
+        w[n++] = '\r';
+        w[n++] = '\n';
+
+        BenchCmd cmd = { w, std::size_t(n) };
+        cmds.push_back( cmd );
+        total += n;
+        w += n;
+    }
+
+    printf( "%d commands, %.1f bytes avg, runtime pick: %s\n",
+        ncmds, double(total) / ncmds, rp::scan::Implementation() );
+
+    bench( "memchr-each", findMemchrEach, cmds, total, rounds );
+    bench( "scalar", rp::scan::findScalar, cmds, total, rounds );
+    bench( "sse2", rp::scan::findSSE2, cmds, total, rounds );
+    if ( __builtin_cpu_supports("avx2") ) {
+        bench( "avx2", rp::scan::findAVX2, cmds, total, rounds );
+    }
+
+    return 0;
+}
+#endif
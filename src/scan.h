@@ -0,0 +1,27 @@
+#ifndef __RP_SCAN_H__
+#define __RP_SCAN_H__
+
+#include <stddef.h>
+
+namespace rp { namespace scan {
+
+/**
+ * FindFirstOf
+ * returns the first byte in [data, data + size) which is one of
+ * set[0..nset), or nullptr if there is none. the whole set is matched
+ * in a single pass, with SSE2/AVX2 when the cpu has them.
+ **/
+const char* FindFirstOf( const char* data, std::size_t size, const char* set, int nset );
+
+inline const char* FindFirst( const char* data, std::size_t size, char ch ) {
+    return FindFirstOf( data, size, &ch, 1 );
+}
+
+/**
+ * the implementation chosen at startup, "avx2", "sse2" or "scalar"
+ **/
+const char* Implementation();
+
+}}
+
+#endif
@@ -1,98 +1,78 @@
 
+#include <thread>
+
 #include "server.h"
-#include "connections.h"
-#include "cmd.h"
+#include "logger.h"
 #include "metric.h"
 
 namespace rp {
-MetricFactory* MetricFactoryInstance = nullptr;
-
-Error Server::newClientConnection( Connection** pconn ) {
-    Connection* conn = nullptr;
-    Error err = connPool_.CreateConnection( &conn );
-    if ( !err.None() ) {
-        return err; 
-    }
+thread_local MetricFactory* MetricFactoryInstance = nullptr;
 
-    Session* sess;
-    err = sessPool_.CreateSession( &sess, conn );
-    if ( !err.None() ) {
-        return err; 
+Server::~Server() {
+    for ( std::size_t i = 0; i < workers_.size(); ++i ) {
+        delete workers_[i];
     }
-
-    err = sess->OnNewClientConnection( conn );
-    if ( !err.None() ) { 
-        return err; 
-    }
-
-    *pconn = conn;
-    return Error::OK;
 }
 
 Error Server::Init() {
-    MetricFactoryInstance = new MetricFactory;
-    lastMetricUpdate_ = ustime() / 1000;
-
-    io::NetIoOptions& opt(serverOpt_.ClientOpt->NetOpt);
-    {
-        using namespace std::placeholders;
-        opt.NewConnectionHandler = std::bind( &Server::newClientConnection, this, _1 );
+    int threads = serverOpt_.WorkerThreads;
+    if ( threads <= 0 ) {
+        threads = std::thread::hardware_concurrency();
+        if ( threads <= 0 ) { threads = 1; }
     }
 
-    Error err = io::Init( &listenEvt_.context, opt );
-    if ( !err.None() ) {
-        return err;
+    /**
+     * every worker binds its own listen socket on the same address,
+     * and the kernel spreads the incoming clients among them.
+     * a unix socket is bound once and shared instead.
+     **/
+    if ( threads > 1 ) {
+        serverOpt_.ClientOpt->NetOpt.ListenReusePort = true;
     }
 
-    err = connPool_.Init( listenEvt_.context );
-    if ( !err.None() ) {
-        return err;
-    }
-
-    io::Addr addr(serverOpt_.BindHost.c_str(), serverOpt_.BindPort);
-    err = io::Listen( &listenEvt_, addr, serverOpt_.ClientOpt->NetOpt );
-    if ( !err.None() ) {
-        return err;
-    }
+    for ( int i = 0; i < threads; ++i ) {
+        Worker* worker = new Worker( i, serverOpt_ );
+        workers_.push_back( worker );
 
-    err = upstreamPool_.Init();
-    if ( !err.None() ) {
-        return err;
+        Error err = worker->Init( i > 0 ? workers_[0] : nullptr );
+        if ( !err.None() ) {
+            LogErrorf( "worker[%d] Init() failed:%s", i, err.String().c_str() );
+            return err;
+        }
     }
 
     return Error::OK;
 }
 
-Error Server::RunOnce() {
-    //TimeSumMetric* pollMetric = MetricFactoryInstance->FetchTimeSum( "poll" );
-
-    io::NetIoOptions& opt(serverOpt_.ClientOpt->NetOpt);
-
-    //pollMetric->TimingBegin();
-    Error err = io::PollOnce( listenEvt_.context, &listenEvt_, opt );
-    //pollMetric->Inc();
-
-    if ( !err.None() ) {
-        // handle the error
-        return err;
+Error Server::Run() {
+    if ( workers_.empty() ) {
+        return Error::InitFailed;
     }
 
-    int64_t now = ustime() / 1000;
-    if ( now -  lastMetricUpdate_ >= 5000) {
-        lastMetricUpdate_ = now;
-        //MetricFactoryInstance->PrintInfo();
+    std::vector<std::thread> threads;
+    for ( std::size_t i = 1; i < workers_.size(); ++i ) {
+        Worker* worker = workers_[i];
+        threads.push_back( std::thread( [worker]() {
+            Error err = worker->Run();
+            if ( !err.None() ) {
+                LogErrorf( "worker[%d] Run() failed:%s", worker->Index(), err.String().c_str() );
+            }
+        } ) );
     }
 
-    return Error::OK;
-}
+    // the first worker runs on the main thread
+    Error err = workers_[0]->Run();
 
-Error Server::Run() {
-    while( true ) {
-        Error err = RunOnce();
-        if ( !err.None() ) { return err; }
+    // the others would loop for ever, the process is going down with err
+    for ( std::size_t i = 1; i < workers_.size(); ++i ) {
+        workers_[i]->Stop();
     }
 
-    return Error::OK;
+    for ( std::size_t i = 0; i < threads.size(); ++i ) {
+        threads[i].join();
+    }
+
+    return err;
 }
 
 }
@@ -1,4 +1,6 @@
 
+#include <string.h>
+#include <strings.h>
 #include <functional>
 
 #include "session.h"
@@ -7,21 +9,383 @@
 namespace rp {
 
 
-void Session::OnServerWrite( const Buffer& buffer ) {
+void Session::OnServerWrite( const Buffer& buffer, uint64_t tag ) {
+    inflight_--;
+
+    if ( clientConn_ == nullptr ) {
+        // the client has gone, drop the reply
+        if ( inflight_ == 0 ) {
+            sessionPool_->RemoveSession( this );
+        }
+        return;
+    }
+
     if ( clientConn_->IsConnected() ) {
-        clientConn_->WriteToBuffer( buffer );
+        if ( replyStreamed_ && tag == streamedTag_ ) {
+            replyStreamed_ = false;
+            if ( buffer.Empty() ) {
+                // cut in the middle, nothing the client could make sense of follows
+                clientConn_->WriteToBuffer( buffer, NET_FLAG_CLOSE );
+                return;
+            }
+        }
+
+        ReplySlot& slot( slots_[tag - slotBase_] );
+        slot.ready = true;
+        slot.reply = buffer;
+        flushSlots();
+
+        if ( closing_ ) {
+            return;
+        }
+        clientConn_->SetReadable( true );
+
+        // the cmd waiting might go now, no more data has to come for that
+        if ( pushPending_ ) {
+            OnClientRead( clientConn_, parser_.GetInputBuffer() );
+        }
+    }
+}
+
+/**
+ * flushSlots
+ * the replies ready at the front, and the ones made here behind them
+ **/
+void Session::flushSlots() {
+    while ( !slots_.empty() && slots_.front().ready ) {
+        clientConn_->WriteToBuffer( slots_.front().reply, slots_.front().flags );
+        slots_.pop_front();
+        slotBase_++;
+    }
+}
+
+/**
+ * a reply goes out in parts only when nothing is to go out before it
+ **/
+bool Session::Streamable( uint64_t tag ) const {
+    return clientConn_ == nullptr || tag == slotBase_;
+}
+
+Error Session::OnServerStream( Upstream* upstream, const Buffer& part ) {
+    // the client has gone, the rest is dropped as it comes
+    if ( clientConn_ == nullptr || !clientConn_->IsConnected() ) {
+        return Error::OK;
+    }
+
+    // only the reply at the front is streamed, see Streamable()
+    replyStreamed_ = true;
+    streamedTag_ = slotBase_;
+    Error err = clientConn_->WriteToBuffer( part );
+    if ( !err.None() ) {
+        return err;
+    }
+
+    if ( clientOpt_.StreamPendingSize > 0 && clientConn_->PendingSize() >= clientOpt_.StreamPendingSize ) {
+        throttled_ = upstream;
+        return Error::TryAgain;
+    }
+    return Error::OK;
+}
+
+Error Session::OnClientWritable( Connection* conn ) {
+    assert( conn == clientConn_ );
+
+    if ( throttled_ != nullptr && conn->PendingSize() < clientOpt_.StreamPendingSize ) {
+        Upstream* upstream = throttled_;
+        throttled_ = nullptr;
+        upstream->ResumeRead();
+    }
+    return Error::OK;
+}
+
+void Session::OnUpstreamReady() {
+    if ( clientConn_ != nullptr && clientConn_->IsConnected() && !closing_ && (pushPending_ || streaming_) ) {
         clientConn_->SetReadable( true );
+        OnClientRead( clientConn_, parser_.GetInputBuffer() );
     }
 }
 
+/**
+ * forwardStream
+ * passes on the rest of a streamed request as far as it has come.
+ * TryAgain while the upstream has enough to send, OnUpstreamReady() goes on.
+ **/
+Error Session::forwardStream() {
+    while ( streaming_ ) {
+        if ( streamChunk_.Empty() && !streamLast_ ) {
+            Error err = parser_.ParseStream( &streamChunk_ );
+            if ( err.None() ) {
+                streamLast_ = true;
+            } else if ( err != Error::TryAgain ) {
+                return err;
+            } else if ( streamChunk_.Empty() ) {
+                return Error::OK;
+            }
+        }
+
+        Error err = upstreamPool_->PushStream( streamChunk_, streamLast_, this );
+        if ( err == Error::TryAgain ) {
+            return err;
+        }
+
+        // anything else has failed the request already, the rest is dropped
+        streamChunk_ = Buffer();
+        if ( streamLast_ ) {
+            streaming_ = false;
+            streamLast_ = false;
+            parser_.Reset();
+            currentCmd_.Reset();
+        }
+    }
+
+    return Error::OK;
+}
+
+/**
+ * replyUnavailable
+ * the upstream is down, the reply takes its place behind the ones
+ * still to come from the others.
+ **/
+Error Session::replyUnavailable( Connection* conn ) {
+    static const char msg[] = "-ERR upstream unavailable\r\n";
+    return writeLocal( conn, Buffer(msg, sizeof(msg) - 1) );
+}
+
+/**
+ * writeLocal
+ * a reply made here goes out after the ones still to come from upstream,
+ * it takes a slot only while there are any.
+ **/
+Error Session::writeLocal( Connection* conn, const Buffer& reply, int flags ) {
+    if ( slots_.empty() ) {
+        return conn->WriteToBuffer( reply, flags );
+    }
+
+    slots_.push_back( ReplySlot(reply, flags) );
+    return Error::OK;
+}
+
+static Buffer integerReply( long long n ) {
+    char reply[32];
+    int size = snprintf( reply, sizeof(reply), ":%lld\r\n", n );
+    return Buffer( reply, size );
+}
+
+static bool argIs( const Slice& arg, const char* s, std::size_t size ) {
+    return arg.Size() == size && strncasecmp( arg.Data(), s, size ) == 0;
+}
+
+/**
+ * replyLocal
+ * the commands about the connection itself are answered here, without a
+ * trip to the upstream. the forms not known here go on, NotFound then.
+ **/
+Error Session::replyLocal( Connection* conn ) {
+    static const CommandInfo* ping = LookupCommand( "ping", 4 );
+    static const CommandInfo* echo = LookupCommand( "echo", 4 );
+    static const CommandInfo* quit = LookupCommand( "quit", 4 );
+    static const CommandInfo* select = LookupCommand( "select", 6 );
+    static const CommandInfo* client = LookupCommand( "client", 6 );
+    static const CommandInfo* command = LookupCommand( "command", 7 );
+
+    static const Buffer ok( "+OK\r\n", 5 );
+    static const Buffer pong( "+PONG\r\n", 7 );
+    static const Buffer nil( "$-1\r\n", 5 );
+    static const Buffer commandCount( integerReply( CommandCount() ) );
+
+    const CommandInfo* info = currentCmd_.Info();
+    if ( info == nullptr ) {
+        return Error::NotFound;
+    }
+
+    std::size_t argc = currentCmd_.GetArgSize();
+    if ( info == ping && argc <= 1 ) {
+        if ( argc == 0 ) {
+            return writeLocal( conn, pong );
+        }
+        info = echo;
+    }
+
+    if ( info == echo && argc == 1 ) {
+        Slice msg = currentCmd_.GetArg( 0 );
+        char head[32];
+        int n = snprintf( head, sizeof(head), "$%zu\r\n", msg.Size() );
+
+        Buffer reply;
+        Error err = reply.AppendCapacity( n + msg.Size() + 2 );
+        if ( err.None() ) { err = reply.Append( head, n ); }
+        if ( err.None() ) { err = reply.Append( msg.Data(), msg.Size() ); }
+        if ( err.None() ) { err = reply.Append( "\r\n", 2 ); }
+        if ( !err.None() ) {
+            return err;
+        }
+        return writeLocal( conn, reply );
+    }
+
+    if ( info == quit ) {
+        closing_ = true;
+        return writeLocal( conn, ok, NET_FLAG_CLOSE );
+    }
+
+    // the link is shared, another db on it would be for everyone
+    if ( info == select && argc == 1 ) {
+        if ( argIs( currentCmd_.GetArg( 0 ), "0", 1 ) ) {
+            return writeLocal( conn, ok );
+        }
+
+        static const char msg[] = "-ERR only DB 0 is served by the proxy\r\n";
+        return writeLocal( conn, Buffer(msg, sizeof(msg) - 1) );
+    }
+
+    if ( info == client && argc == 2 && argIs( currentCmd_.GetArg( 0 ), "setname", 7 ) ) {
+        Slice name = currentCmd_.GetArg( 1 );
+        for ( std::size_t i = 0; i < name.Size(); ++i ) {
+            if ( name.Data()[i] < '!' || name.Data()[i] > '~' ) {
+                static const char msg[] = "-ERR Client names cannot contain spaces, newlines or special characters.\r\n";
+                return writeLocal( conn, Buffer(msg, sizeof(msg) - 1) );
+            }
+        }
+
+        name_.assign( name.Data(), name.Size() );
+        return writeLocal( conn, ok );
+    }
+
+    if ( info == client && argc == 1 && argIs( currentCmd_.GetArg( 0 ), "getname", 7 ) ) {
+        if ( name_.empty() ) {
+            return writeLocal( conn, nil );
+        }
+
+        char head[32];
+        int n = snprintf( head, sizeof(head), "$%zu\r\n", name_.size() );
+        return writeLocal( conn, Buffer( (head + name_ + "\r\n").c_str(), n + name_.size() + 2 ) );
+    }
+
+    if ( info == command && argc == 1 && argIs( currentCmd_.GetArg( 0 ), "count", 5 ) ) {
+        return writeLocal( conn, commandCount );
+    }
+
+    return Error::NotFound;
+}
+
+/**
+ * replyHello
+ * HELLO [protover [AUTH username password] [SETNAME clientname]]
+ * the proxy has no users of its own, AUTH and SETNAME are taken as they are.
+ **/
+Error Session::replyHello( Connection* conn ) {
+    if ( currentCmd_.GetArgSize() > 0 ) {
+        Slice ver = currentCmd_.GetArg( 0 );
+        std::string v( ver.Data(), ver.Size() );
+        if ( v != "2" && v != "3" ) {
+            static const char msg[] = "-NOPROTO sorry, this protocol version is not supported.\r\n";
+            return conn->WriteToBuffer( Buffer(msg, sizeof(msg) - 1) );
+        }
+
+        protocol_ = v[0] - '0';
+    }
+
+    char reply[512];
+    int n = snprintf( reply, sizeof(reply), "%s"
+        "$6\r\nserver\r\n$10\r\nredisproxy\r\n"
+        "$7\r\nversion\r\n$%zu\r\n%s\r\n"
+        "$5\r\nproto\r\n:%d\r\n"
+        "$2\r\nid\r\n:%llu\r\n"
+        "$4\r\nmode\r\n$10\r\nstandalone\r\n"
+        "$4\r\nrole\r\n$6\r\nmaster\r\n"
+        "$7\r\nmodules\r\n*0\r\n",
+        protocol_ == 3 ? "%7\r\n" : "*14\r\n", strlen(RP_VERSION), RP_VERSION,
+        protocol_, (unsigned long long)id_ );
+
+    return writeLocal( conn, Buffer(reply, n) );
+}
+
+/**
+ * dispatch
+ * sends currentCmd_ on its way or answers it here. TryAgain when it has
+ * to wait, reading is paused then and resumed by a reply coming back.
+ **/
+Error Session::dispatch( Connection* conn ) {
+    // the rest of a streamed one can only go to the upstream
+    if ( !currentCmd_.Streaming() ) {
+        Slice name = currentCmd_.GetCmd();
+        if ( name.Size() == 5 && strncasecmp( name.Data(), "hello", 5 ) == 0 ) {
+            // the replies in front of it are in the protocol before
+            if ( inflight_ > 0 ) {
+                return Error::TryAgain;
+            }
+            return replyHello( conn );
+        }
+
+        // the link is shared, the pushes of a subscription have no owner on it
+        const CommandInfo* info = currentCmd_.Info();
+        if ( info != nullptr && (info->flags & CMD_PUBSUB) && strstr( info->name, "subscribe" ) != nullptr ) {
+            static const char msg[] = "-ERR subscribing is not supported by the proxy\r\n";
+            return writeLocal( conn, Buffer(msg, sizeof(msg) - 1) );
+        }
+
+        Error err = replyLocal( conn );
+        if ( err != Error::NotFound ) {
+            return err;
+        }
+    }
+
+    Error err = upstreamPool_->PushRequest( currentCmd_, this, slotBase_ + slots_.size() );
+    if ( err == Error::Closed ) {
+        return replyUnavailable( conn );
+    }
+
+    if ( err == Error::CrossSlot ) {
+        static const char msg[] = "-CROSSSLOT Keys in request don't hash to the same slot\r\n";
+        return writeLocal( conn, Buffer(msg, sizeof(msg) - 1) );
+    }
+
+    if ( err == Error::KeysUnseen ) {
+        static const char msg[] = "-ERR keys after a value of StreamBulkSize or more are not supported by the proxy\r\n";
+        return writeLocal( conn, Buffer(msg, sizeof(msg) - 1) );
+    }
+
+    if ( err.None() ) {
+        slots_.push_back( ReplySlot() );
+        inflight_++;
+    }
+    return err;
+}
+
+Error Session::OnClientClosed( Connection* conn ) {
+    assert( conn == clientConn_ );
+
+    // before clientConn_ is gone, a request it streamed is failed right away
+    upstreamPool_->Forget( this );
+    clientConn_ = nullptr;
+
+    Upstream* throttled = throttled_;
+    throttled_ = nullptr;
+
+    if ( inflight_ == 0 ) {
+        sessionPool_->RemoveSession( this );
+    }
+
+    // the rest of the reply is dropped, the session may go with it
+    if ( throttled != nullptr ) {
+        throttled->ResumeRead();
+    }
+
+    return Error::OK;
+}
+
 Error Session::OnClientRead( Connection* conn, Buffer* buffer ) {
     assert( conn == clientConn_ );
 
-    if ( !currentCmd_.Empty() ) {
-        Error err = upstreamPool_->PushRequest( currentCmd_, this );
+    if ( closing_ ) {
+        return Error::OK;
+    }
+
+    if ( pushPending_ ) {
+        Error err = dispatch( conn );
         if ( !err.None() ) {
             if ( err == Error::TryAgain ) {
                 // setup an metric here
+                pushPending_ = true;
                 conn->SetReadable( false );
                 return Error::OK;
             }
@@ -29,10 +393,42 @@ Error Session::OnClientRead( Connection* conn, Buffer* buffer ) {
             return err;
         }
 
-        currentCmd_.Reset();
+        pushPending_ = false;
+        if ( closing_ ) {
+            conn->SetReadable( false );
+            return Error::OK;
+        }
+
+        if ( currentCmd_.Streaming() ) {
+            streaming_ = true;
+        } else {
+            parser_.Reset();
+            currentCmd_.Reset();
+        }
     }
 
-    while( !buffer->Empty() ) {
+    while( streaming_ || !buffer->Empty() ) {
+        if ( streaming_ ) {
+            Error err = forwardStream();
+            if ( !err.None() ) {
+                if ( err == Error::TryAgain ) {
+                    conn->SetReadable( false );
+                    return Error::OK;
+                }
+
+                // the upstream link goes with the client, see OnClientClosed()
+                std::string s = err.String();
+                conn->WriteToBuffer( Buffer( s.c_str(), s.size() ), NET_FLAG_CLOSE );
+                return err;
+            }
+
+            // the rest has not come yet
+            if ( streaming_ ) {
+                break;
+            }
+            continue;
+        }
+
         Error err = parser_.ParseRequest( &currentCmd_ );
         if ( !err.None() ) {
             if ( err == Error::TryAgain ) {
@@ -49,11 +445,18 @@ Error Session::OnClientRead( Connection* conn, Buffer* buffer ) {
             return err;
         }
 
-        err = upstreamPool_->PushRequest( currentCmd_, this );
+        // "*0" or "*-1", the server would not reply to it either
+        if ( currentCmd_.Empty() ) {
+            parser_.Reset();
+            currentCmd_.Reset();
+            continue;
+        }
+
+        err = dispatch( conn );
         if ( !err.None() ) {
-            printf("PushRequest failed:%s\n", err.String().c_str());
             if ( err == Error::TryAgain ) {
                 // setup an metric here
+                pushPending_ = true;
                 conn->SetReadable( false );
                 return Error::OK;
             }
@@ -61,6 +464,17 @@ Error Session::OnClientRead( Connection* conn, Buffer* buffer ) {
             return err;
         }
 
+        // nothing after QUIT is taken
+        if ( closing_ ) {
+            conn->SetReadable( false );
+            return Error::OK;
+        }
+
+        if ( currentCmd_.Streaming() ) {
+            streaming_ = true;
+            continue;
+        }
+
         /**
         const Buffer* buffer = currentCmd_.GetCmd();
         if ( buffer == nullptr ) {
@@ -75,9 +489,14 @@ Error Session::OnClientRead( Connection* conn, Buffer* buffer ) {
         currentCmd_.Reset();
     }
 
+    /**
+     * while streaming, what was read is out as slices and the buffer moves
+     * to new memory, read in larger pieces then.
+     **/
+    std::size_t minSize = streaming_ ? clientOpt_.ReadBufferInitSize : clientOpt_.ReadBufferMinSize;
     std::size_t freeSize = buffer->FreeSize();
-    if ( freeSize < clientOpt_.ReadBufferMinSize ) {
-        Error err = buffer->AppendCapacity( clientOpt_.ReadBufferMinSize );
+    if ( freeSize < minSize ) {
+        Error err = buffer->AppendCapacity( minSize );
         if ( !err.None() ) {
             return err;
         }
@@ -90,6 +509,7 @@ Error Session::OnNewClientConnection( Connection* conn ) {
     clientConn_ = conn;
 
     Buffer* buffer = parser_.GetInputBuffer();
+    parser_.SetStreamThreshold( clientOpt_.StreamBulkSize );
     Error err = buffer->AppendCapacity( clientOpt_.ReadBufferInitSize );
     if ( !err.None() ) {
         return err;
@@ -98,6 +518,16 @@ Error Session::OnNewClientConnection( Connection* conn ) {
     {
         using namespace std::placeholders;
         err = conn->OnReadEvent( std::bind( &Session::OnClientRead, this, _1, _2 ), buffer );
+        if ( !err.None() ) {
+            return err;
+        }
+
+        err = conn->OnClosedEvent( std::bind( &Session::OnClientClosed, this, _1 ) );
+        if ( !err.None() ) {
+            return err;
+        }
+
+        err = conn->OnWriteEvent( std::bind( &Session::OnClientWritable, this, _1 ) );
     }
 
     return err;
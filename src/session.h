@@ -2,6 +2,8 @@
 #ifndef __RP_SESSION_H__
 #define __RP_SESSION_H__
 
+#include <deque>
+#include <string>
 #include <vector>
 
 #include "connections.h"
@@ -13,14 +15,19 @@ namespace rp {
 
 #define NULLID 0
 
+#define RP_VERSION "0.1.0"
+
 /**
  * Session
  **/
+class SessionPool;
+
 class Session : public UpstreamReader {
 public:
     Session( const ConnectionOptions& opt ) :
         clientOpt_(opt), id_(NULLID), clientConn_(nullptr), 
-        connectionPool_(nullptr), upstreamPool_(nullptr) {}
+        connectionPool_(nullptr), upstreamPool_(nullptr), sessionPool_(nullptr), inflight_(0), link_(0), slotBase_(0), pushPending_(false), closing_(false), streaming_(false), streamLast_(false),
+        replyStreamed_(false), streamedTag_(0), throttled_(nullptr), protocol_(2) {}
 
     virtual ~Session() {}
 
@@ -28,16 +35,35 @@ public:
     void SetId( uint64_t id ) { id_ = id; }
     uint64_t GetId() const { return id_; }
     virtual uint64_t Identity() const { return GetId(); }
+    virtual int Protocol() const { return protocol_; }
 
 public:
     void SetConnectionPool( ConnectionPool* pool ) { connectionPool_ = pool; }
     void SetUpstreamPool( UpstreamPool* pool ) { upstreamPool_ = pool; }
+    void SetSessionPool( SessionPool* pool ) { sessionPool_ = pool; }
 
 public:
     Error OnNewClientConnection( Connection* conn );
     Error OnClientRead( Connection* conn, Buffer* buffer );
+    Error OnClientClosed( Connection* conn );
+
+    virtual void OnServerWrite( const Buffer& buffer, uint64_t tag );
+    virtual void OnUpstreamReady();
+    virtual bool Streamable( uint64_t tag ) const;
+    virtual Error OnServerStream( Upstream* upstream, const Buffer& part );
+    virtual int Link() const { return inflight_ > 0 ? link_ : -1; }
+    virtual void SetLink( int link ) { link_ = link; }
+
+private:
+    Error OnClientWritable( Connection* conn );
 
-    virtual void OnServerWrite( const Buffer& buffer );
+    Error dispatch( Connection* conn );
+    Error replyLocal( Connection* conn );
+    Error writeLocal( Connection* conn, const Buffer& reply, int flags = 0 );
+    void flushSlots();
+    Error forwardStream();
+    Error replyUnavailable( Connection* conn );
+    Error replyHello( Connection* conn );
 
 private:
     const ConnectionOptions&    clientOpt_;
@@ -47,6 +73,71 @@ private:
     Connection* clientConn_;
     ConnectionPool* connectionPool_;
     UpstreamPool*   upstreamPool_;
+    SessionPool*    sessionPool_;
+
+    /**
+     * requests pushed to upstreams and not replied yet,
+     * the session outlives its client until they all come back.
+     **/
+    uint32_t    inflight_;
+    /**
+     * the link of a backend they took, see Backend::Pick()
+     **/
+    int     link_;
+
+    /**
+     * a slot for every request in flight and every reply made here behind
+     * one, in the order of the requests. the tag of a request is its place
+     * counted from slotBase_, the tag of the front slot. the replies go out
+     * from the front as they are ready, whichever upstream they come from.
+     **/
+    struct ReplySlot {
+        bool    ready;
+        Buffer  reply;
+        int     flags;
+
+        ReplySlot() : ready(false), flags(0) {}
+        ReplySlot( const Buffer& r, int f ) : ready(true), reply(r), flags(f) {}
+    };
+    std::deque<ReplySlot>   slots_;
+    uint64_t    slotBase_;
+
+    /**
+     * currentCmd_ is complete and waits for room in the upstream queue,
+     * otherwise it might be half parsed.
+     **/
+    bool    pushPending_;
+
+    /**
+     * QUIT has come, nothing after it is read
+     **/
+    bool    closing_;
+
+    /**
+     * the head of currentCmd_ went upstream and the rest follows as it
+     * comes. streamChunk_ is read already and waits for the upstream to
+     * take it, streamLast_ if it completes the request.
+     **/
+    bool    streaming_;
+    bool    streamLast_;
+    Buffer  streamChunk_;
+
+    /**
+     * the reply of streamedTag_ is coming out in parts, throttled_ stopped
+     * reading it while the client has StreamPendingSize or more to take.
+     * the replies of other upstreams may come back meanwhile.
+     **/
+    bool        replyStreamed_;
+    uint64_t    streamedTag_;
+    Upstream*   throttled_;
+
+    /**
+     * RESP version of the client, switched by HELLO
+     **/
+    int protocol_;
+
+    // CLIENT SETNAME
+    std::string name_;
 
     /**
      * 
@@ -72,6 +163,7 @@ public:
 
         sess->SetId( ++idCounter_ );
         sess->SetUpstreamPool( upstreamPool_ );
+        sess->SetSessionPool( this );
         sess->SetConnectionPool( conn->GetConnectionPool() );
         conn->SetSession( sess );
 
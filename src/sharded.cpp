@@ -0,0 +1,403 @@
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <algorithm>
+#include <functional>
+
+#include "sharded.h"
+#include "resolver.h"
+#include "keys.h"
+#include "fanout.h"
+
+namespace rp {
+
+static const uint32_t md5K[64] = {
+    0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee,
+    0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+    0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be,
+    0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+    0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa,
+    0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+    0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed,
+    0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+    0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c,
+    0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+    0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05,
+    0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+    0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039,
+    0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+    0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1,
+    0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391,
+};
+
+static const uint8_t md5R[64] = {
+    7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22,
+    5, 9, 14, 20, 5, 9, 14, 20, 5, 9, 14, 20, 5, 9, 14, 20,
+    4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23,
+    6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21,
+};
+
+/**
+ * md5
+ * RFC 1321, for the points of the continuum only
+ **/
+static void md5( const char* data, std::size_t size, uint8_t digest[16] ) {
+    uint32_t h[4] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476 };
+
+    // 0x80, zeros up to 56 mod 64, then the size in bits
+    std::size_t total = (size + 8) / 64 * 64 + 64;
+    std::vector<uint8_t> msg( total, 0 );
+    memcpy( &msg[0], data, size );
+    msg[size] = 0x80;
+    uint64_t bits = (uint64_t)size * 8;
+    for ( int i = 0; i < 8; ++i ) {
+        msg[total - 8 + i] = (uint8_t)(bits >> (8 * i));
+    }
+
+    for ( std::size_t chunk = 0; chunk < total; chunk += 64 ) {
+        uint32_t w[16];
+        for ( int i = 0; i < 16; ++i ) {
+            const uint8_t* p = &msg[chunk + i * 4];
+            w[i] = p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+        }
+
+        uint32_t a = h[0], b = h[1], c = h[2], d = h[3];
+        for ( int i = 0; i < 64; ++i ) {
+            uint32_t f;
+            int g;
+            if ( i < 16 ) {
+                f = (b & c) | (~b & d);
+                g = i;
+            } else if ( i < 32 ) {
+                f = (d & b) | (~d & c);
+                g = (5 * i + 1) % 16;
+            } else if ( i < 48 ) {
+                f = b ^ c ^ d;
+                g = (3 * i + 5) % 16;
+            } else {
+                f = c ^ (b | ~d);
+                g = (7 * i) % 16;
+            }
+
+            uint32_t t = a + f + md5K[i] + w[g];
+            a = d;
+            d = c;
+            c = b;
+            b = b + ((t << md5R[i]) | (t >> (32 - md5R[i])));
+        }
+
+        h[0] += a;
+        h[1] += b;
+        h[2] += c;
+        h[3] += d;
+    }
+
+    for ( int i = 0; i < 16; ++i ) {
+        digest[i] = (uint8_t)(h[i / 4] >> (8 * (i % 4)));
+    }
+}
+
+/**
+ * keyHash
+ * FNV-1a 64 of every key on the way, its last bytes barely reach the high
+ * bits, so keys like "k1" and "k2" would land side by side on the ring. the
+ * finalizer of murmur3 spreads them before the halves are folded.
+ **/
+static uint32_t keyHash( const char* key, std::size_t size ) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for ( std::size_t i = 0; i < size; ++i ) {
+        hash ^= (uint8_t)key[i];
+        hash *= 0x100000001b3ULL;
+    }
+
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ULL;
+    hash ^= hash >> 33;
+    return (uint32_t)(hash ^ (hash >> 32));
+}
+
+/**
+ * Build
+ * the points are laid out as libketama does, but a server has as many for
+ * each unit of its weight whatever the others weigh. libketama shares them
+ * out by the total weight, so a new server takes points from the others too.
+ **/
+void Continuum::Build( const std::vector<std::string>& names, const std::vector<int>& weights ) {
+    std::vector<std::pair<uint32_t, uint32_t> > points;
+
+    for ( std::size_t i = 0; i < names.size(); ++i ) {
+        uint32_t count = weights[i] > 0 ? (uint32_t)weights[i] * (KETAMA_POINTS_PER_SERVER / 4) : 0;
+
+        for ( uint32_t n = 0; n < count; ++n ) {
+            char name[512];
+            int size = snprintf( name, sizeof(name), "%s-%u", names[i].c_str(), n );
+            if ( size >= (int)sizeof(name) ) {
+                size = sizeof(name) - 1;
+            }
+
+            uint8_t digest[16];
+            md5( name, size, digest );
+            for ( int x = 0; x < 4; ++x ) {
+                const uint8_t* p = digest + x * 4;
+                uint32_t point = ((uint32_t)p[3] << 24) | (p[2] << 16) | (p[1] << 8) | p[0];
+                points.push_back( std::make_pair( point, (uint32_t)i ) );
+            }
+        }
+    }
+
+    // ties go to the server listed first
+    std::sort( points.begin(), points.end() );
+
+    points_.resize( points.size() );
+    owners_.resize( points.size() );
+    for ( std::size_t i = 0; i < points.size(); ++i ) {
+        points_[i] = points[i].first;
+        owners_[i] = points[i].second;
+    }
+}
+
+std::size_t Continuum::Locate( const char* key, std::size_t size ) const {
+    Slice tag = HashTag( key, size );
+    uint32_t hash = keyHash( tag.Data(), tag.Size() );
+
+    // the first point at or after the hash, the ring wraps past the last
+    std::size_t left = 0, right = points_.size();
+    while ( left < right ) {
+        std::size_t middle = left + (right - left) / 2;
+        if ( points_[middle] < hash ) {
+            left = middle + 1;
+        } else {
+            right = middle;
+        }
+    }
+
+    if ( right == points_.size() ) {
+        right = 0;
+    }
+    return owners_[right];
+}
+
+Sharded::~Sharded() {
+    for ( std::size_t i = 0; i < servers_.size(); ++i ) {
+        delete servers_[i];
+    }
+}
+
+static bool isNumber( const std::string& s ) {
+    return !s.empty() && s.find_first_not_of( "0123456789" ) == std::string::npos;
+}
+
+/**
+ * Init
+ * a server is "host:port" or "host:port:weight", "unix:/path:0" for a
+ * unix domain socket. its points are named by "host:port", so a new
+ * weight does not move the points it keeps.
+ **/
+Error Sharded::Init() {
+    const std::string& list = opt_.ShardedOpt->Servers;
+    std::vector<std::string> names;
+    std::vector<int> weights;
+
+    std::size_t begin = 0;
+    while ( begin < list.size() ) {
+        std::size_t end = list.find( ',', begin );
+        if ( end == std::string::npos ) {
+            end = list.size();
+        }
+
+        std::size_t from = list.find_first_not_of( ' ', begin );
+        std::string server = from < end ? list.substr( from, end - from ) : std::string();
+        begin = end + 1;
+
+        int weight = 1;
+        std::size_t colon = server.rfind( ':' );
+        if ( colon != std::string::npos && colon > 0 ) {
+            std::size_t prev = server.rfind( ':', colon - 1 );
+            if ( prev != std::string::npos && isNumber( server.substr( colon + 1 ) ) &&
+                isNumber( server.substr( prev + 1, colon - prev - 1 ) ) ) {
+                weight = atoi( server.c_str() + colon + 1 );
+                server.erase( colon );
+                colon = prev;
+            }
+        }
+
+        if ( colon == std::string::npos || colon == 0 || !isNumber( server.substr( colon + 1 ) ) ) {
+            LogErrorf( "bad sharded server:%s", server.c_str() );
+            return Error::InitFailed;
+        }
+
+        std::string host = server.substr( 0, colon );
+        io::Addr addr( host.c_str(), atoi( server.c_str() + colon + 1 ) );
+
+        // before the loop runs, the reconnects find it in the cache then
+        io::Resolver* resolver = pool_->Context()->resolver;
+        if ( resolver != nullptr ) {
+            Error err = resolver->Prefetch( addr );
+            if ( !err.None() ) {
+                return err;
+            }
+        }
+
+        Backend* backend = new Backend();
+        servers_.push_back( backend );
+        Error err = backend->Init( opt_, pool_, addr, opt_.ShardedOpt->Password, opt_.ShardedOpt->Protocol );
+        if ( !err.None() ) {
+            return err;
+        }
+
+        names.push_back( server );
+        weights.push_back( weight );
+    }
+
+    continuum_.Build( names, weights );
+    if ( continuum_.Empty() ) {
+        LogErrorf( "no sharded server with a weight" );
+        return Error::InitFailed;
+    }
+
+    LogInfof( "%zu sharded servers", servers_.size() );
+    return Error::OK;
+}
+
+int Sharded::serverOf( const void* ctx, const char* key, std::size_t size ) {
+    return (int)((const Sharded *)ctx)->continuum_.Locate( key, size );
+}
+
+/**
+ * backendOf
+ * the server of index, any which is up for KEYS_NONE
+ **/
+Backend* Sharded::backendOf( int server ) {
+    if ( server >= 0 ) {
+        return servers_[server];
+    }
+
+    for ( std::size_t i = 0; i < servers_.size(); ++i ) {
+        if ( servers_[i]->IsAcceptable() ) {
+            return servers_[i];
+        }
+    }
+    return nullptr;
+}
+
+Error Sharded::PushRequest( const Cmd& cmd, UpstreamReader* reader, uint64_t tag ) {
+    int server = KeysBucket( cmd, serverOf, this );
+    if ( server == KEYS_UNSEEN ) {
+        return Error::KeysUnseen;
+    }
+    if ( server == KEYS_CROSS ) {
+        // one part for each server, with all of its keys
+        using namespace std::placeholders;
+        return FanOut::Push( cmd, serverOf, this, std::bind( &Sharded::backendOf, this, _1 ), reader, tag );
+    }
+
+    // fail fast while the server is down
+    Backend* backend = backendOf( server );
+    if ( backend == nullptr || !backend->IsAcceptable() ) {
+        return Error::Closed;
+    }
+
+    return backend->PushRequest( cmd, reader, tag );
+}
+
+Error Sharded::PushStream( const Buffer& chunk, bool last, UpstreamReader* reader ) {
+    for ( std::size_t i = 0; i < servers_.size(); ++i ) {
+        Error err = servers_[i]->PushStream( chunk, last, reader );
+        if ( err != Error::Closed ) {
+            return err;
+        }
+    }
+
+    return Error::Closed;
+}
+
+void Sharded::Forget( UpstreamReader* reader ) {
+    for ( std::size_t i = 0; i < servers_.size(); ++i ) {
+        servers_[i]->Forget( reader );
+    }
+}
+
+}
+
+#ifdef RP_SHARDED_TEST
+#include <math.h>
+#include "metric.h"
+
+int main() {
+    int failed = 0;
+
+    const char* vectors[][2] = {
+        { "", "d41d8cd98f00b204e9800998ecf8427e" },
+        { "abc", "900150983cd24fb0d6963f7d28e17f72" },
+        { "12345678901234567890123456789012345678901234567890123456789012345678901234567890",
+            "57edf4a22be3c955ac49da2e2107b67a" },
+    };
+    for ( std::size_t i = 0; i < sizeof(vectors) / sizeof(vectors[0]); ++i ) {
+        uint8_t digest[16];
+        char hex[33];
+        rp::md5( vectors[i][0], strlen(vectors[i][0]), digest );
+        for ( int j = 0; j < 16; ++j ) {
+            snprintf( hex + j * 2, 3, "%02x", digest[j] );
+        }
+        bool ok = strcmp( hex, vectors[i][1] ) == 0;
+        printf( "md5(\"%.8s\") %s%s%s\n", vectors[i][0], ok ? "ok" : hex, ok ? "" : " expected ", ok ? "" : vectors[i][1] );
+        failed += !ok;
+    }
+
+    std::vector<std::string> names;
+    std::vector<int> weights;
+    for ( int i = 0; i < 5; ++i ) {
+        char name[32];
+        snprintf( name, sizeof(name), "10.0.0.%d:6379", i + 1 );
+        names.push_back( name );
+        weights.push_back( i == 4 ? 2 : 1 );
+    }
+
+    rp::Continuum four, five;
+    four.Build( std::vector<std::string>( names.begin(), names.begin() + 4 ), std::vector<int>( 4, 1 ) );
+    five.Build( names, weights );
+
+    const int keys = 1000000;
+    int moved = 0, wrong = 0;
+    int share[5] = { 0 };
+    for ( int i = 0; i < keys; ++i ) {
+        char key[32];
+        int size = snprintf( key, sizeof(key), "key:%d", i );
+        std::size_t a = four.Locate( key, size ), b = five.Locate( key, size );
+        share[b]++;
+        if ( a != b ) {
+            moved++;
+            // only to the new server
+            wrong += b != 4;
+        }
+    }
+
+    // the new server takes 2 of the 6 weights, from the old ones alone
+    double movedShare = (double)moved / keys;
+    bool ok = fabs( movedShare - 2.0 / 6 ) < 0.05 && wrong == 0;
+    printf( "moved %.3f (expected about %.3f), to old servers %d %s\n", movedShare, 2.0 / 6, wrong, ok ? "ok" : "failed" );
+    failed += !ok;
+
+    for ( int i = 0; i < 5; ++i ) {
+        double got = (double)share[i] / keys;
+        ok = fabs( got - weights[i] / 6.0 ) < 0.04;
+        printf( "%s weight %d share %.3f %s\n", names[i].c_str(), weights[i], got, ok ? "ok" : "failed" );
+        failed += !ok;
+    }
+
+    int64_t start = rp::ustime();
+    std::size_t sum = 0;
+    for ( int i = 0; i < keys; ++i ) {
+        char key[32];
+        int size = snprintf( key, sizeof(key), "key:%d", i );
+        sum += five.Locate( key, size );
+    }
+    printf( "locate %.1fns (with snprintf) %zu\n", (rp::ustime() - start) * 1000.0 / keys, sum );
+
+    printf( "%d failed\n", failed );
+    return failed == 0 ? 0 : 1;
+}
+#endif
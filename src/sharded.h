@@ -0,0 +1,76 @@
+#ifndef __RP_SHARDED_H__
+#define __RP_SHARDED_H__
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "upstream.h"
+
+namespace rp {
+
+/**
+ * points of a server on the continuum for each unit of its weight,
+ * four are taken from each MD5 of "<name>-<n>".
+ **/
+#define KETAMA_POINTS_PER_SERVER    160
+
+/**
+ * Continuum
+ * the ketama ring of 2^32. each server has points on it in proportion to
+ * its weight, and a key goes to the server of the first point at or after
+ * its hash. adding a server only takes the keys before its points, about
+ * 1/N of them. the points are sorted once, a lookup is a binary search.
+ **/
+class Continuum {
+public:
+    void Build( const std::vector<std::string>& names, const std::vector<int>& weights );
+    bool Empty() const { return points_.empty(); }
+
+    /**
+     * the index of the server of key, a "{tag}" in it places it by the tag.
+     * the continuum must not be empty.
+     **/
+    std::size_t Locate( const char* key, std::size_t size ) const;
+
+private:
+    std::vector<uint32_t>   points_;
+    // the server of each point
+    std::vector<uint32_t>   owners_;
+};
+
+/**
+ * Sharded
+ * standalone servers sharing the keys out by a Continuum. a cmd goes to
+ * the server of its keys, the keyless ones to any server which is up. the
+ * multi-key ones with keys on several servers are split, see FanOut.
+ **/
+class Sharded {
+public:
+    Sharded( const ProxyOptions& opt, ConnectionPool* pool ) :
+        opt_(opt), pool_(pool) {}
+    ~Sharded();
+
+public:
+    Error Init();
+
+public:
+    Error PushRequest( const Cmd& cmd, UpstreamReader* reader, uint64_t tag );
+    Error PushStream( const Buffer& chunk, bool last, UpstreamReader* reader );
+    void Forget( UpstreamReader* reader );
+
+private:
+    Backend* backendOf( int server );
+    static int serverOf( const void* ctx, const char* key, std::size_t size );
+
+private:
+    const ProxyOptions& opt_;
+    ConnectionPool* pool_;
+
+    std::vector<Backend*>   servers_;
+    Continuum   continuum_;
+};
+
+}
+
+#endif
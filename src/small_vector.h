@@ -0,0 +1,109 @@
+#ifndef __RP_SMALL_VECTOR_H__
+#define __RP_SMALL_VECTOR_H__
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "error.h"
+
+namespace rp {
+
+/**
+ * SmallVector<T, N>
+ * a vector of plain types holding the first N in place,
+ * it goes to the heap only past them. copied with memcpy.
+ **/
+template <typename T, std::size_t N>
+class SmallVector {
+public:
+    SmallVector() : data_(inline_), size_(0), capacity_(N) {}
+    SmallVector( const SmallVector& other ) : data_(inline_), size_(0), capacity_(N) {
+        *this = other;
+    }
+
+    ~SmallVector() { Release(); }
+
+public:
+    SmallVector& operator= ( const SmallVector& other ) {
+        if ( this == &other ) {
+            return *this;
+        }
+
+        size_ = 0;
+        if ( Reserve( other.size_ ).None() ) {
+            memcpy( data_, other.data_, other.size_ * sizeof(T) );
+            size_ = other.size_;
+        }
+        return *this;
+    }
+
+    T& operator[] ( std::size_t index ) { return data_[index]; }
+    const T& operator[] ( std::size_t index ) const { return data_[index]; }
+
+public:
+    bool Empty() const { return size_ == 0; }
+    std::size_t Size() const { return size_; }
+    std::size_t Capacity() const { return capacity_; }
+
+public:
+    Error Reserve( std::size_t capacity ) {
+        if ( capacity <= capacity_ ) {
+            return Error::OK;
+        }
+
+        T* data = nullptr;
+        if ( data_ == inline_ ) {
+            data = (T *)malloc( capacity * sizeof(T) );
+            if ( data != nullptr ) {
+                memcpy( data, inline_, size_ * sizeof(T) );
+            }
+        } else {
+            data = (T *)realloc( data_, capacity * sizeof(T) );
+        }
+
+        if ( data == nullptr ) {
+            return Error::Exhausted;
+        }
+
+        data_ = data;
+        capacity_ = capacity;
+        return Error::OK;
+    }
+
+    Error PushBack( const T& value ) {
+        if ( size_ == capacity_ ) {
+            Error err = Reserve( capacity_ * 2 );
+            if ( !err.None() ) {
+                return err;
+            }
+        }
+
+        data_[size_++] = value;
+        return Error::OK;
+    }
+
+    /**
+     * Clear keeps the memory, Release gives back what is on the heap
+     **/
+    void Clear() { size_ = 0; }
+    void Release() {
+        if ( data_ != inline_ ) {
+            free( data_ );
+        }
+
+        data_ = inline_;
+        size_ = 0;
+        capacity_ = N;
+    }
+
+private:
+    T*  data_;
+    std::size_t size_;
+    std::size_t capacity_;
+
+    T   inline_[N];
+};
+
+}
+
+#endif
@@ -0,0 +1,374 @@
+
+#include <string.h>
+#include <stdlib.h>
+#include <functional>
+
+#include "sourcemgr.h"
+#include "resolver.h"
+
+namespace rp {
+
+/**
+ * RespCursor
+ * walks the elements of a framed RESP2 reply, those of the internal
+ * cmds are converted from RESP3 by the upstream already.
+ **/
+class RespCursor {
+public:
+    explicit RespCursor( const Buffer& reply ) : p_(reply.Data()), end_(reply.Data() + reply.Size()) {}
+
+public:
+    Error Integer( long long* n ) { return number( ':', n ); }
+    Error Array( long long* n ) { return number( '*', n ); }
+
+    Error String( const char** data, std::size_t* size ) {
+        if ( p_ < end_ && *p_ == '+' ) {
+            return line( '+', data, size );
+        }
+
+        long long n = 0;
+        Error err = number( '$', &n );
+        if ( !err.None() ) {
+            return err;
+        }
+        if ( n < 0 || end_ - p_ < n + 2 ) {
+            return Error::Protocol;
+        }
+
+        *data = p_;
+        *size = n;
+        p_ += n + 2;
+        return Error::OK;
+    }
+
+    Error Skip() {
+        if ( p_ >= end_ ) {
+            return Error::Protocol;
+        }
+
+        const char* data = nullptr;
+        std::size_t size = 0;
+        long long n = 0;
+        switch ( *p_ ) {
+        case '+': case '-': case ':':
+            return line( *p_, &data, &size );
+        case '$':
+            if ( end_ - p_ > 2 && p_[1] == '-' ) {
+                return number( '$', &n );
+            }
+            return String( &data, &size );
+        case '*': {
+            Error err = Array( &n );
+            for ( long long i = 0; i < n && err.None(); ++i ) {
+                err = Skip();
+            }
+            return err;
+        }
+        default:
+            return Error::Protocol;
+        }
+    }
+
+private:
+    Error line( char type, const char** data, std::size_t* size ) {
+        if ( p_ >= end_ || *p_ != type ) {
+            return Error::Protocol;
+        }
+
+        const char* cr = (const char *)memchr( p_, '\r', end_ - p_ );
+        if ( cr == nullptr || cr + 1 >= end_ ) {
+            return Error::Protocol;
+        }
+
+        *data = p_ + 1;
+        *size = cr - p_ - 1;
+        p_ = cr + 2;
+        return Error::OK;
+    }
+
+    Error number( char type, long long* n ) {
+        const char* data = nullptr;
+        std::size_t size = 0;
+        Error err = line( type, &data, &size );
+        if ( !err.None() ) {
+            return err;
+        }
+
+        // the line ends at "\r", which stops strtoll
+        char* end = nullptr;
+        *n = strtoll( data, &end, 10 );
+        if ( size == 0 || end != data + size ) {
+            return Error::Protocol;
+        }
+        return Error::OK;
+    }
+
+private:
+    const char* p_;
+    const char* end_;
+};
+
+/**
+ * ParseClusterSlots
+ * every entry is "start end master replica...", a node being
+ * "host port id" with more in the newer versions.
+ **/
+Error ParseClusterSlots( const Buffer& reply, std::vector<SlotRange>* ranges ) {
+    RespCursor cursor( reply );
+    long long count = 0;
+    Error err = cursor.Array( &count );
+    if ( !err.None() ) {
+        return err;
+    }
+
+    ranges->clear();
+    for ( long long i = 0; i < count; ++i ) {
+        long long fields = 0, first = 0, last = 0, nodeFields = 0, port = 0;
+        const char* host = nullptr;
+        std::size_t hostSize = 0;
+
+        err = cursor.Array( &fields );
+        if ( err.None() && fields < 3 ) {
+            err = Error::Protocol;
+        }
+        if ( err.None() ) { err = cursor.Integer( &first ); }
+        if ( err.None() ) { err = cursor.Integer( &last ); }
+        if ( err.None() ) { err = cursor.Array( &nodeFields ); }
+        if ( err.None() && nodeFields < 2 ) {
+            err = Error::Protocol;
+        }
+        if ( err.None() ) { err = cursor.String( &host, &hostSize ); }
+        if ( err.None() ) { err = cursor.Integer( &port ); }
+        for ( long long j = 2; j < nodeFields && err.None(); ++j ) {
+            err = cursor.Skip();
+        }
+        // the replicas
+        for ( long long j = 3; j < fields && err.None(); ++j ) {
+            err = cursor.Skip();
+        }
+        if ( !err.None() ) {
+            return err;
+        }
+
+        if ( first < 0 || first > last || last >= CLUSTER_SLOTS ) {
+            return Error::Protocol;
+        }
+
+        SlotRange range;
+        range.first = first;
+        range.last = last;
+        range.port = port;
+        // "?" is what a node not knowing its own address tells
+        if ( !(hostSize == 1 && host[0] == '?') ) {
+            range.host.assign( host, hostSize );
+        }
+        ranges->push_back( range );
+    }
+
+    return Error::OK;
+}
+
+SourceManager::~SourceManager() {
+    for ( std::size_t i = 0; i < nodes_.size(); ++i ) {
+        delete nodes_[i].backend;
+    }
+
+    delete slotsCmd_;
+}
+
+Error SourceManager::Init( const std::string& sources, const std::string& password, int protocol,
+    SlotsHandlerType slotsHandler, Upstream::RedirectHandlerType redirectHandler ) {
+    password_ = password;
+    protocol_ = protocol;
+    slotsHandler_ = slotsHandler;
+    redirectHandler_ = redirectHandler;
+    timer_.SetCallback( std::bind( &SourceManager::ask, this ) );
+
+    std::size_t begin = 0;
+    while ( begin < sources.size() ) {
+        std::size_t end = sources.find( ',', begin );
+        if ( end == std::string::npos ) {
+            end = sources.size();
+        }
+
+        std::string source = sources.substr( begin, end - begin );
+        begin = end + 1;
+
+        std::size_t from = source.find_first_not_of( ' ' );
+        std::size_t colon = source.rfind( ':' );
+        if ( from == std::string::npos || colon == std::string::npos || colon <= from ) {
+            LogErrorf( "bad source:%s", source.c_str() );
+            return Error::InitFailed;
+        }
+
+        std::string host = source.substr( from, colon - from );
+        int port = atoi( source.c_str() + colon + 1 );
+
+        // before the loop runs, the reconnects find it in the cache then
+        Error err;
+        io::Resolver* resolver = pool_->Context()->resolver;
+        if ( resolver != nullptr ) {
+            err = resolver->Prefetch( io::Addr( host.c_str(), port ) );
+        }
+
+        std::size_t index = 0;
+        if ( err.None() ) {
+            err = AddNode( host, port, &index );
+        }
+        if ( !err.None() ) {
+            LogWarnf( "source %s:%d left out:%s", host.c_str(), port, err.String().c_str() );
+        }
+    }
+
+    if ( nodes_.empty() ) {
+        return Error::InitFailed;
+    }
+    return Error::OK;
+}
+
+Error SourceManager::AddNode( const std::string& host, int port, std::size_t* index ) {
+    for ( std::size_t i = 0; i < nodes_.size(); ++i ) {
+        if ( nodes_[i].port == port && nodes_[i].host == host ) {
+            *index = i;
+            return Error::OK;
+        }
+    }
+
+    Backend* backend = new Backend();
+    Error err = backend->Init( opt_, pool_, io::Addr( host.c_str(), port ), password_, protocol_ );
+    if ( !err.None() ) {
+        delete backend;
+        return err;
+    }
+
+    if ( redirectHandler_ ) {
+        backend->OnRedirect( redirectHandler_ );
+    }
+    if ( closedHandler_ ) {
+        backend->OnClosed( closedHandler_ );
+    }
+
+    Node node;
+    node.host = host;
+    node.port = port;
+    node.backend = backend;
+    nodes_.push_back( node );
+
+    *index = nodes_.size() - 1;
+    return Error::OK;
+}
+
+void SourceManager::OnClosed( Upstream::ClosedHandlerType handler ) {
+    closedHandler_ = handler;
+    for ( std::size_t i = 0; i < nodes_.size(); ++i ) {
+        nodes_[i].backend->OnClosed( handler );
+    }
+}
+
+void SourceManager::RefreshEvery( int period ) {
+    period_ = period;
+    periodTimer_.SetCallback( std::bind( &SourceManager::onPeriod, this ) );
+    if ( period_ > 0 ) {
+        pool_->Context()->timers.Start( &periodTimer_, period_ );
+    } else {
+        periodTimer_.Cancel();
+    }
+}
+
+void SourceManager::onPeriod() {
+    Refresh();
+    pool_->Context()->timers.Start( &periodTimer_, period_ );
+}
+
+void SourceManager::Refresh() {
+    // one is on the way or due already
+    if ( slotsCmd_ != nullptr || timer_.Pending() ) {
+        return;
+    }
+
+    TimerWheel& timers = pool_->Context()->timers;
+    int64_t due = lastAsked_ + opt_.ClusterOpt->RefreshInterval;
+    if ( lastAsked_ >= 0 && timers.Now() < due ) {
+        timers.Start( &timer_, due - timers.Now() );
+        return;
+    }
+
+    ask();
+}
+
+/**
+ * ask
+ * sends CLUSTER SLOTS to the next node which is up,
+ * tries again after ReconnectInterval when none is.
+ **/
+void SourceManager::ask() {
+    using namespace std::placeholders;
+
+    if ( slotsCmd_ != nullptr ) {
+        return;
+    }
+
+    lastAsked_ = pool_->Context()->timers.Now();
+    for ( std::size_t tries = 0; tries < nodes_.size(); ++tries, ++asked_ ) {
+        Backend* backend = nodes_[asked_ % nodes_.size()].backend;
+        if ( !backend->IsAcceptable() ) {
+            continue;
+        }
+
+        slotsCmd_ = new cmd::Internal( "cluster", "slots", std::bind( &SourceManager::onSlots, this, _1, _2 ) );
+        if ( backend->PushRequest( slotsCmd_->GetCmd(), slotsCmd_ ).None() ) {
+            return;
+        }
+
+        delete slotsCmd_;
+        slotsCmd_ = nullptr;
+    }
+
+    pool_->Context()->timers.Start( &timer_, opt_.UpstreamOpt->ReconnectInterval );
+}
+
+void SourceManager::onSlots( bool ok, const Buffer& reply ) {
+    if ( slotsCmd_ != nullptr ) {
+        delete slotsCmd_;
+        slotsCmd_ = nullptr;
+    }
+
+    // the handler may add nodes
+    Node asked = nodes_[asked_ % nodes_.size()];
+
+    std::vector<SlotRange> ranges;
+    Error err;
+    if ( !ok ) {
+        LogErrorf( "cluster slots refused by %s:%d:%.*s", asked.host.c_str(), asked.port, (int)reply.Size(), reply.Data() );
+        err = Error::Closed;
+    } else {
+        err = ParseClusterSlots( reply, &ranges );
+        if ( err.None() && ranges.empty() ) {
+            err = Error::NotFound;
+        }
+        if ( !err.None() ) {
+            LogErrorf( "bad cluster slots from %s:%d:%s", asked.host.c_str(), asked.port, err.String().c_str() );
+        }
+    }
+
+    if ( !err.None() ) {
+        asked_++;
+        pool_->Context()->timers.Start( &timer_, opt_.UpstreamOpt->ReconnectInterval );
+        return;
+    }
+
+    for ( std::size_t i = 0; i < ranges.size(); ++i ) {
+        if ( ranges[i].host.empty() ) {
+            ranges[i].host = asked.host;
+        }
+    }
+
+    LogInfof( "cluster slots loaded from %s:%d, %zu ranges", asked.host.c_str(), asked.port, ranges.size() );
+
+    // the slots of the nodes left out are asked for again
+    if ( !slotsHandler_( ranges ) ) {
+        pool_->Context()->timers.Start( &timer_, opt_.UpstreamOpt->ReconnectInterval );
+    }
+}
+
+}
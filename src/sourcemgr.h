@@ -1,22 +1,113 @@
-
 #ifndef __RP_SOURCEMGR_H__
 #define __RP_SOURCEMGR_H__
 
+#include <string>
+#include <vector>
+#include <functional>
+
 #include "connections.h"
+#include "upstream.h"
 
 namespace rp {
 
+#define CLUSTER_SLOTS   16384
+
+/**
+ * SlotRange
+ * an entry of CLUSTER SLOTS, the master only.
+ * an empty host stands for the node which was asked.
+ **/
+struct SlotRange {
+    int first;
+    int last;
+    std::string host;
+    int port;
+};
+
+Error ParseClusterSlots( const Buffer& reply, std::vector<SlotRange>* ranges );
+
 /**
  * Manage the source
- * Try to send "info" at first
- * If the source run in cluster mode send "cluster nodes" to get all running nodes
+ * the links to the nodes of a cluster, a backend each, and the slots
+ * they serve. CLUSTER SLOTS is sent to the nodes in turn until one answers.
+ * a refresh asked for while one is on the way, or sooner than
+ * RefreshInterval after the last, is put off and done once.
  **/
 class SourceManager {
 public:
-    Error Init( const std::vector<addr_type>& sources );
+    /**
+     * the ranges have the host of the node asked filled in,
+     * false has the slots asked for again.
+     **/
+    typedef std::function<bool (const std::vector<SlotRange>&)>   SlotsHandlerType;
+
+public:
+    SourceManager( const ProxyOptions& opt, ConnectionPool* pool ) :
+        opt_(opt), pool_(pool), protocol_(2), asked_(0), lastAsked_(-1), slotsCmd_(nullptr), period_(0) {}
+    ~SourceManager();
+
+public:
+    /**
+     * links the sources, "host:port" comma separated. the nodes are
+     * authed with password and take their redirections to redirectHandler.
+     **/
+    Error Init( const std::string& sources, const std::string& password, int protocol,
+        SlotsHandlerType slotsHandler, Upstream::RedirectHandlerType redirectHandler );
+
+public:
+    std::size_t Size() const { return nodes_.size(); }
+    Backend* Get( std::size_t index ) const { return nodes_[index].backend; }
+    const std::string& Host( std::size_t index ) const { return nodes_[index].host; }
+
+    /**
+     * the index of the node at host:port, linked to if it was not yet
+     **/
+    Error AddNode( const std::string& host, int port, std::size_t* index );
+    /**
+     * the links of every node, the ones added later too,
+     * tell handler when they are lost
+     **/
+    void OnClosed( Upstream::ClosedHandlerType handler );
+
+public:
+    void Refresh();
+    /**
+     * a Refresh() every period ms from now on, none for 0
+     **/
+    void RefreshEvery( int period );
 
 private:
-    ConnectionPool*             pool_;
+    void ask();
+    void onSlots( bool ok, const Buffer& reply );
+    void onPeriod();
+
+private:
+    const ProxyOptions& opt_;
+    ConnectionPool* pool_;
+
+    std::string password_;
+    int protocol_;
+    SlotsHandlerType slotsHandler_;
+    Upstream::RedirectHandlerType redirectHandler_;
+    Upstream::ClosedHandlerType closedHandler_;
+
+    struct Node {
+        std::string host;
+        int port;
+        Backend* backend;
+    };
+    std::vector<Node>   nodes_;
+
+    /**
+     * the nodes are asked in turn, the next one when the last failed
+     **/
+    std::size_t asked_;
+    int64_t lastAsked_;
+    cmd::Internal*  slotsCmd_;
+    Timer   timer_;
+
+    int period_;
+    Timer   periodTimer_;
 };
 
 }
@@ -0,0 +1,395 @@
+#include <time.h>
+#include <assert.h>
+
+#include "timer.h"
+
+namespace rp {
+
+const int64_t TimerWheel::MAX_TIMEOUT;
+
+static int64_t monotonicUs() {
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ((int64_t)ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void spliceList( TimerNode* from, TimerNode* to ) {
+    if ( !from->Linked() ) {
+        return;
+    }
+
+    to->next = from->next;
+    to->prev = from->prev;
+    to->next->prev = to;
+    to->prev->next = to;
+    from->prev = from->next = from;
+}
+
+static void appendNode( TimerNode* head, TimerNode* node ) {
+    node->prev = head->prev;
+    node->next = head;
+    head->prev->next = node;
+    head->prev = node;
+}
+
+/**
+ * TimerWheel
+ **/
+TimerWheel::TimerWheel() : nowUs_(monotonicUs()), size_(0) {
+    tick_ = Now();
+    for ( int i = 0; i < LEVELS; i++ ) {
+        for ( int j = 0; j < ROOT_SIZE / 64; j++ ) {
+            bits_[i][j] = 0;
+        }
+    }
+}
+
+int64_t TimerWheel::UpdateClock() {
+    nowUs_ = monotonicUs();
+    return nowUs_;
+}
+
+void TimerWheel::Start( Timer* timer, int64_t timeoutMs ) {
+    if ( timer->wheel_ != nullptr ) {
+        Cancel( timer );
+    }
+
+    if ( timeoutMs < 0 ) {
+        timeoutMs = 0;
+    } else if ( timeoutMs > MAX_TIMEOUT ) {
+        timeoutMs = MAX_TIMEOUT;
+    }
+
+    timer->expire_ = Now() + timeoutMs;
+    timer->wheel_ = this;
+    size_++;
+
+    add( timer );
+}
+
+void TimerWheel::Cancel( Timer* timer ) {
+    if ( timer->wheel_ != this ) {
+        return;
+    }
+
+    timer->Unlink();
+    TimerNode* head = timer->level_ == 0 ? &root_[timer->slot_] :
+        &levels_[timer->level_ - 1][timer->slot_];
+    if ( !head->Linked() ) {
+        clearBit( timer->level_, timer->slot_ );
+    }
+
+    timer->wheel_ = nullptr;
+    size_--;
+}
+
+void TimerWheel::add( Timer* timer ) {
+    int64_t expire = timer->expire_;
+    int64_t delta = expire - tick_;
+    TimerNode* head;
+
+    if ( delta < ROOT_SIZE ) {
+        // overdue ones go to the next slot to be processed
+        if ( delta < 0 ) {
+            expire = tick_;
+        }
+        timer->level_ = 0;
+        timer->slot_ = expire & ROOT_MASK;
+        head = &root_[timer->slot_];
+    } else {
+        if ( delta > MAX_TIMEOUT ) {
+            expire = tick_ + MAX_TIMEOUT;
+            delta = MAX_TIMEOUT;
+        }
+
+        int level = 1;
+        while ( level < LEVELS - 1 && delta >= (1LL << (ROOT_BITS + level * LEVEL_BITS)) ) {
+            level++;
+        }
+
+        timer->level_ = level;
+        timer->slot_ = ( expire >> (ROOT_BITS + (level - 1) * LEVEL_BITS) ) & LEVEL_MASK;
+        head = &levels_[level - 1][timer->slot_];
+    }
+
+    appendNode( head, timer );
+    setBit( timer->level_, timer->slot_ );
+}
+
+int TimerWheel::cascade( int level, int slot ) {
+    TimerNode list;
+    spliceList( &levels_[level - 1][slot], &list );
+    clearBit( level, slot );
+
+    while ( list.Linked() ) {
+        Timer* timer = static_cast<Timer*>( list.next );
+        timer->Unlink();
+        add( timer );
+    }
+
+    return slot;
+}
+
+int TimerWheel::Run() {
+    int64_t now = Now();
+    int fired = 0;
+
+    while ( tick_ <= now ) {
+        if ( size_ == 0 ) {
+            // nothing to cascade either, jump straight to now
+            tick_ = now + 1;
+            break;
+        }
+
+        int index = tick_ & ROOT_MASK;
+        if ( index == 0 ) {
+            for ( int level = 1; level < LEVELS; level++ ) {
+                int slot = ( tick_ >> (ROOT_BITS + (level - 1) * LEVEL_BITS) ) & LEVEL_MASK;
+                if ( cascade( level, slot ) != 0 ) {
+                    break;
+                }
+            }
+        }
+
+        // whatever gets armed from the callbacks lands after this slot
+        tick_++;
+
+        TimerNode expired;
+        spliceList( &root_[index], &expired );
+        clearBit( 0, index );
+
+        while ( expired.Linked() ) {
+            Timer* timer = static_cast<Timer*>( expired.next );
+            timer->Unlink();
+            timer->wheel_ = nullptr;
+            size_--;
+
+            // the owner may go away from inside its own callback
+            Timer::CallbackType cb = timer->callback_;
+            if ( cb ) {
+                cb();
+            }
+            fired++;
+        }
+    }
+
+    return fired;
+}
+
+int TimerWheel::NextTimeout( int maxMs ) const {
+    if ( size_ == 0 ) {
+        return maxMs;
+    }
+
+    int64_t now = Now();
+    int index = tick_ & ROOT_MASK;
+    // the upper levels are only looked at on the next cascade,
+    // which is tick_ itself when it sits on a wrap
+    int64_t deadline = tick_ + ( (ROOT_SIZE - index) & ROOT_MASK );
+
+    for ( int w = index >> 6; index != 0 && w < ROOT_SIZE / 64; w++ ) {
+        uint64_t word = bits_[0][w];
+        if ( w == (index >> 6) ) {
+            word &= ~0ULL << (index & 63);
+        }
+        if ( word != 0 ) {
+            deadline = tick_ + ( w * 64 + __builtin_ctzll(word) - index );
+            break;
+        }
+    }
+
+    int64_t timeout = deadline - now;
+    if ( timeout <= 0 ) {
+        return 0;
+    }
+    return timeout < maxMs ? (int)timeout : maxMs;
+}
+
+}
+
+
+#ifdef RP_TIMER_TEST
+#include <stdio.h>
+#include <unistd.h>
+#include <vector>
+
+namespace rp {
+
+/**
+ * TimerTest
+ * runs the wheel on a clock of its own, stepped 1ms at a time, so every
+ * timer is told to fire on its very ms, across the cascades of each level.
+ **/
+struct TimerTest {
+    struct Probe {
+        const char* name;
+        Timer timer;
+        std::vector<int64_t> fired;
+        // run after the firing is recorded
+        std::function<void ()> then;
+
+        explicit Probe( const char* n ) : name(n) {}
+    };
+
+    TimerWheel wheel;
+    int64_t start;
+    int64_t quietUntil;
+    int failed;
+
+    explicit TimerTest( int64_t startMs ) : start(startMs), quietUntil(0), failed(0) {
+        wheel.nowUs_ = startMs * 1000;
+        wheel.tick_ = startMs;
+    }
+
+    int64_t Elapsed() const { return wheel.Now() - start; }
+
+    void Arm( Probe* probe, int64_t timeoutMs ) {
+        probe->timer.SetCallback( [this, probe]() { fire( probe ); } );
+        wheel.Start( &probe->timer, timeoutMs );
+    }
+
+    void Advance( int64_t ms ) {
+        for ( int64_t i = 0; i < ms; i++ ) {
+            wheel.Run();
+            quietUntil = wheel.Now() + wheel.NextTimeout( 1000 );
+            wheel.nowUs_ += 1000;
+        }
+    }
+
+    void Expect( const Probe& probe, const std::vector<int64_t>& expected ) {
+        bool ok = probe.fired == expected;
+        printf( "%s %s", probe.name, ok ? "ok\n" : (probe.fired.empty() ? "fired at none" : "fired at") );
+        for ( std::size_t i = 0; !ok && i < probe.fired.size(); i++ ) {
+            printf( " +%lld", (long long)probe.fired[i] );
+        }
+        for ( std::size_t i = 0; !ok && i <= expected.size(); i++ ) {
+            if ( i < expected.size() ) {
+                printf( "%s +%lld", i == 0 ? ", expected" : "", (long long)expected[i] );
+            } else {
+                printf( "%s\n", i == 0 ? ", expected none" : "" );
+            }
+        }
+        failed += !ok;
+    }
+
+private:
+    void fire( Probe* probe ) {
+        if ( wheel.Now() < quietUntil ) {
+            printf( "%s fired at +%lld, NextTimeout() promised none before +%lld\n",
+                probe->name, (long long)Elapsed(), (long long)(quietUntil - start) );
+            failed++;
+        }
+
+        probe->fired.push_back( Elapsed() );
+        if ( probe->then ) {
+            probe->then();
+        }
+    }
+};
+
+}
+
+int main() {
+    // off every slot boundary, the first wraps come early
+    rp::TimerTest t( 123456789 );
+    typedef rp::TimerTest::Probe Probe;
+
+    static const struct {
+        const char* name;
+        int64_t timeout;
+    } plain[] = {
+        { "0ms", 0 }, { "3ms", 3 }, { "255ms", 255 }, { "256ms level 1", 256 }, { "300ms", 300 },
+        { "2000ms", 2000 }, { "16383ms", 16383 }, { "16384ms level 2", 16384 }, { "20000ms", 20000 },
+        { "70000ms", 70000 }, { "1048576ms level 3", 1048576 }, { "1100000ms", 1100000 },
+    };
+    const std::size_t nplain = sizeof(plain) / sizeof(plain[0]);
+
+    std::vector<Probe*> probes;
+    for ( std::size_t i = 0; i < nplain; i++ ) {
+        probes.push_back( new Probe( plain[i].name ) );
+        t.Arm( probes.back(), plain[i].timeout );
+    }
+
+    Probe cancelled( "cancelled" );
+    t.Arm( &cancelled, 5000 );
+    cancelled.timer.Cancel();
+
+    // cancelled after being cascaded from level 2 to a lower one
+    Probe cascaded( "cancelled after a cascade" ), canceller( "canceller at 19000ms" );
+    t.Arm( &cascaded, 20000 );
+    canceller.then = [&cascaded]() { cascaded.timer.Cancel(); };
+    t.Arm( &canceller, 19000 );
+
+    Probe rearmed( "rearmed from its callback" );
+    rearmed.then = [&t, &rearmed]() {
+        if ( rearmed.fired.size() < 3 ) {
+            t.wheel.Start( &rearmed.timer, 500 );
+        }
+    };
+    t.Arm( &rearmed, 500 );
+
+    // the victims sit in the slot being fired and in a later one
+    Probe killer( "killer" ), sameMs( "cancelled in the same ms" ), later( "cancelled from a callback" ),
+        chained( "armed from a callback" );
+    killer.then = [&t, &sameMs, &later, &chained]() {
+        sameMs.timer.Cancel();
+        later.timer.Cancel();
+        t.Arm( &chained, 0 );
+    };
+    t.Arm( &killer, 700 );
+    t.Arm( &sameMs, 700 );
+    t.Arm( &later, 5000 );
+
+    t.Advance( 1100001 );
+
+    for ( std::size_t i = 0; i < nplain; i++ ) {
+        t.Expect( *probes[i], std::vector<int64_t>( 1, plain[i].timeout ) );
+        delete probes[i];
+    }
+    t.Expect( cancelled, std::vector<int64_t>() );
+    t.Expect( cascaded, std::vector<int64_t>() );
+    t.Expect( canceller, std::vector<int64_t>( 1, 19000 ) );
+    t.Expect( rearmed, std::vector<int64_t>{ 500, 1000, 1500 } );
+    t.Expect( killer, std::vector<int64_t>( 1, 700 ) );
+    t.Expect( sameMs, std::vector<int64_t>() );
+    t.Expect( later, std::vector<int64_t>() );
+    t.Expect( chained, std::vector<int64_t>( 1, 701 ) );
+
+    if ( t.wheel.Size() != 0 ) {
+        printf( "%zu timers left\n", t.wheel.Size() );
+        t.failed++;
+    }
+
+    // on the real clock, late by the sleep granularity at most, never early
+    rp::TimerWheel wheel;
+    rp::Timer timers[3];
+    int64_t timeouts[3] = { 3, 50, 20 };
+    int64_t fired[3] = { -1, -1, -1 };
+    int64_t start = wheel.Now();
+
+    for ( int i = 0; i < 3; i++ ) {
+        int64_t* at = &fired[i];
+        timers[i].SetCallback( [at, start, &wheel]() { *at = wheel.Now() - start; } );
+        wheel.Start( &timers[i], timeouts[i] );
+    }
+    timers[2].Cancel();
+
+    while ( wheel.Size() > 0 ) {
+        usleep( wheel.NextTimeout( 1000 ) * 1000 );
+        wheel.UpdateClock();
+        wheel.Run();
+    }
+
+    for ( int i = 0; i < 3; i++ ) {
+        bool ok = i == 2 ? fired[i] == -1 : fired[i] >= timeouts[i] && fired[i] <= timeouts[i] + 20;
+        printf( "real clock %lldms%s %s", (long long)timeouts[i], i == 2 ? " cancelled" : "", ok ? "ok\n" : "" );
+        if ( !ok ) {
+            printf( "fired at +%lldms\n", (long long)fired[i] );
+            t.failed++;
+        }
+    }
+
+    printf( "%d failed\n", t.failed );
+    return t.failed == 0 ? 0 : 1;
+}
+#endif
@@ -0,0 +1,166 @@
+#ifndef __RP_TIMER_H__
+#define __RP_TIMER_H__
+
+#include <stdint.h>
+#include <functional>
+
+namespace rp {
+
+class TimerWheel;
+
+/**
+ * TimerNode
+ * intrusive link, the slots of the wheel are the list heads.
+ **/
+struct TimerNode {
+    TimerNode* prev;
+    TimerNode* next;
+
+public:
+    TimerNode() : prev(this), next(this) {}
+
+    bool Linked() const { return next != this; }
+    void Unlink() {
+        prev->next = next;
+        next->prev = prev;
+        prev = next = this;
+    }
+};
+
+/**
+ * Timer
+ * owned by whoever arms it, the wheel only links it.
+ * destroying a pending timer cancels it.
+ **/
+class Timer : private TimerNode {
+    friend class TimerWheel;
+
+public:
+    typedef std::function<void ()> CallbackType;
+
+public:
+    Timer() : wheel_(nullptr), expire_(0), level_(0), slot_(0) {}
+    explicit Timer( CallbackType cb ) : wheel_(nullptr), expire_(0),
+        level_(0), slot_(0), callback_(cb) {}
+    ~Timer() { Cancel(); }
+
+private:
+    Timer( const Timer& );
+    Timer& operator =( const Timer& );
+
+public:
+    void SetCallback( CallbackType cb ) { callback_ = cb; }
+
+    bool Pending() const { return wheel_ != nullptr; }
+    /**
+     * absolute deadline in ms on the clock of the wheel
+     **/
+    int64_t Expire() const { return expire_; }
+
+    void Cancel();
+
+private:
+    TimerWheel* wheel_;
+    int64_t expire_;
+    uint16_t level_;
+    uint16_t slot_;
+
+    CallbackType callback_;
+};
+
+/**
+ * TimerWheel
+ * hierarchical wheel with a resolution of 1ms, adding, cancelling
+ * and firing are O(1); the upper levels are cascaded down as the
+ * lowest one wraps. deadlines farther than the wheel spans
+ * (about 18 hours) are clamped.
+ *
+ * it also keeps the clock of the loop: UpdateClock() is called once
+ * per poll round and everything else reads the cached value.
+ **/
+class TimerWheel {
+    friend class Timer;
+#ifdef RP_TIMER_TEST
+    friend struct TimerTest;
+#endif
+
+public:
+    enum {
+        ROOT_BITS   = 8,
+        ROOT_SIZE   = 1 << ROOT_BITS,
+        ROOT_MASK   = ROOT_SIZE - 1,
+        LEVEL_BITS  = 6,
+        LEVEL_SIZE  = 1 << LEVEL_BITS,
+        LEVEL_MASK  = LEVEL_SIZE - 1,
+        LEVELS      = 4,
+    };
+
+    static const int64_t MAX_TIMEOUT = ( 1LL << (ROOT_BITS + (LEVELS - 1) * LEVEL_BITS) ) - 1;
+
+public:
+    TimerWheel();
+
+private:
+    TimerWheel( const TimerWheel& );
+    TimerWheel& operator =( const TimerWheel& );
+
+public:
+    /**
+     * monotonic time of the current round, in ms and us
+     **/
+    int64_t Now() const { return nowUs_ / 1000; }
+    int64_t NowUs() const { return nowUs_; }
+    int64_t UpdateClock();
+
+public:
+    /**
+     * (re)arm the timer to fire `timeoutMs` after Now()
+     **/
+    void Start( Timer* timer, int64_t timeoutMs );
+    void Cancel( Timer* timer );
+
+    /**
+     * fire every timer that is due, returns how many did
+     **/
+    int Run();
+
+    /**
+     * ms until the earliest deadline, no more than `maxMs`
+     **/
+    int NextTimeout( int maxMs ) const;
+
+    std::size_t Size() const { return size_; }
+
+private:
+    void add( Timer* timer );
+    int cascade( int level, int slot );
+
+    void setBit( int level, int slot ) { bits_[level][slot >> 6] |= 1ULL << (slot & 63); }
+    void clearBit( int level, int slot ) { bits_[level][slot >> 6] &= ~(1ULL << (slot & 63)); }
+
+private:
+    int64_t nowUs_;
+    /**
+     * the next ms to be processed by Run()
+     **/
+    int64_t tick_;
+    std::size_t size_;
+
+    TimerNode root_[ROOT_SIZE];
+    TimerNode levels_[LEVELS - 1][LEVEL_SIZE];
+
+    /**
+     * which slots are occupied, the root level takes 4 words
+     **/
+    uint64_t bits_[LEVELS][ROOT_SIZE / 64];
+};
+
+inline void Timer::Cancel() {
+    if ( wheel_ != nullptr ) {
+        wheel_->Cancel( this );
+    }
+}
+
+}
+
+#endif
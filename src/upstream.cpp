@@ -1,105 +1,229 @@
 
+#include <string.h>
 #include <functional>
 
 #include "upstream.h"
+#include "cluster.h"
+#include "sharded.h"
 #include "session.h"
+#include "resolver.h"
+#include "metric.h"
 
 namespace rp {
 
-namespace cmd {
-
 /**
- * Auth
+ * newUpstream
+ * an upstream to addr which has started connecting
  **/
-class Auth : public UpstreamReader {
-public:
-    typedef std::function<void (bool, const Buffer&)>    CallbackHandlerType;
-public:
-    Auth( const std::string& pw, CallbackHandlerType handler ) : callbackHandler_(handler) {
-        static Buffer auth( "auth", sizeof("auth") - 1 );
-
-        cmd_.AppendArg( auth );
-        cmd_.AppendArg( Buffer(pw.c_str(), pw.size()) );
-    }
-    virtual ~Auth() {}
-
-public:
-    const Cmd& GetCmd() const { return cmd_; }
-
-public:
-    virtual void OnServerWrite( const Buffer& buffer ) {
-        if ( !buffer.Empty() ) {
-            const char* resp = buffer.Data();
-            callbackHandler_( resp[0] == '+', buffer );
-        } else {
-            callbackHandler_( false, buffer );
+static Error newUpstream( const ConnectionOptions& opt, ConnectionPool* pool, const io::Addr& addr,
+    const std::string& password, int protocol, Upstream** upstream ) {
+    // owned by the upstream instead of the pool, it outlives the closing
+    Connection* conn = new Connection( opt, pool );
+    conn->SetConnectionPool( nullptr );
+
+    Error err = conn->Connect( addr );
+    if ( !err.None() ) {
+        delete conn;
+        return err;
+    }
+
+    Upstream* created = new Upstream( opt );
+    err = created->Init( conn, password, protocol );
+    if ( !err.None() ) {
+        delete created;
+        return err;
+    }
+
+    *upstream = created;
+    return Error::OK;
+}
+
+Backend::~Backend() {
+    for ( std::size_t i = 0; i < links_.size(); ++i ) {
+        delete links_[i];
+    }
+}
+
+Error Backend::Init( const ProxyOptions& opt, ConnectionPool* pool, const io::Addr& addr,
+    const std::string& password, int protocol ) {
+    int links = opt.UpstreamConnections > 0 ? opt.UpstreamConnections : 1;
+    for ( int i = 0; i < links; ++i ) {
+        Upstream* upstream = nullptr;
+        Error err = newUpstream( *opt.UpstreamOpt, pool, addr, password, protocol, &upstream );
+        if ( !err.None() ) {
+            return err;
         }
+
+        links_.push_back( upstream );
     }
 
-private:
-    Cmd cmd_;
-    CallbackHandlerType callbackHandler_;
-};
+    return Error::OK;
+}
 
-/**
-class Info : public UpstreamReader {
-public:
-};
+Upstream* Backend::Pick( UpstreamReader* reader ) {
+    if ( links_.size() == 1 ) {
+        return links_[0];
+    }
+
+    int link = reader->Link();
+    if ( link >= 0 && link < (int)links_.size() ) {
+        return links_[link];
+    }
+
+    // a streamed cmd holds its link until it is through, those go last
+    std::size_t best = 0;
+    bool bestStreaming = true;
+    std::size_t bestLoad = (std::size_t)-1;
+    for ( std::size_t i = 0; i < links_.size(); ++i ) {
+        Upstream* upstream = links_[i];
+        if ( !upstream->IsAcceptable() ) {
+            continue;
+        }
+
+        bool streaming = upstream->Streaming();
+        std::size_t load = upstream->Outstanding();
+        if ( streaming == bestStreaming ? load < bestLoad : !streaming ) {
+            best = i;
+            bestStreaming = streaming;
+            bestLoad = load;
+        }
+    }
+
+    reader->SetLink( best );
+    return links_[best];
+}
+
+bool Backend::Owns( const Upstream* upstream ) const {
+    for ( std::size_t i = 0; i < links_.size(); ++i ) {
+        if ( links_[i] == upstream ) {
+            return true;
+        }
+    }
+    return false;
+}
 
-class Cluster : public UpstreamReader {
-public:
-    const static Buffer Info;
-    const static Buffer Nodes;
+bool Backend::IsAcceptable() const {
+    for ( std::size_t i = 0; i < links_.size(); ++i ) {
+        if ( links_[i]->IsAcceptable() ) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void Backend::OnRedirect( Upstream::RedirectHandlerType handler ) {
+    for ( std::size_t i = 0; i < links_.size(); ++i ) {
+        links_[i]->OnRedirect( handler );
+    }
+}
+
+void Backend::OnClosed( Upstream::ClosedHandlerType handler ) {
+    for ( std::size_t i = 0; i < links_.size(); ++i ) {
+        links_[i]->OnClosed( handler );
+    }
+}
+
+Error Backend::PushStream( const Buffer& chunk, bool last, UpstreamReader* reader ) {
+    for ( std::size_t i = 0; i < links_.size(); ++i ) {
+        if ( links_[i]->Streams( reader ) ) {
+            return links_[i]->PushStream( chunk, last, reader );
+        }
+    }
+
+    return Error::Closed;
+}
 
-public:
-    explicit Cluster( const Buffer& subCmd );
-    
-public:
-    virtual Error OnServerWrite( const Buffer& buffer );
-};
-*/
+void Backend::Forget( UpstreamReader* reader ) {
+    for ( std::size_t i = 0; i < links_.size(); ++i ) {
+        links_[i]->Forget( reader );
+    }
 }
 
 UpstreamPool::~UpstreamPool() {
     if ( singular_ != nullptr ) {
         delete singular_;
     }
+
+    if ( cluster_ != nullptr ) {
+        delete cluster_;
+    }
+
+    if ( sharded_ != nullptr ) {
+        delete sharded_;
+    }
 }
 
 Error UpstreamPool::Init() {
     if ( opt_.ClusterMode ) {
-        return Error::NotImplemented;
+        cluster_ = new Cluster( opt_, pool_ );
+        return cluster_->Init();
+    }
+
+    if ( opt_.ShardedMode ) {
+        sharded_ = new Sharded( opt_, pool_ );
+        return sharded_->Init();
+    }
+
+    // a singular upstream redirecting takes the routing of a cluster too
+    if ( opt_.SingularOpt->FollowRedirects ) {
+        cluster_ = new Cluster( opt_, pool_ );
+        return cluster_->Init();
     }
 
     Error err;
-    Connection* singularConn;
     io::Addr addr( opt_.SingularOpt->UpstreamHost.c_str(), opt_.SingularOpt->UpstreamPort );
 
-    err = pool_->CreateConnection( &singularConn );
-    if ( !err.None() ) {
-        return err;
+    // before the loop runs, the reconnects find it in the cache then
+    io::Resolver* resolver = pool_->Context()->resolver;
+    if ( resolver != nullptr ) {
+        err = resolver->Prefetch( addr );
+        if ( !err.None() ) {
+            return err;
+        }
     }
 
-    err = singularConn->Connect( addr );
-    if ( !err.None() ) {
-        return err;
+    singular_ = new Backend();
+    return singular_->Init( opt_, pool_, addr, opt_.SingularOpt->Password, opt_.SingularOpt->Protocol );
+}
+
+Error UpstreamPool::PushStream( const Buffer& chunk, bool last, UpstreamReader* reader ) {
+    if ( cluster_ != nullptr ) {
+        return cluster_->PushStream( chunk, last, reader );
+    }
+
+    if ( sharded_ != nullptr ) {
+        return sharded_->PushStream( chunk, last, reader );
     }
 
-    singular_ = new Upstream( *opt_.UpstreamOpt );
-    return singular_->Init( singularConn, opt_.SingularOpt->Password );
+    return singular_->PushStream( chunk, last, reader );
 }
 
-Error UpstreamPool::PushRequest( const Cmd& cmd, UpstreamReader* reader ) {
-    if ( opt_.ClusterMode ) {
-        // cmd.GetArg(0);
-        return Error::NotImplemented;
+void UpstreamPool::Forget( UpstreamReader* reader ) {
+    if ( singular_ != nullptr ) {
+        singular_->Forget( reader );
+    }
+
+    if ( cluster_ != nullptr ) {
+        cluster_->Forget( reader );
+    }
+
+    if ( sharded_ != nullptr ) {
+        sharded_->Forget( reader );
+    }
+}
+
+Error UpstreamPool::PushRequest( const Cmd& cmd, UpstreamReader* reader, uint64_t tag ) {
+    if ( cluster_ != nullptr ) {
+        return cluster_->PushRequest( cmd, reader, tag );
+    } else if ( sharded_ != nullptr ) {
+        return sharded_->PushRequest( cmd, reader, tag );
     } else {
         if ( !singular_->IsAcceptable() ) {
-            printf("!IsAcceptable()\n");
-            return Error::TryAgain;
+            // fail fast while the server is down
+            return Error::Closed;
         }
 
-        return singular_->PushRequest( cmd, reader );
+        return singular_->PushRequest( cmd, reader, tag );
     }
 
     return Error::OK;
@@ -110,6 +234,9 @@ Upstream::~Upstream() {
         delete serverConn_;
         serverConn_ = nullptr;
     }
+
+    delete authCmd_;
+    delete helloCmd_;
 }
 
 bool Upstream::IsAcceptable() const {
@@ -117,20 +244,15 @@ bool Upstream::IsAcceptable() const {
     if ( serverConn_ == nullptr ) {
         return false;
     }
-    // unconnected yet
-    if ( !serverConn_->IsConnected() ) {
-        return false;
-    }
-    // unauth yet
-    if ( !auth_ ) {
-        return false;
-    }
 
-    return true;
+    return serverConn_->IsConnected() || serverConn_->IsConnecting();
 }
 
 void Upstream::onAuthCallback( bool ok, const Buffer& cb ) {
     auth_ = ok;
+    if ( !ok ) {
+        LogErrorf( "upstream auth failed:%.*s", (int)cb.Size(), cb.Data() );
+    }
 
     if ( authCmd_ != nullptr ) {
         delete authCmd_;
@@ -138,17 +260,53 @@ void Upstream::onAuthCallback( bool ok, const Buffer& cb ) {
     }
 }
 
-Error Upstream::Init( Connection* conn, const std::string& password ) {
+void Upstream::onHelloCallback( bool ok, const Buffer& cb ) {
+    if ( !ok ) {
+        LogErrorf( "upstream refused HELLO 3, going on with RESP2:%.*s", (int)cb.Size(), cb.Data() );
+    }
+
+    if ( helloCmd_ != nullptr ) {
+        delete helloCmd_;
+        helloCmd_ = nullptr;
+    }
+}
+
+/**
+ * pushHandshake
+ * queued ahead of anything else on every new link,
+ * AUTH first since HELLO needs it done.
+ **/
+Error Upstream::pushHandshake() {
+    using namespace std::placeholders;
+    Error err;
+
+    if ( password_.empty() ) {
+        auth_ = true;
+    } else if ( authCmd_ == nullptr ) {
+        authCmd_ = new cmd::Internal( "auth", password_, std::bind( &Upstream::onAuthCallback, this, _1, _2 ) );
+        err = PushRequest( authCmd_->GetCmd(), authCmd_ );
+        if ( !err.None() ) {
+            return err;
+        }
+    }
+
+    // the previous ones are still in process otherwise
+    if ( protocol_ == 3 && helloCmd_ == nullptr ) {
+        helloCmd_ = new cmd::Internal( "hello", "3", std::bind( &Upstream::onHelloCallback, this, _1, _2 ) );
+        err = PushRequest( helloCmd_->GetCmd(), helloCmd_ );
+    }
+
+    return err;
+}
+
+Error Upstream::Init( Connection* conn, const std::string& password, int protocol ) {
     if ( serverConn_ != nullptr ) {
         return Error::InitFailed;
     }
 
-    if ( authCmd_ != nullptr ) {
-        // the auth cmd was in process
-        return Error::TryAgain;
-    }
-    
     serverConn_ = conn;
+    password_ = password;
+    protocol_ = protocol;
     connectTimes_++;
 
     Buffer* buffer = parser_.GetInputBuffer();
@@ -169,62 +327,183 @@ Error Upstream::Init( Connection* conn, const std::string& password ) {
             return err;
         }
 
-        if ( !password.empty() ) {
-            authCmd_ = new cmd::Auth( password, std::bind( &Upstream::onAuthCallback, this, _1, _2 ) );
-            
-            err = PushRequest( authCmd_->GetCmd(), authCmd_ );
-            if ( !err.None() ) {
-                return err;
-            }
-        } else {
-            auth_ = true;
+        err = serverConn_->OnConnectedEvent( std::bind( &Upstream::OnServerConnected, this, _1 ) );
+        if ( !err.None() ) {
+            return err;
+        }
+
+        err = serverConn_->OnWriteEvent( std::bind( &Upstream::OnServerWritable, this, _1 ) );
+        if ( !err.None() ) {
+            return err;
         }
     }
 
+    reconnectTimer_.SetCallback( std::bind( &Upstream::onReconnectTimer, this ) );
+
+    return pushHandshake();
+}
+
+Error Upstream::OnServerConnected( Connection* conn ) {
+    if ( failures_ > 0 ) {
+        LogInfof( "upstream %s:%d is back after %u failures",
+            conn->GetAddr().Host(), conn->GetAddr().Port(), failures_ );
+    }
+
+    failures_ = 0;
     return Error::OK;
 }
 
+/**
+ * failQueued
+ * the link is gone and the replies with it, answer everyone waiting
+ **/
+void Upstream::failQueued() {
+    static const char msg[] = "-ERR upstream connection lost\r\n";
+    Buffer reply( msg, sizeof(msg) - 1 );
+
+    // a reply out in part can not be followed by anything sane
+    bool cut = replyStreaming_;
+    replyStreaming_ = false;
+
+    ReaderPair pair;
+    while ( cmdQueue_.Pop( &pair ).None() ) {
+        if ( pair.reader->Identity() == pair.identity ) {
+            pair.reader->OnServerWrite( cut ? Buffer() : reply, pair.tag );
+        }
+        cut = false;
+    }
+}
+
 Error Upstream::OnServerClosed( Connection* conn ) {
+    auth_ = false;
+
+    failQueued();
+    // what is left of a streamed cmd has nowhere to go
+    releaseStream();
+    wakeQueueWaiters();
+
+    // a reply might have been cut in the middle
+    readPaused_ = false;
+    parser_.Reset();
+    parser_.GetInputBuffer()->Clear();
+
+    uint32_t shift = failures_ < 5 ? failures_ : 5;
+    failures_++;
+
+    LogWarnf( "upstream %s:%d closed, reconnecting in %dms",
+        conn->GetAddr().Host(), conn->GetAddr().Port(), opt_.ReconnectInterval << shift );
+    serverConn_->Timers().Start( &reconnectTimer_, opt_.ReconnectInterval << shift );
+
+    if ( closedHandler_ ) {
+        closedHandler_( this );
+    }
+    return Error::OK;
+}
+
+void Upstream::onReconnectTimer() {
     connectTimes_++;
-    //TODO: check if the connectTimes overcame threshold.
-    return serverConn_->Reconnect();
+
+    Error err = serverConn_->Reconnect();
+    if ( err.None() ) {
+        err = pushHandshake();
+    }
+
+    if ( !err.None() ) {
+        LogErrorf( "reconnecting upstream failed:%s", err.String().c_str() );
+        if ( !serverConn_->IsConnecting() && !serverConn_->IsConnected() ) {
+            OnServerClosed( serverConn_ );
+        }
+    }
+}
+
+static bool isRedirect( const Buffer& reply ) {
+    return (reply.Size() > 7 && memcmp( reply.Data(), "-MOVED ", 7 ) == 0) ||
+        (reply.Size() > 5 && memcmp( reply.Data(), "-ASK ", 5 ) == 0);
 }
 
 Error Upstream::OnServerRead( Connection* conn, Buffer* buffer ) {
     assert( conn == serverConn_ );
 
     while( !buffer->Empty() ) {
-        Error err = parser_.ParseResponse( &respBuffer_ );
+        Buffer reply;
+        Error err = parser_.ParseResponse( &reply );
         if ( !err.None() ) {
-            printf("ParseResponse failed:%s\n", err.String().c_str());
             if ( err == Error::TryAgain ) {
+                err = streamReply();
+                if ( err == Error::TryAgain ) {
+                    // until the reader has sent enough, see ResumeRead()
+                    readPaused_ = true;
+                    conn->SetReadable( false );
+                    return Error::OK;
+                }
                 break;
             }
 
-            // log this error
-            // and reconnect to server
+            // the stream can not be trusted anymore, reconnect to server
+            LogErrorf( "bad reply from upstream:%s", err.String().c_str() );
+            conn->Close();
             return err;
         }
 
+        if ( parser_.ReplyType() == '>' ) {
+            onPush( reply );
+            parser_.Reset();
+            continue;
+        }
+
         ReaderPair pair;
         err = cmdQueue_.Pop( &pair );
         if ( !err.None() ) {
             // expected bug occur, log as crisical and return
             return err;
         }
+        replyStreaming_ = false;
 
         // check if the session was valid
         if ( pair.reader->Identity() == pair.identity ) {
-            pair.reader->OnServerWrite( respBuffer_ );
+            if ( !pair.request.Empty() && isRedirect( reply ) ) {
+                Redirection redirection;
+                redirection.request = pair.request;
+                redirection.reader = pair.reader;
+                redirection.identity = pair.identity;
+                redirection.tag = pair.tag;
+                redirection.hops = pair.hops;
+
+                if ( redirectHandler_( this, reply, redirection ) ) {
+                    parser_.Reset();
+                    continue;
+                }
+            }
+
+            if ( parser_.ReplyRESP3() && pair.reader->Protocol() < 3 ) {
+                Buffer converted;
+                err = impl::ConvertToRESP2( reply, &converted );
+                if ( !err.None() ) {
+                    LogErrorf( "converting reply to RESP2 failed:%s", err.String().c_str() );
+                }
+                reply = converted;
+            }
+
+            pair.reader->OnServerWrite( reply, pair.tag );
         }
         
         parser_.Reset();
-        respBuffer_.Clear();
     }
 
+    if ( !queueWaiters_.empty() && cmdQueue_.Size() <= cmdQueue_.Capacity() / 2 ) {
+        wakeQueueWaiters();
+    }
+
+    /**
+     * a partial reply stays in the buffer until it is complete,
+     * grow it by its size at least so that a large one is not copied over and over.
+     * a streamed one is out as slices, the buffer moves to new memory then.
+     **/
+    std::size_t minSize = replyStreaming_ ? opt_.ReadBufferInitSize : opt_.ReadBufferMinSize;
     std::size_t freeSize = buffer->FreeSize();
-    if ( freeSize < opt_.ReadBufferMinSize ) {
-        Error err = buffer->AppendCapacity( opt_.ReadBufferMinSize );
+    if ( freeSize < minSize ) {
+        std::size_t grow = buffer->Size() > minSize ? buffer->Size() : minSize;
+        Error err = buffer->AppendCapacity( grow );
         if ( !err.None() ) {
             return err;
         }
@@ -233,36 +512,268 @@ Error Upstream::OnServerRead( Connection* conn, Buffer* buffer ) {
     return Error::OK;
 }
 
-Error Upstream::PushRequest( const Cmd& cmd, UpstreamReader* reader ) {
-    Error err;
-    if ( !serverConn_->IsConnected() ) {
-        return Error::TryAgain;
+/**
+ * streamReply
+ * a reply of StreamBulkSize or more is not held until it is complete,
+ * what has been framed of it goes to its reader as it comes.
+ **/
+Error Upstream::streamReply() {
+    std::size_t size = parser_.PartialSize();
+    if ( size == 0 || (!replyStreaming_ && (opt_.StreamBulkSize == 0 || size < opt_.StreamBulkSize)) ) {
+        return Error::OK;
+    }
+
+    // not for a reader, or not known yet
+    char type = parser_.PartialType();
+    if ( type == 0 || type == '|' || type == '>' || cmdQueue_.Empty() ) {
+        return Error::OK;
     }
 
-    err = cmdQueue_.Push( ReaderPair(reader, reader->Identity()) );
+    ReaderPair& pair( cmdQueue_.Front() );
+    bool alive = pair.reader->Identity() == pair.identity;
+
+    // RESP3 is converted for the RESP2 readers, which takes it whole
+    if ( alive && (!pair.reader->Streamable( pair.tag ) || (protocol_ == 3 && pair.reader->Protocol() < 3)) ) {
+        return Error::OK;
+    }
+
+    Buffer part;
+    Error err = parser_.TakePartialResponse( &part );
     if ( !err.None() ) {
-        if ( err == Error::Full ) {
-            return Error::TryAgain;
+        return err;
+    }
+    replyStreaming_ = true;
+
+    // nobody waits for it, no need to keep it either
+    if ( !alive ) {
+        return Error::OK;
+    }
+
+    return pair.reader->OnServerStream( this, part );
+}
+
+void Upstream::ResumeRead() {
+    if ( !readPaused_ ) {
+        return;
+    }
+
+    readPaused_ = false;
+    serverConn_->SetReadable( true );
+    OnServerRead( serverConn_, parser_.GetInputBuffer() );
+}
+
+/**
+ * onPush
+ * out-of-band data like the invalidations of client tracking. the link is
+ * shared by every session of the worker, so there is no telling whose it is,
+ * it answers no request and must not take a place in cmdQueue_.
+ **/
+void Upstream::onPush( const Buffer& reply ) {
+    MetricFactoryInstance->FetchTimeSum( "upstream_push" )->Inc();
+}
+
+Error Upstream::OnServerWritable( Connection* conn ) {
+    if ( streamPaused_ && conn->PendingSize() < opt_.StreamPendingSize ) {
+        streamPaused_ = false;
+        if ( streamOwner_.reader->Identity() == streamOwner_.identity ) {
+            streamOwner_.reader->OnUpstreamReady();
         }
-        printf("!cmdQueue_Push()\n");
+    }
+
+    return Error::OK;
+}
+
+/**
+ * releaseStream
+ * the link is free again, everyone who waited for it gets another go
+ **/
+void Upstream::releaseStream() {
+    streamOwner_ = ReaderPair();
+    streamPaused_ = false;
+
+    std::vector<ReaderPair> waiters;
+    waiters.swap( streamWaiters_ );
+    for ( std::size_t i = 0; i < waiters.size(); ++i ) {
+        if ( waiters[i].reader->Identity() == waiters[i].identity ) {
+            waiters[i].reader->OnUpstreamReady();
+        }
+    }
+}
+
+/**
+ * wakeQueueWaiters
+ * cmdQueue_ has room again, or the link is lost and they are answered
+ * by Closed. the ones still short of room wait again.
+ **/
+void Upstream::wakeQueueWaiters() {
+    std::vector<ReaderPair> waiters;
+    waiters.swap( queueWaiters_ );
+    for ( std::size_t i = 0; i < waiters.size(); ++i ) {
+        if ( waiters[i].reader->Identity() == waiters[i].identity ) {
+            waiters[i].reader->OnUpstreamReady();
+        }
+    }
+}
+
+Error Upstream::PushStream( const Buffer& chunk, bool last, UpstreamReader* reader ) {
+    if ( streamOwner_.reader != reader || streamOwner_.identity != reader->Identity() ) {
+        return Error::Closed;
+    }
+
+    if ( opt_.StreamPendingSize > 0 && serverConn_->PendingSize() >= opt_.StreamPendingSize ) {
+        streamPaused_ = true;
+        return Error::TryAgain;
+    }
+
+    Error err = serverConn_->WriteToBuffer( chunk );
+    if ( !err.None() ) {
+        // half a cmd is on the link, nothing can follow it
+        serverConn_->Close();
         return err;
     }
 
-    Buffer buffer;
-    err = buffer.AppendCapacity( 4 * 1024 );
+    if ( last ) {
+        releaseStream();
+    }
+    return Error::OK;
+}
+
+void Upstream::Forget( UpstreamReader* reader ) {
+    for ( std::size_t i = 0; i < streamWaiters_.size(); ) {
+        if ( streamWaiters_[i].reader == reader ) {
+            streamWaiters_.erase( streamWaiters_.begin() + i );
+        } else {
+            ++i;
+        }
+    }
+    for ( std::size_t i = 0; i < queueWaiters_.size(); ) {
+        if ( queueWaiters_[i].reader == reader ) {
+            queueWaiters_.erase( queueWaiters_.begin() + i );
+        } else {
+            ++i;
+        }
+    }
+
+    if ( streamOwner_.reader == reader ) {
+        LogWarnf( "client gone in the middle of a streamed request, dropping the upstream link" );
+        serverConn_->Close();
+    }
+}
+
+/**
+ * addWaiter
+ * a reader is in once however often it is turned away. the internal cmds
+ * have no identity, they try again by themselves and may be gone by then.
+ **/
+void Upstream::addWaiter( std::vector<ReaderPair>* waiters, UpstreamReader* reader ) {
+    uint64_t identity = reader->Identity();
+    if ( identity == 0 ) {
+        return;
+    }
+
+    for ( std::size_t i = 0; i < waiters->size(); ++i ) {
+        if ( (*waiters)[i].reader == reader && (*waiters)[i].identity == identity ) {
+            return;
+        }
+    }
+    waiters->push_back( ReaderPair(reader, identity) );
+}
+
+Error Upstream::Reserve( std::size_t count, UpstreamReader* reader ) {
+    if ( !IsAcceptable() ) {
+        return Error::Closed;
+    }
+
+    if ( streamOwner_.reader != nullptr ) {
+        // it would land in the middle of the streamed one
+        addWaiter( &streamWaiters_, reader );
+        return Error::TryAgain;
+    }
+
+    if ( count > cmdQueue_.Capacity() ) {
+        return Error::Exhausted;
+    }
+    if ( cmdQueue_.Size() + count > cmdQueue_.Capacity() ) {
+        addWaiter( &queueWaiters_, reader );
+        return Error::TryAgain;
+    }
+    return Error::OK;
+}
+
+Error Upstream::PushRequest( const Cmd& cmd, UpstreamReader* reader, uint64_t tag ) {
+    Error err = Reserve( 1, reader );
     if ( !err.None() ) {
         return err;
     }
 
-    err = cmd.FormatRESP2( &buffer );
+    // forwarded as the client sent it when there is nothing rewritten
+    Buffer buffer( cmd.Raw() );
+    if ( buffer.Empty() ) {
+        err = cmd.FormatRESP2( &buffer );
+        if ( !err.None() ) {
+            return err;
+        }
+    }
+
+    ReaderPair pair( reader, reader->Identity(), tag );
+    if ( redirectHandler_ && !cmd.Streaming() ) {
+        pair.request = buffer;
+    }
+
+    err = cmdQueue_.Push( pair );
     if ( !err.None() ) {
+        printf("!cmdQueue_Push()\n");
         return err;
     }
 
-    //printf("Push[%d]%s\n====\n", buffer.Size(), buffer.Data());
+    if ( cmd.Streaming() ) {
+        streamOwner_ = ReaderPair( reader, reader->Identity() );
+    }
 
-    err = serverConn_->WriteToBuffer( buffer );
-    return err;
+    return serverConn_->WriteToBuffer( buffer );
+}
+
+/**
+ * the +OK of ASKING answers nobody
+ **/
+static struct AskingReader : public UpstreamReader {
+    virtual void OnServerWrite( const Buffer& buffer, uint64_t tag ) {}
+} askingReader;
+
+Error Upstream::Resend( const Redirection& redirection, bool asking ) {
+    static const char askingCmd[] = "*1\r\n$6\r\nASKING\r\n";
+
+    if ( !IsAcceptable() ) {
+        return Error::Closed;
+    }
+
+    // ASKING and the request go together or not at all
+    std::size_t need = asking ? 2 : 1;
+    if ( streamOwner_.reader != nullptr || cmdQueue_.Size() + need > cmdQueue_.Capacity() ) {
+        return Error::TryAgain;
+    }
+
+    Error err;
+    if ( asking ) {
+        err = cmdQueue_.Push( ReaderPair(&askingReader, askingReader.Identity()) );
+        if ( err.None() ) {
+            err = serverConn_->WriteToBuffer( Buffer(askingCmd, sizeof(askingCmd) - 1) );
+        }
+        if ( !err.None() ) {
+            return err;
+        }
+    }
+
+    ReaderPair pair( redirection.reader, redirection.identity, redirection.tag );
+    pair.request = redirection.request;
+    pair.hops = redirection.hops;
+
+    err = cmdQueue_.Push( pair );
+    if ( !err.None() ) {
+        return err;
+    }
+
+    return serverConn_->WriteToBuffer( redirection.request );
 }
 
 }
@@ -2,56 +2,211 @@
 #ifndef __RP_UPSTREAM_H__
 #define __RP_UPSTREAM_H__
 
+#include <string.h>
+#include <vector>
+#include <functional>
+
 #include "connections.h"
 #include "recycle.h"
 #include "cmd.h"
 
 namespace rp {
 
-namespace cmd {
-
-class Auth;
-class Info;
+class Upstream;
 class Cluster;
-
-}
+class Sharded;
 
 /**
  * UpstreamReader
  **/
 struct UpstreamReader {
     virtual uint64_t Identity() const { return 0; }
-    virtual void OnServerWrite( const Buffer& buffer ) = 0;
+    /**
+     * the RESP version it speaks, RESP3 replies are converted for 2
+     **/
+    virtual int Protocol() const { return 2; }
+    /**
+     * the reply to the request pushed with tag, the replies of one upstream
+     * come in the order of the requests, those of different ones do not.
+     **/
+    virtual void OnServerWrite( const Buffer& buffer, uint64_t tag ) = 0;
+    /**
+     * the parts of a reply of StreamBulkSize or more as they come, for the
+     * readers taking them. OnServerWrite() ends it with the rest, or with an
+     * empty buffer when it got cut. TryAgain stops the upstream reading until
+     * Upstream::ResumeRead().
+     **/
+    virtual bool Streamable( uint64_t tag ) const { return false; }
+    virtual Error OnServerStream( Upstream* upstream, const Buffer& part ) { return Error::NotImplemented; }
+    /**
+     * the upstream which answered a push with TryAgain can take more
+     **/
+    virtual void OnUpstreamReady() {}
+    /**
+     * the link of a backend its requests in flight took, the next one takes
+     * it too to run after them. -1 when none are, see Backend::Pick().
+     **/
+    virtual int Link() const { return -1; }
+    virtual void SetLink( int link ) {}
+};
+
+namespace cmd {
+
+/**
+ * Internal
+ * a command of the proxy itself on the link, like AUTH or HELLO,
+ * its reply goes to the handler instead of a session.
+ **/
+class Internal : public UpstreamReader {
+public:
+    typedef std::function<void (bool, const Buffer&)>    CallbackHandlerType;
+public:
+    Internal( const char* name, const std::string& arg, CallbackHandlerType handler ) : callbackHandler_(handler) {
+        cmd_.AppendArg( name, strlen(name) );
+        cmd_.AppendArg( arg.c_str(), arg.size() );
+    }
+    virtual ~Internal() {}
+
+public:
+    const Cmd& GetCmd() const { return cmd_; }
+
+public:
+    virtual void OnServerWrite( const Buffer& buffer, uint64_t tag ) {
+        if ( !buffer.Empty() ) {
+            const char* resp = buffer.Data();
+            callbackHandler_( resp[0] != '-' && resp[0] != '!', buffer );
+        } else {
+            callbackHandler_( false, buffer );
+        }
+    }
+
+private:
+    Cmd cmd_;
+    CallbackHandlerType callbackHandler_;
+};
+
+}
+
+/**
+ * Redirection
+ * a request answered with -MOVED or -ASK, with what it takes to send it again
+ **/
+struct Redirection {
+    Buffer request;
+    UpstreamReader* reader;
+    uint64_t identity;
+    uint64_t tag;
+    int hops;
 };
 
 /**
  * Upstream
  **/
 class Upstream {
+public:
+    typedef std::function<bool (Upstream*, const Buffer&, const Redirection&)>    RedirectHandlerType;
+    typedef std::function<void (Upstream*)>    ClosedHandlerType;
+
 public:
     Upstream( const ConnectionOptions& opt ) : 
-        opt_(opt), serverConn_(nullptr), connectTimes_(0), auth_(false),
-        authCmd_(nullptr), cmdQueue_(opt.ConnSendBufferCount) {}
+        opt_(opt), serverConn_(nullptr), connectTimes_(0), failures_(0), auth_(false),
+        authCmd_(nullptr), protocol_(2), helloCmd_(nullptr), cmdQueue_(opt.ConnSendBufferCount), streamPaused_(false),
+        replyStreaming_(false), readPaused_(false) {}
     ~Upstream();
 
     /**
      * Init()
+     * takes over `conn`, which has started connecting,
+     * and keeps it across the reconnects.
+     * protocol 3 has every new link switched to RESP3 with HELLO.
      **/
-    Error Init( Connection* conn, const std::string& password );
+    Error Init( Connection* conn, const std::string& password, int protocol = 2 );
     Error Close();
 
 public:
+    Error OnServerConnected( Connection* conn );
     Error OnServerClosed( Connection* conn );
     Error OnServerRead( Connection* conn, Buffer* buffer );
+    Error OnServerWritable( Connection* conn );
 
 public:
-    Error PushRequest( const Cmd& cmd, UpstreamReader* reader );
+    /**
+     * a streamed cmd holds the link until its last chunk, the others
+     * get TryAgain meanwhile and OnUpstreamReady() once it is free.
+     * the same while cmdQueue_ is full, until half of it has replied.
+     **/
+    Error PushRequest( const Cmd& cmd, UpstreamReader* reader, uint64_t tag = 0 );
+    /**
+     * Reserve()
+     * whether count requests can be pushed right now, as PushRequest() tells
+     * of one: Closed, or TryAgain with reader told by OnUpstreamReady() when
+     * there is room. Exhausted for more than the queue ever holds.
+     **/
+    Error Reserve( std::size_t count, UpstreamReader* reader );
+    /**
+     * PushStream()
+     * the rest of the streamed cmd of reader. TryAgain takes nothing while
+     * StreamPendingSize waits to be sent, OnUpstreamReady() follows.
+     * Closed if the link was lost meanwhile, its reply is an error then.
+     **/
+    Error PushStream( const Buffer& chunk, bool last, UpstreamReader* reader );
+    /**
+     * the reader is going away. a cmd it streams can not be completed,
+     * the link is closed to drop it.
+     **/
+    void Forget( UpstreamReader* reader );
+    /**
+     * a reader which had the reading stopped can take more again
+     **/
+    void ResumeRead();
+    /**
+     * OnRedirect()
+     * the -MOVED and -ASK replies go to handler instead of the reader, false
+     * hands them on. the requests are kept until their replies for it,
+     * the streamed ones aside.
+     **/
+    void OnRedirect( RedirectHandlerType handler ) { redirectHandler_ = handler; }
+    /**
+     * OnClosed()
+     * handler is told each time the link is lost, after the requests
+     * on it have been answered.
+     **/
+    void OnClosed( ClosedHandlerType handler ) { closedHandler_ = handler; }
+    /**
+     * Resend()
+     * a request redirected here, after an ASKING for asking. TryAgain while
+     * there is no room for it, nothing waits for OnUpstreamReady() then.
+     **/
+    Error Resend( const Redirection& redirection, bool asking );
+    /**
+     * the link is held by a cmd the reader streams
+     **/
+    bool Streams( const UpstreamReader* reader ) const {
+        return streamOwner_.reader == reader && streamOwner_.identity == reader->Identity();
+    }
+    bool Streaming() const { return streamOwner_.reader != nullptr; }
+    /**
+     * the replies still to come
+     **/
+    std::size_t Outstanding() const { return cmdQueue_.Size(); }
 
 public:
+    /**
+     * connected or on the way to, requests pushed while connecting
+     * are sent once it is done. false while waiting to reconnect.
+     **/
     bool IsAcceptable() const;
 
 private:
     void onAuthCallback( bool ok, const Buffer& cb );
+    void onHelloCallback( bool ok, const Buffer& cb );
+    Error pushHandshake();
+    void onPush( const Buffer& reply );
+    void failQueued();
+    void onReconnectTimer();
+    void releaseStream();
+    void wakeQueueWaiters();
+    Error streamReply();
 
 private:
     const ConnectionOptions&    opt_;
@@ -61,28 +216,113 @@ private:
      **/
     Connection* serverConn_;
     uint32_t connectTimes_;
+    /**
+     * the connection attempts failed in a row
+     **/
+    uint32_t failures_;
+    Timer   reconnectTimer_;
 
     /**
      * 
      **/
-    Buffer respBuffer_;
     CmdParser parser_;
 
 private:
     bool    auth_;
-    cmd::Auth   *authCmd_;
+    std::string password_;
+    cmd::Internal   *authCmd_;
+
+    int protocol_;
+    cmd::Internal   *helloCmd_;
 
 private:
     struct ReaderPair {
         uint64_t identity;
         UpstreamReader* reader;
+        uint64_t tag;
+        /**
+         * the request, kept for redirectHandler_ only
+         **/
+        Buffer request;
+        int hops;
 
-        ReaderPair() : identity(0), reader(nullptr) {}
-        ReaderPair( UpstreamReader* r, uint64_t id ) : identity(id), reader(r) {}
+        ReaderPair() : identity(0), reader(nullptr), tag(0), hops(0) {}
+        ReaderPair( UpstreamReader* r, uint64_t id, uint64_t t = 0 ) : identity(id), reader(r), tag(t), hops(0) {}
     };
 
     typedef Recycle<ReaderPair> CmdQueueType;
     CmdQueueType  cmdQueue_;
+
+    /**
+     * the reader whose cmd is being streamed, nothing else
+     * may be written to the link until it is through.
+     **/
+    ReaderPair  streamOwner_;
+    bool    streamPaused_;
+    std::vector<ReaderPair> streamWaiters_;
+
+    /**
+     * the readers turned away while cmdQueue_ was full
+     **/
+    std::vector<ReaderPair> queueWaiters_;
+
+    void addWaiter( std::vector<ReaderPair>* waiters, UpstreamReader* reader );
+
+    /**
+     * the reply in progress has been handed out in part, to the front of
+     * cmdQueue_. readPaused_ while its reader has enough to send.
+     **/
+    bool    replyStreaming_;
+    bool    readPaused_;
+
+    RedirectHandlerType redirectHandler_;
+    ClosedHandlerType   closedHandler_;
+};
+
+/**
+ * Backend
+ * the links to one server, UpstreamConnections of them. the requests of a
+ * reader go on the link of those it has in flight, to run in the order
+ * they came, else on the one with the fewest replies to come.
+ **/
+class Backend {
+public:
+    Backend() {}
+    ~Backend();
+
+    Error Init( const ProxyOptions& opt, ConnectionPool* pool, const io::Addr& addr,
+        const std::string& password, int protocol );
+
+public:
+    Upstream* Pick( UpstreamReader* reader );
+    bool Owns( const Upstream* upstream ) const;
+    /**
+     * some link is, see Upstream::IsAcceptable()
+     **/
+    bool IsAcceptable() const;
+
+public:
+    void OnRedirect( Upstream::RedirectHandlerType handler );
+    void OnClosed( Upstream::ClosedHandlerType handler );
+
+    Error PushRequest( const Cmd& cmd, UpstreamReader* reader, uint64_t tag = 0 ) {
+        return Pick( reader )->PushRequest( cmd, reader, tag );
+    }
+    Error Resend( const Redirection& redirection, bool asking ) {
+        return Pick( redirection.reader )->Resend( redirection, asking );
+    }
+    /**
+     * Closed when no link is streamed on by reader
+     **/
+    Error PushStream( const Buffer& chunk, bool last, UpstreamReader* reader );
+    void Forget( UpstreamReader* reader );
+
+private:
+    Backend( const Backend& );
+    Backend& operator =( const Backend& );
+
+private:
+    std::vector<Upstream*>  links_;
 };
 
 /**
@@ -91,7 +331,7 @@ private:
 class UpstreamPool {
 public:
     UpstreamPool( const ProxyOptions& opt, ConnectionPool* pool ) : 
-        opt_(opt), pool_(pool), singular_(nullptr) {}
+        opt_(opt), pool_(pool), singular_(nullptr), cluster_(nullptr), sharded_(nullptr) {}
     ~UpstreamPool();
 
 public:
@@ -99,17 +339,21 @@ public:
 
 public:
     /**
-     * check if it is in cluster mode.
+     * to the one upstream, to the master of the slot in cluster mode,
+     * or to the server of the keys in sharded mode
      **/
-    Error PushRequest( const Cmd& cmd, UpstreamReader* reader );
+    Error PushRequest( const Cmd& cmd, UpstreamReader* reader, uint64_t tag = 0 );
+    Error PushStream( const Buffer& chunk, bool last, UpstreamReader* reader );
+    void Forget( UpstreamReader* reader );
 
 private:
     const ProxyOptions& opt_;
     ConnectionPool* pool_;
 
 private:
-    Upstream* singular_;
-
+    Backend* singular_;
+    Cluster* cluster_;
+    Sharded* sharded_;
 };
 
 }
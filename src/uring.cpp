@@ -0,0 +1,1028 @@
+
+#ifdef RP_USE_URING
+
+#include <assert.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <string.h>
+#include <vector>
+#include <algorithm>
+
+#include "io.h"
+#include "error.h"
+#include "connections.h"
+#include "logger.h"
+#include "metric.h"
+
+/**
+ * io_uring backend
+ *
+ * each socket is read by a multishot IORING_OP_RECV into the buffers of a
+ * ring registered with the kernel (IORING_REGISTER_PBUF_RING), the data is
+ * there with its completion and Event::Read() copies it out without any
+ * syscall. what the recv can not serve, an eventfd or a socket at its end,
+ * goes back to readiness by IORING_OP_POLL_ADD and read(), as it all does
+ * with UringRecvBuffers 0. a recv which found no buffer left does so only
+ * until some were read out and given back to the ring.
+ *
+ * the listener is served by a multishot IORING_OP_ACCEPT, and the writes
+ * of the connections go out as IORING_OP_SENDMSG: Event::Writev() queues
+ * the segments, holding their buffers, and reports what was sent the next
+ * round. the loop flushes the connections every round, it collects then.
+ *
+ * nothing of it costs a syscall of its own: every SQE queued during an
+ * iteration is handed to the kernel by the single io_uring_enter() which
+ * also waits for the next completions.
+ *
+ * the polls are one-shot and re-armed after being dispatched, what was
+ * received and not read yet is handed out again the next round, which
+ * keeps the level-triggered contract the connections rely on.
+ **/
+namespace rp { namespace io {
+
+enum {
+    URING_ENTRIES   = 1024,
+    URING_NOTIFY_MASK   = POLLIN | POLLOUT | POLLRDHUP,
+    URING_BUF_GROUP = 0,
+    // what one buffer ring takes
+    URING_MAX_BUFFERS   = 32768,
+};
+
+static const uint64_t URING_RECV_TOKEN = 1ULL << 63;
+static const uint64_t URING_SEND_TOKEN = 1ULL << 62;
+static const uint32_t URING_GEN_MASK = 0x3fffffff;
+
+/**
+ * uring user_data layout: generation << 32 | fd, the top bit set for the
+ * recvs and the accepts. a send is its state with the next bit set.
+ * 0 is reserved for the removals whose completion are ignored.
+ **/
+static inline uint64_t pollToken( int fd, uint32_t gen ) {
+    return (uint64_t(gen & URING_GEN_MASK) << 32) | uint32_t(fd);
+}
+
+static inline uint64_t recvToken( int fd, uint32_t life ) {
+    return URING_RECV_TOKEN | pollToken( fd, life );
+}
+
+struct uringState : public LoopState {
+    int ringfd;
+
+    /**
+     * the listen event, known from the first PollOnce(), and the flags
+     * of the sockets its accept makes
+     **/
+    Event* listener;
+    int acceptFlags;
+
+    /**
+     * submission queue
+     **/
+    void* sqPtr;
+    std::size_t sqSize;
+    unsigned* sqHead;
+    unsigned* sqTail;
+    unsigned* sqMask;
+    unsigned* sqArray;
+    io_uring_sqe* sqes;
+    std::size_t sqesSize;
+    unsigned sqEntries;
+    unsigned sqPending;
+
+    /**
+     * completion queue
+     **/
+    void* cqPtr;
+    std::size_t cqSize;
+    unsigned* cqHead;
+    unsigned* cqTail;
+    unsigned* cqMask;
+    io_uring_cqe* cqes;
+
+    /**
+     * the buffers the recvs pick from, nullptr when they are not used.
+     * each is given back to the ring once read out.
+     **/
+    io_uring_buf_ring* bufRing;
+    std::size_t bufRingSize;
+    char* bufs;
+    unsigned bufCount;
+    unsigned bufSize;
+    uint16_t bufTail;
+    // the buffers in the ring
+    unsigned bufFree;
+
+    /**
+     * the recvs stopped for the lack of buffers, fd and life
+     **/
+    std::vector<std::pair<int, uint32_t> > starved;
+
+    /**
+     * what a recv put in a buffer and is not read yet
+     **/
+    struct Chunk {
+        uint16_t bid;
+        uint32_t offset;
+        uint32_t size;
+    };
+
+    /**
+     * the send of an event, the pins hold the memory it reads until it
+     * completes. released with its socket while in flight, it is left
+     * to its completion as an orphan.
+     **/
+    struct Sending {
+        Event* evt;
+        bool inFlight;
+        bool done;
+        int result;
+        msghdr msg;
+        std::vector<iovec> iov;
+        std::vector<Buffer> pins;
+
+        explicit Sending( Event* e ) : evt(e), inFlight(false), done(false), result(0) {}
+    };
+    std::vector<Sending*> orphans;
+
+    /**
+     * registered events indexed by fd, the generation is bumped
+     * every time the poll changes so stale completions are dropped.
+     * the life is bumped when the fd is bound to an event or released,
+     * `receiving` while the recv, or the accept, serves it. a starved
+     * one is read() until buffers are back.
+     **/
+    struct Registration {
+        Event* evt;
+        uint32_t gen;
+        bool armed;
+        // what the armed poll waits for
+        int mask;
+
+        uint32_t life;
+        bool receiving;
+        bool starved;
+        bool recvArmed;
+        bool recvCancelling;
+        std::vector<Chunk> received;
+
+        Sending* sending;
+
+        Registration() : evt(nullptr), gen(0), armed(false), mask(0), life(0), receiving(false),
+            starved(false), recvArmed(false), recvCancelling(false), sending(nullptr) {}
+
+        bool Serving() const { return receiving && !starved; }
+    };
+    std::vector<Registration> regs;
+
+public:
+    uringState() : ringfd(-1), listener(nullptr), acceptFlags(0), sqPtr(MAP_FAILED), sqSize(0), sqes((io_uring_sqe*)MAP_FAILED),
+        sqesSize(0), sqPending(0), cqPtr(MAP_FAILED), cqSize(0),
+        bufRing(nullptr), bufRingSize(0), bufs(nullptr), bufCount(0), bufSize(0), bufTail(0), bufFree(0) {}
+
+    virtual ~uringState() {
+        if ( sqes != MAP_FAILED ) { munmap( sqes, sqesSize ); }
+        if ( cqPtr != MAP_FAILED && cqPtr != sqPtr ) { munmap( cqPtr, cqSize ); }
+        if ( sqPtr != MAP_FAILED ) { munmap( sqPtr, sqSize ); }
+        if ( ringfd != -1 ) { close( ringfd ); }
+
+        // the kernel lets go of the buffers with the ring
+        if ( bufRing != nullptr ) { munmap( bufRing, bufRingSize ); }
+        if ( bufs != nullptr ) { munmap( bufs, std::size_t(bufCount) * bufSize ); }
+
+        for ( std::size_t i = 0; i < regs.size(); i++ ) {
+            delete regs[i].sending;
+        }
+        for ( std::size_t i = 0; i < orphans.size(); i++ ) {
+            delete orphans[i];
+        }
+    }
+
+public:
+    Registration& Get( int fd ) {
+        if ( std::size_t(fd) >= regs.size() ) {
+            regs.resize( fd * 2 + 64 );
+        }
+        return regs[fd];
+    }
+
+    bool CqEmpty() const {
+        return *cqHead == __atomic_load_n( cqTail, __ATOMIC_ACQUIRE );
+    }
+
+    Error Enter( unsigned submit, unsigned wait, int timeoutMs ) {
+        unsigned flags = 0;
+        __kernel_timespec ts;
+        io_uring_getevents_arg arg;
+        memset( &arg, 0, sizeof(arg) );
+
+        if ( wait > 0 ) {
+            flags |= IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+
+            ts.tv_sec = timeoutMs / 1000;
+            ts.tv_nsec = (timeoutMs % 1000) * 1000000LL;
+            arg.ts = (uint64_t)(uintptr_t)&ts;
+        }
+
+        int ret = syscall( __NR_io_uring_enter, ringfd, submit, wait, flags,
+            wait > 0 ? &arg : nullptr, sizeof(arg) );
+        if ( ret < 0 && errno != ETIME && errno != EINTR ) {
+            return Error( errno, strerror(errno) );
+        }
+
+        // whatever the kernel did not consume is still pending
+        sqPending = *sqTail - __atomic_load_n( sqHead, __ATOMIC_ACQUIRE );
+        return Error::OK;
+    }
+
+    io_uring_sqe* NextSqe() {
+        unsigned head = __atomic_load_n( sqHead, __ATOMIC_ACQUIRE );
+        unsigned tail = *sqTail;
+
+        if ( tail - head >= sqEntries ) {
+            // the queue is full, hand it over to the kernel right now
+            Error err = Enter( sqPending, 0, 0 );
+            if ( !err.None() ) {
+                LogErrorf( "io_uring_enter() failed:%s", err.String().c_str() );
+                return nullptr;
+            }
+
+            head = __atomic_load_n( sqHead, __ATOMIC_ACQUIRE );
+            if ( tail - head >= sqEntries ) {
+                return nullptr;
+            }
+        }
+
+        unsigned index = tail & *sqMask;
+        io_uring_sqe* sqe = &sqes[index];
+        memset( sqe, 0, sizeof(*sqe) );
+
+        sqArray[index] = index;
+        __atomic_store_n( sqTail, tail + 1, __ATOMIC_RELEASE );
+        sqPending++;
+
+        return sqe;
+    }
+
+    Error PollAdd( int fd, Registration& reg, int mask ) {
+        io_uring_sqe* sqe = NextSqe();
+        if ( sqe == nullptr ) {
+            return Error::Full;
+        }
+
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = fd;
+        sqe->poll32_events = mask;
+        sqe->user_data = pollToken( fd, reg.gen );
+
+        reg.armed = true;
+        reg.mask = mask;
+        return Error::OK;
+    }
+
+    Error PollRemove( int fd, Registration& reg ) {
+        if ( !reg.armed ) {
+            return Error::OK;
+        }
+
+        io_uring_sqe* sqe = NextSqe();
+        if ( sqe == nullptr ) {
+            return Error::Full;
+        }
+
+        sqe->opcode = IORING_OP_POLL_REMOVE;
+        sqe->fd = -1;
+        sqe->addr = pollToken( fd, reg.gen );
+        sqe->user_data = 0;
+
+        reg.armed = false;
+        return Error::OK;
+    }
+
+    /**
+     * the multishot recv of a socket, or the accept of the listener
+     **/
+    Error RecvAdd( int fd, Registration& reg ) {
+        io_uring_sqe* sqe = NextSqe();
+        if ( sqe == nullptr ) {
+            return Error::Full;
+        }
+
+        sqe->fd = fd;
+        if ( reg.evt == listener ) {
+            sqe->opcode = IORING_OP_ACCEPT;
+            sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+            sqe->accept_flags = acceptFlags;
+        } else {
+            sqe->opcode = IORING_OP_RECV;
+            sqe->ioprio = IORING_RECV_MULTISHOT;
+            sqe->flags = IOSQE_BUFFER_SELECT;
+            sqe->buf_group = URING_BUF_GROUP;
+        }
+        sqe->user_data = recvToken( fd, reg.life );
+
+        reg.recvArmed = true;
+        return Error::OK;
+    }
+
+    /**
+     * the recv stops with its last completion, it is armed till then
+     **/
+    Error RecvCancel( int fd, Registration& reg ) {
+        if ( !reg.recvArmed || reg.recvCancelling ) {
+            return Error::OK;
+        }
+
+        io_uring_sqe* sqe = NextSqe();
+        if ( sqe == nullptr ) {
+            return Error::Full;
+        }
+
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = -1;
+        sqe->addr = recvToken( fd, reg.life );
+        sqe->user_data = 0;
+
+        reg.recvCancelling = true;
+        return Error::OK;
+    }
+
+    Error SendAdd( int fd, Sending* sending ) {
+        io_uring_sqe* sqe = NextSqe();
+        if ( sqe == nullptr ) {
+            return Error::Full;
+        }
+
+        memset( &sending->msg, 0, sizeof(sending->msg) );
+        sending->msg.msg_iov = sending->iov.data();
+        sending->msg.msg_iovlen = sending->iov.size();
+
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = fd;
+        sqe->addr = (uint64_t)(uintptr_t)&sending->msg;
+        sqe->len = 1;
+        sqe->msg_flags = MSG_NOSIGNAL;
+        sqe->user_data = URING_SEND_TOKEN | (uint64_t)(uintptr_t)sending;
+
+        sending->inFlight = true;
+        return Error::OK;
+    }
+
+    Error SendCancel( Sending* sending ) {
+        io_uring_sqe* sqe = NextSqe();
+        if ( sqe == nullptr ) {
+            return Error::Full;
+        }
+
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = -1;
+        sqe->addr = URING_SEND_TOKEN | (uint64_t)(uintptr_t)sending;
+        sqe->user_data = 0;
+        return Error::OK;
+    }
+
+    Error SetupBuffers( int count, int size ) {
+        unsigned n = 1;
+        while ( n < unsigned(count) && n < URING_MAX_BUFFERS ) {
+            n <<= 1;
+        }
+
+        std::size_t ringSize = n * sizeof(io_uring_buf);
+        void* ring = mmap( 0, ringSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+        if ( ring == MAP_FAILED ) {
+            return Error( errno, strerror(errno) );
+        }
+
+        void* base = mmap( 0, std::size_t(n) * size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+        if ( base == MAP_FAILED ) {
+            Error err( errno, strerror(errno) );
+            munmap( ring, ringSize );
+            return err;
+        }
+
+        io_uring_buf_reg reg;
+        memset( &reg, 0, sizeof(reg) );
+        reg.ring_addr = (uint64_t)(uintptr_t)ring;
+        reg.ring_entries = n;
+        reg.bgid = URING_BUF_GROUP;
+
+        if ( syscall( __NR_io_uring_register, ringfd, IORING_REGISTER_PBUF_RING, &reg, 1 ) < 0 ) {
+            Error err( errno, strerror(errno) );
+            munmap( base, std::size_t(n) * size );
+            munmap( ring, ringSize );
+            return err;
+        }
+
+        bufRing = static_cast<io_uring_buf_ring*>(ring);
+        bufRingSize = ringSize;
+        bufs = static_cast<char*>(base);
+        bufCount = n;
+        bufSize = size;
+
+        for ( unsigned bid = 0; bid < n; bid++ ) {
+            ReturnBuffer( bid );
+        }
+        return Error::OK;
+    }
+
+    char* BufferOf( uint16_t bid ) {
+        return bufs + std::size_t(bid) * bufSize;
+    }
+
+    void ReturnBuffer( uint16_t bid ) {
+        /**
+         * the entries start at the ring, not at `bufs` which c++ lays out
+         * past an empty struct. the tail overlays the last field of the
+         * first entry, it is left alone.
+         **/
+        io_uring_buf* buf = reinterpret_cast<io_uring_buf*>(bufRing) + (bufTail & (bufCount - 1));
+        buf->addr = (uint64_t)(uintptr_t)BufferOf( bid );
+        buf->len = bufSize;
+        buf->bid = bid;
+
+        bufTail++;
+        bufFree++;
+        __atomic_store_n( &bufRing->tail, bufTail, __ATOMIC_RELEASE );
+    }
+
+    /**
+     * Refill
+     * the starved recvs armed again, once an eighth of the buffers is back
+     **/
+    void Refill() {
+        if ( starved.empty() || bufFree == 0 || bufFree < bufCount / 8 ) {
+            return;
+        }
+
+        std::vector<std::pair<int, uint32_t> > list;
+        list.swap( starved );
+        for ( std::size_t i = 0; i < list.size(); i++ ) {
+            Registration& reg( Get(list[i].first) );
+            if ( reg.evt != nullptr && reg.life == list[i].second && reg.starved ) {
+                reg.starved = false;
+                Sync( list[i].first, reg );
+            }
+        }
+    }
+
+    /**
+     * Bind
+     * the registration of fd for evt, a fresh one when it was another's
+     **/
+    Registration& Bind( int fd, Event* evt ) {
+        Registration& reg( Get(fd) );
+        if ( reg.evt != evt ) {
+            Release( fd, reg );
+
+            reg.evt = evt;
+            reg.receiving = bufRing != nullptr || evt == listener;
+        }
+        return reg;
+    }
+
+    /**
+     * Release
+     * drops the poll, the recv and whatever was received for fd
+     **/
+    Error Release( int fd, Registration& reg ) {
+        Error err = PollRemove( fd, reg );
+        Error cancelErr = RecvCancel( fd, reg );
+        if ( err.None() ) {
+            err = cancelErr;
+        }
+
+        for ( std::size_t i = 0; i < reg.received.size(); i++ ) {
+            ReturnBuffer( reg.received[i].bid );
+        }
+        reg.received.clear();
+
+        Sending* sending = reg.sending;
+        if ( sending != nullptr && sending->inFlight ) {
+            // the memory stays pinned till the kernel is done with it
+            Error sendErr = SendCancel( sending );
+            if ( err.None() ) {
+                err = sendErr;
+            }
+            sending->evt = nullptr;
+            orphans.push_back( sending );
+        } else {
+            delete sending;
+        }
+        reg.sending = nullptr;
+
+        reg.evt = nullptr;
+        reg.gen++;
+        reg.life++;
+        reg.receiving = false;
+        reg.starved = false;
+        reg.recvArmed = false;
+        reg.recvCancelling = false;
+        return err;
+    }
+
+    /**
+     * Sync
+     * the poll and the recv of fd brought in line with the interest of its
+     * event. the EPOLLOUT of the write list is the loop's, the reading is
+     * the recv's while it serves the fd.
+     **/
+    Error Sync( int fd, Registration& reg ) {
+        const Event* evt = reg.evt;
+        int mask = (evt->writeQueued ? (evt->events & ~EPOLLOUT) : evt->events) & URING_NOTIFY_MASK;
+
+        bool recv = reg.Serving() && (mask & POLLIN);
+        if ( reg.Serving() ) {
+            mask &= ~(POLLIN | POLLRDHUP);
+        }
+
+        Error err;
+        if ( reg.armed && reg.mask != mask ) {
+            err = PollRemove( fd, reg );
+            reg.gen++;
+        }
+
+        if ( err.None() && !reg.armed && mask != 0 ) {
+            err = PollAdd( fd, reg, mask );
+        }
+
+        if ( err.None() ) {
+            if ( recv && !reg.recvArmed ) {
+                err = RecvAdd( fd, reg );
+            } else if ( !recv ) {
+                err = RecvCancel( fd, reg );
+            }
+        }
+
+        return err;
+    }
+};
+
+/**
+ * Init
+ **/
+Error Init( ContextType* context, const NetIoOptions& opt ) {
+    uringState* us = new uringState;
+
+    io_uring_params params;
+    memset( &params, 0, sizeof(params) );
+    params.flags = IORING_SETUP_CLAMP;
+
+    us->ringfd = syscall( __NR_io_uring_setup, URING_ENTRIES, &params );
+    if ( us->ringfd < 0 ) {
+        delete us;
+        return Error::InitFailed;
+    }
+
+    if ( !(params.features & IORING_FEAT_EXT_ARG) ) {
+        // waiting with a timeout needs linux 5.11
+        delete us;
+        return Error::InitFailed;
+    }
+
+    us->sqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    us->cqSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    if ( params.features & IORING_FEAT_SINGLE_MMAP ) {
+        us->sqSize = us->cqSize = std::max( us->sqSize, us->cqSize );
+    }
+
+    us->sqPtr = mmap( 0, us->sqSize, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, us->ringfd, IORING_OFF_SQ_RING );
+    if ( us->sqPtr == MAP_FAILED ) {
+        delete us;
+        return Error::InitFailed;
+    }
+
+    if ( params.features & IORING_FEAT_SINGLE_MMAP ) {
+        us->cqPtr = us->sqPtr;
+    } else {
+        us->cqPtr = mmap( 0, us->cqSize, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, us->ringfd, IORING_OFF_CQ_RING );
+        if ( us->cqPtr == MAP_FAILED ) {
+            delete us;
+            return Error::InitFailed;
+        }
+    }
+
+    us->sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+    us->sqes = (io_uring_sqe*)mmap( 0, us->sqesSize, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, us->ringfd, IORING_OFF_SQES );
+    if ( us->sqes == MAP_FAILED ) {
+        delete us;
+        return Error::InitFailed;
+    }
+
+    char* sq = static_cast<char*>(us->sqPtr);
+    us->sqHead = (unsigned*)(sq + params.sq_off.head);
+    us->sqTail = (unsigned*)(sq + params.sq_off.tail);
+    us->sqMask = (unsigned*)(sq + params.sq_off.ring_mask);
+    us->sqArray = (unsigned*)(sq + params.sq_off.array);
+    us->sqEntries = params.sq_entries;
+
+    char* cq = static_cast<char*>(us->cqPtr);
+    us->cqHead = (unsigned*)(cq + params.cq_off.head);
+    us->cqTail = (unsigned*)(cq + params.cq_off.tail);
+    us->cqMask = (unsigned*)(cq + params.cq_off.ring_mask);
+    us->cqes = (io_uring_cqe*)(cq + params.cq_off.cqes);
+
+    us->acceptFlags = SOCK_CLOEXEC | (opt.SocketNonBlock ? SOCK_NONBLOCK : 0);
+
+    if ( opt.UringRecvBuffers > 0 && opt.UringRecvBufferSize > 0 ) {
+        Error err = us->SetupBuffers( opt.UringRecvBuffers, opt.UringRecvBufferSize );
+        if ( !err.None() ) {
+            // the sockets are polled and read() then
+            LogWarnf( "io_uring recv buffers unavailable:%s", err.String().c_str() );
+        }
+    }
+
+    *context = us;
+    return Error::OK;
+}
+
+Error Deinit( ContextType context ) {
+    uringState* us = static_cast<uringState*>(context);
+    if ( us != nullptr ) {
+        delete us;
+    }
+
+    return Error::OK;
+}
+
+/**
+ * dispatch()
+ **/
+static void dispatch( Event* evt, Event* listenEvt, int revents, const NetIoOptions& opt ) {
+    if ( evt == listenEvt ) {
+        Error err = Accept( listenEvt, opt );
+        if ( !err.None() ) {
+            LogErrorf( "Accept() failed:%s", err.String().c_str() );
+        }
+        return;
+    }
+
+    if ( revents & (POLLHUP | POLLERR) ) {
+        evt->OnError( Error(revents, "uring events") );
+        evt->Close();
+        return;
+    }
+
+    if ( revents & POLLIN ) {
+        Error err = evt->OnReadable();
+        if ( !err.None() ) {
+            return;
+        }
+    }
+
+    if ( revents & POLLOUT ) {
+        evt->OnWritable();
+    }
+}
+
+/**
+ * received()
+ * a completion of the recv of a socket, or of the accept of the listener
+ **/
+static void received( uringState* us, uint64_t token, int res, unsigned flags, const NetIoOptions& opt ) {
+    int fd = int(token & 0xffffffff);
+    uint32_t life = uint32_t(token >> 32) & URING_GEN_MASK;
+    bool hasBuffer = flags & IORING_CQE_F_BUFFER;
+    uint16_t bid = uint16_t(flags >> IORING_CQE_BUFFER_SHIFT);
+
+    if ( hasBuffer ) {
+        us->bufFree--;
+    }
+
+    uringState::Registration& reg( us->Get(fd) );
+    if ( reg.evt == nullptr || (reg.life & URING_GEN_MASK) != life ) {
+        // the socket went away in between
+        if ( hasBuffer ) {
+            us->ReturnBuffer( bid );
+        }
+        if ( res > 0 && !hasBuffer ) {
+            // the data of a recv always comes in a buffer, this is an accepted socket
+            close( res );
+        }
+        return;
+    }
+
+    if ( !(flags & IORING_CQE_F_MORE) ) {
+        reg.recvArmed = false;
+        reg.recvCancelling = false;
+    }
+
+    Event* evt = reg.evt;
+    if ( evt == us->listener ) {
+        if ( res >= 0 ) {
+            Error err = AcceptSocket( evt, res, opt );
+            if ( !err.None() ) {
+                LogErrorf( "accept connection failed:%s", err.String().c_str() );
+            }
+        } else if ( res == -EINVAL || res == -EOPNOTSUPP ) {
+            // no multishot accept before linux 5.19, the poll and accept4() do
+            us->Get(fd).receiving = false;
+        } else if ( res != -ECANCELED ) {
+            LogErrorf( "io_uring accept failed:%s", strerror(-res) );
+        }
+    } else if ( res > 0 && hasBuffer ) {
+        uringState::Chunk chunk = { bid, 0, uint32_t(res) };
+        reg.received.push_back( chunk );
+    } else {
+        if ( hasBuffer ) {
+            us->ReturnBuffer( bid );
+        }
+
+        if ( res == -ENOBUFS ) {
+            // read() for the time being, armed again when buffers are back
+            reg.starved = true;
+            us->starved.push_back( std::make_pair( fd, reg.life ) );
+        } else if ( res != -ECANCELED ) {
+            // the end or an error, the poll and read() tell it themselves
+            reg.receiving = false;
+        }
+    }
+
+    if ( evt != us->listener && res > 0 && (evt->events & EPOLLIN) ) {
+        evt->OnReadable();
+    }
+
+    // the callback might have closed the event or changed its interest
+    uringState::Registration& after( us->Get(fd) );
+    if ( after.evt == evt && (after.life & URING_GEN_MASK) == life ) {
+        us->Sync( fd, after );
+    }
+}
+
+/**
+ * sent()
+ * a completion of a send, collected by the next Writev() of the event
+ **/
+static void sent( uringState* us, uint64_t token, int res ) {
+    uringState::Sending* sending = (uringState::Sending*)(uintptr_t)(token & ~URING_SEND_TOKEN);
+    sending->inFlight = false;
+    // the kernel is done with the memory
+    sending->pins.clear();
+
+    if ( sending->evt == nullptr ) {
+        us->orphans.erase( std::find( us->orphans.begin(), us->orphans.end(), sending ) );
+        delete sending;
+        return;
+    }
+
+    sending->done = true;
+    sending->result = res == -EAGAIN ? 0 : res;
+
+    Event* evt = sending->evt;
+    if ( !evt->writeQueued ) {
+        evt->SetWritable( true );
+    }
+}
+
+/**
+ * PollOnce()
+ **/
+Error PollOnce( ContextType context, Event* listenEvt, const NetIoOptions& opt ) {
+    uringState* us = static_cast<uringState*>(context);
+
+    if ( us->listener != listenEvt ) {
+        // the listener gets its accept instead of the poll
+        us->listener = listenEvt;
+
+        uringState::Registration& reg( us->Get(listenEvt->fd) );
+        if ( reg.evt == listenEvt ) {
+            reg.receiving = true;
+            us->Sync( listenEvt->fd, reg );
+        }
+    }
+
+    Event::HandleWriteEvents( context );
+    // what was received and left for the lack of room
+    Event::HandleReadEvents( context );
+    us->Refill();
+
+    int timeout = PollTimeout( context, opt );
+    Error err;
+
+    if ( opt.BusyPollUs > 0 && timeout > 0 ) {
+        // submit once, then spin on the completion tail before giving the cpu away
+        err = us->Enter( us->sqPending, 0, 0 );
+        if ( !err.None() ) {
+            return err;
+        }
+
+        int64_t deadline = context->timers.UpdateClock() + opt.BusyPollUs;
+        while ( us->CqEmpty() && context->timers.UpdateClock() < deadline ) {
+        }
+    }
+
+    // submit everything queued since the last round and wait in one go,
+    // no syscall at all when completions are there and nothing is queued
+    if ( us->sqPending > 0 || us->CqEmpty() ) {
+        err = us->Enter( us->sqPending, us->CqEmpty() ? 1 : 0, timeout );
+        if ( !err.None() ) {
+            return err;
+        }
+    }
+
+    // one clock reading for everything done in this round
+    context->timers.UpdateClock();
+
+    unsigned head = *us->cqHead;
+    unsigned tail = __atomic_load_n( us->cqTail, __ATOMIC_ACQUIRE );
+
+    for ( ; head != tail; ++head ) {
+        io_uring_cqe& cqe( us->cqes[head & *us->cqMask] );
+        uint64_t token = cqe.user_data;
+        int revents = cqe.res;
+        unsigned flags = cqe.flags;
+
+        // release the slot before dispatching, callbacks may queue more
+        __atomic_store_n( us->cqHead, head + 1, __ATOMIC_RELEASE );
+
+        if ( token & URING_SEND_TOKEN ) {
+            sent( us, token, revents );
+            continue;
+        }
+
+        if ( token & URING_RECV_TOKEN ) {
+            received( us, token, revents, flags, opt );
+            continue;
+        }
+
+        if ( token == 0 || revents < 0 ) {
+            continue;
+        }
+
+        int fd = int(token & 0xffffffff);
+        uint32_t gen = uint32_t(token >> 32);
+
+        uringState::Registration& reg( us->Get(fd) );
+        if ( reg.evt == nullptr || (reg.gen & URING_GEN_MASK) != gen ) {
+            // completion of a registration replaced or removed in between
+            continue;
+        }
+
+        Event* evt = reg.evt;
+        reg.armed = false;
+        dispatch( evt, listenEvt, revents, opt );
+
+        // the callback might have closed the event or changed its interest
+        uringState::Registration& after( us->Get(fd) );
+        if ( after.evt == evt && (after.gen & URING_GEN_MASK) == gen && !after.armed ) {
+            us->Sync( fd, after );
+        }
+    }
+
+    context->timers.Run();
+
+    return Error::OK;
+}
+
+/**
+ * Attach
+ **/
+Error Event::Attach() {
+    if ( fd == -1 ) {
+        return Error::InitFailed;
+    }
+
+    if ( events == 0 ) {
+        return Error::OK;
+    }
+
+    uringState* us = static_cast<uringState*>(context);
+    return us->Sync( fd, us->Bind( fd, this ) );
+}
+
+Error Event::RemoveNotify() {
+    dequeue();
+
+    uringState* us = static_cast<uringState*>(context);
+    uringState::Registration& reg( us->Get(fd) );
+
+    Error err;
+    if ( reg.evt == this ) {
+        err = us->Release( fd, reg );
+    }
+
+    events = 0;
+    return err;
+}
+
+Error Event::SetReadable( bool flag ) {
+    return operateNotify( EPOLLIN, flag );
+}
+
+ssize_t Event::receive( char* data, std::size_t size ) {
+    uringState* us = static_cast<uringState*>(context);
+    uringState::Registration& reg( us->Get(fd) );
+
+    if ( reg.evt != this || (reg.received.empty() && !reg.Serving()) ) {
+        return read( fd, data, size );
+    }
+
+    std::size_t nread = 0;
+    std::size_t taken = 0;
+    while ( taken < reg.received.size() && nread < size ) {
+        uringState::Chunk& chunk( reg.received[taken] );
+        std::size_t n = std::min( size - nread, std::size_t(chunk.size) );
+
+        memcpy( data + nread, us->BufferOf(chunk.bid) + chunk.offset, n );
+        nread += n;
+        chunk.offset += n;
+        chunk.size -= n;
+
+        if ( chunk.size == 0 ) {
+            us->ReturnBuffer( chunk.bid );
+            taken++;
+        }
+    }
+    reg.received.erase( reg.received.begin(), reg.received.begin() + taken );
+
+    if ( nread == 0 ) {
+        // nothing came yet, the recv is still waiting for it
+        errno = EAGAIN;
+        return -1;
+    }
+
+    if ( !reg.received.empty() ) {
+        // the rest is handed out the next round
+        queueRead();
+    }
+
+    return nread;
+}
+
+ssize_t Event::transmit( const iovec* iov, const Buffer* const* pins, int iovcnt ) {
+    uringState* us = static_cast<uringState*>(context);
+    uringState::Registration& reg( us->Get(fd) );
+
+    if ( reg.evt != this ) {
+        return writev( fd, iov, iovcnt );
+    }
+
+    uringState::Sending* sending = reg.sending;
+    if ( sending == nullptr ) {
+        sending = reg.sending = new uringState::Sending( this );
+    }
+
+    if ( sending->done ) {
+        // the segments start where the ones of the send did
+        sending->done = false;
+        if ( sending->result < 0 ) {
+            errno = -sending->result;
+            return -1;
+        }
+        return sending->result;
+    }
+
+    if ( !sending->inFlight ) {
+        sending->iov.assign( iov, iov + iovcnt );
+        sending->pins.clear();
+        for ( int i = 0; i < iovcnt; i++ ) {
+            sending->pins.push_back( *pins[i] );
+        }
+
+        if ( !us->SendAdd( fd, sending ).None() ) {
+            sending->pins.clear();
+            return writev( fd, iov, iovcnt );
+        }
+    }
+
+    errno = EAGAIN;
+    return -1;
+}
+
+Error Event::operateNotify( int newEvents, bool flag ) {
+    if (flag) {
+        if ( events & newEvents ) {
+            return Error::OK;
+        }
+        events |= newEvents;
+    } else {
+        if ( !(events & newEvents) ) {
+            return Error::OK;
+        }
+        events &= ~newEvents;
+    }
+
+    if ( fd == -1 ) {
+        // would effect when Attached
+        return Error::OK;
+    }
+
+    uringState* us = static_cast<uringState*>(context);
+    uringState::Registration& reg( us->Bind( fd, this ) );
+
+    Error err = us->Sync( fd, reg );
+    if ( (events & EPOLLIN) && !reg.received.empty() ) {
+        // received while reading was off
+        queueRead();
+    }
+
+    return err;
+}
+
+}}
+
+#endif
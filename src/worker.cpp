@@ -0,0 +1,112 @@
+
+#include "worker.h"
+#include "connections.h"
+#include "metric.h"
+
+namespace rp {
+
+Error Worker::newClientConnection( Connection** pconn ) {
+    Connection* conn = nullptr;
+    Error err = connPool_.CreateConnection( &conn );
+    if ( !err.None() ) {
+        return err; 
+    }
+
+    Session* sess;
+    err = sessPool_.CreateSession( &sess, conn );
+    if ( !err.None() ) {
+        return err; 
+    }
+
+    err = sess->OnNewClientConnection( conn );
+    if ( !err.None() ) { 
+        return err; 
+    }
+
+    *pconn = conn;
+    return Error::OK;
+}
+
+enum {
+    METRIC_UPDATE_INTERVAL  = 5000,
+};
+
+void Worker::onMetricTimer() {
+    //MetricFactoryInstance->PrintInfo();
+    listenEvt_.Timers().Start( &metricTimer_, METRIC_UPDATE_INTERVAL );
+}
+
+Error Worker::Init( const Worker* leader ) {
+    MetricFactoryInstance = &metrics_;
+
+    {
+        using namespace std::placeholders;
+        listenOpt_.NewConnectionHandler = std::bind( &Worker::newClientConnection, this, _1 );
+    }
+
+    Error err = io::Init( &listenEvt_.context, listenOpt_ );
+    if ( !err.None() ) {
+        return err;
+    }
+
+    err = connPool_.Init( listenEvt_.context );
+    if ( !err.None() ) {
+        return err;
+    }
+
+    resolver_ = new io::Resolver( listenEvt_.context );
+    err = resolver_->Init( serverOpt_.UpstreamOpt->NetOpt );
+    if ( !err.None() ) {
+        return err;
+    }
+    listenEvt_.context->resolver = resolver_;
+
+    io::Addr addr(serverOpt_.BindHost.c_str(), serverOpt_.BindPort);
+    if ( addr.IsUnix() && leader != nullptr ) {
+        // no SO_REUSEPORT for unix sockets, all the loops watch one
+        err = io::ListenShared( &listenEvt_, &leader->listenEvt_ );
+    } else {
+        err = io::Listen( &listenEvt_, addr, listenOpt_ );
+    }
+    if ( !err.None() ) {
+        return err;
+    }
+
+    err = upstreamPool_.Init();
+    if ( !err.None() ) {
+        return err;
+    }
+
+    metricTimer_.SetCallback( std::bind(&Worker::onMetricTimer, this) );
+    listenEvt_.Timers().Start( &metricTimer_, METRIC_UPDATE_INTERVAL );
+
+    return Error::OK;
+}
+
+Error Worker::RunOnce() {
+    //TimeSumMetric* pollMetric = MetricFactoryInstance->FetchTimeSum( "poll" );
+
+    //pollMetric->TimingBegin();
+    Error err = io::PollOnce( listenEvt_.context, &listenEvt_, listenOpt_ );
+    //pollMetric->Inc();
+
+    if ( !err.None() ) {
+        // handle the error
+        return err;
+    }
+
+    return Error::OK;
+}
+
+Error Worker::Run() {
+    MetricFactoryInstance = &metrics_;
+
+    while( !stopped_ ) {
+        Error err = RunOnce();
+        if ( !err.None() ) { return err; }
+    }
+
+    return Error::OK;
+}
+
+}
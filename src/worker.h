@@ -0,0 +1,74 @@
+
+#ifndef __RP_WORKER_H__
+#define __RP_WORKER_H__
+
+#include <atomic>
+
+#include "io.h"
+#include "connections.h"
+#include "session.h"
+#include "options.h"
+#include "metric.h"
+#include "timer.h"
+#include "resolver.h"
+
+namespace rp {
+
+/**
+ * Worker
+ * one event loop with everything it drives: the listener,
+ * client connections, sessions and the upstream links.
+ * nothing is shared between workers except the read-only options.
+ **/
+class Worker {
+public:
+    Worker( int index, const ProxyOptions& opt ) : index_(index), serverOpt_(opt), 
+        listenOpt_(opt.ClientOpt->NetOpt), listenEvt_(nullptr), resolver_(nullptr),
+        connPool_(*opt.ClientOpt), upstreamPool_(opt, &connPool_), 
+        sessPool_(opt, &upstreamPool_), stopped_(false) {}
+
+public:
+    /**
+     * `leader` is the first worker, the others share its listener
+     * when the address can not be bound more than once.
+     **/
+    Error Init( const Worker* leader = nullptr );
+    Error RunOnce();
+    /**
+     * loops until an error or Stop(), which takes effect within PollTimeout
+     **/
+    Error Run();
+    void Stop() { stopped_ = true; }
+
+public:
+    int Index() const { return index_; }
+
+private:
+    Error newClientConnection( Connection** pconn );
+    void onMetricTimer();
+
+private:
+    int index_;
+    const ProxyOptions& serverOpt_;
+
+    /**
+     * private copy, the NewConnectionHandler is bound to this worker
+     **/
+    io::NetIoOptions    listenOpt_;
+    io::Event   listenEvt_;
+    io::Resolver*   resolver_;
+
+    ConnectionPool  connPool_;
+    UpstreamPool    upstreamPool_;
+    SessionPool sessPool_;
+
+    MetricFactory   metrics_;
+    Timer   metricTimer_;
+
+    // set from another thread
+    std::atomic<bool>   stopped_;
+};
+
+}
+
+#endif